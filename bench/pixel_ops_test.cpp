@@ -0,0 +1,212 @@
+// Checks the PackBits and channel interleaving kernels of pixel_ops, in every
+// version the host can run, against the plain loops the reader used before
+// them. Random, truncated, overlong and short streams are all covered.
+//
+//   make test
+//
+// The kernels are static, so pixel_ops.cpp is compiled into the test.
+
+#include "../src/pixel_ops.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// the decoder the reader used before pixel_ops had one
+static bool reference_unpack_bits(const uint8_t * in, size_t in_size, uint8_t * out, size_t out_size)
+{
+	size_t i = 0;
+	size_t o = 0;
+	while (o < out_size && i < in_size) {
+		int n = (int8_t) in[i++];
+		if (n >= 0) {
+			size_t count = n + 1;
+			if (count > in_size - i || count > out_size - o)
+				return false;
+			memcpy(out + o, in + i, count);
+			i += count;
+			o += count;
+		} else if (n != -128) {
+			size_t count = 1 - n;
+			if (i >= in_size || count > out_size - o)
+				return false;
+			memset(out + o, in[i++], count);
+			o += count;
+		}
+	}
+	return o == out_size;
+}
+
+static bool packbits_scalar(const uint8_t * in, size_t in_size, uint8_t * out, size_t out_size)
+{
+	return packbits_decode_scalar(in, in_size, out, out_size, 0, 0);
+}
+
+struct packbits_variant {
+	const char * name;
+	packbits_decode_fn decode;
+};
+
+struct planar_variant {
+	const char * name;
+	planar_to_argb_fn convert;
+};
+
+static uint32_t random_state = 1;
+
+static uint32_t next_random()
+{
+	// xorshift32, so that runs are the same everywhere
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+	return random_state;
+}
+
+// Encodes data as runs and literals of random lengths, with some -128
+// no-ops, the way an encoder may split them
+static void packbits_encode(const std::vector<uint8_t> & data, std::vector<uint8_t> & out)
+{
+	out.clear();
+	size_t i = 0;
+	while (i < data.size()) {
+		if (next_random() % 16 == 0)
+			out.push_back(0x80);
+		size_t run = 1;
+		while (i + run < data.size() && run < 128 && data[i + run] == data[i])
+			run++;
+		if (run >= 2) {
+			out.push_back((uint8_t) (1 - (int) run));
+			out.push_back(data[i]);
+		} else {
+			size_t count = 1 + next_random() % 128;
+			if (count > data.size() - i)
+				count = data.size() - i;
+			out.push_back((uint8_t) (count - 1));
+			out.insert(out.end(), data.begin() + i, data.begin() + i + count);
+			run = count;
+		}
+		i += run;
+	}
+}
+
+// long runs, short runs and noise mixed, so that every branch is taken
+static void random_plane(std::vector<uint8_t> & data, size_t size)
+{
+	data.resize(size);
+	size_t i = 0;
+	while (i < size) {
+		size_t length = 1 + next_random() % 300;
+		if (length > size - i)
+			length = size - i;
+		bool run = next_random() % 2 == 0;
+		uint8_t value = next_random();
+		for (size_t k = 0; k < length; k++)
+			data[i + k] = run? value : (uint8_t) next_random();
+		i += length;
+	}
+}
+
+static const size_t guard_size = 64;
+static const uint8_t guard_byte = 0xa5;
+
+static int failures = 0;
+
+static void check_packbits(const packbits_variant * variants, size_t variant_count, const std::vector<uint8_t> & in, size_t out_size, const char * kind)
+{
+	std::vector<uint8_t> expected(out_size);
+	bool expected_ok = reference_unpack_bits(in.data(), in.size(), expected.data(), out_size);
+
+	for (size_t v = 0; v < variant_count; v++) {
+		// exact-size input so that reads past it show up under a sanitizer
+		std::vector<uint8_t> input(in);
+		std::vector<uint8_t> out(out_size + guard_size, guard_byte);
+		bool ok = variants[v].decode(input.empty()? NULL : input.data(), input.size(), out.data(), out_size);
+		bool same = ok == expected_ok && (!ok || out_size == 0 || memcmp(out.data(), expected.data(), out_size) == 0);
+		for (size_t k = 0; k < guard_size; k++)
+			same = same && out[out_size + k] == guard_byte;
+		if (!same) {
+			fprintf(stderr, "packbits_decode %s: %s stream of %zu bytes into %zu differs from the reference\n",
+			        variants[v].name, kind, in.size(), out_size);
+			failures++;
+		}
+	}
+}
+
+static void check_planar(const planar_variant * variants, size_t variant_count, size_t count)
+{
+	std::vector<uint8_t> planes[4];
+	for (int p = 0; p < 4; p++) {
+		planes[p].resize(count);
+		for (size_t i = 0; i < count; i++)
+			planes[p][i] = next_random();
+	}
+	std::vector<uint32_t> expected(count);
+	for (size_t i = 0; i < count; i++)
+		expected[i] = (uint32_t) planes[3][i] << 24 | (uint32_t) planes[0][i] << 16 | (uint32_t) planes[1][i] << 8 | planes[2][i];
+
+	for (size_t v = 0; v < variant_count; v++) {
+		std::vector<uint32_t> out(count + 4, 0xdeadbeef);
+		variants[v].convert(planes[0].data(), planes[1].data(), planes[2].data(), planes[3].data(), count, out.data());
+		bool same = count == 0 || memcmp(out.data(), expected.data(), count * 4) == 0;
+		for (size_t k = count; k < count + 4; k++)
+			same = same && out[k] == 0xdeadbeef;
+		if (!same) {
+			fprintf(stderr, "planar_to_argb %s: %zu pixels differ from the reference\n", variants[v].name, count);
+			failures++;
+		}
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	int rounds = argc > 1? atoi(argv[1]) : 2000;
+
+	std::vector<packbits_variant> packbits;
+	std::vector<planar_variant> planar;
+	packbits.push_back(packbits_variant { "scalar", packbits_scalar });
+	planar.push_back(planar_variant { "scalar", planar_to_argb_scalar });
+#ifdef PIXEL_OPS_SSE2
+	packbits.push_back(packbits_variant { "sse2", packbits_decode_sse2 });
+	planar.push_back(planar_variant { "sse2", planar_to_argb_sse2 });
+#endif
+#ifdef PIXEL_OPS_AVX2
+	if (cpu_has_avx2()) {
+		packbits.push_back(packbits_variant { "avx2", packbits_decode_avx2 });
+		planar.push_back(planar_variant { "avx2", planar_to_argb_avx2 });
+	}
+#endif
+
+	std::vector<uint8_t> data;
+	std::vector<uint8_t> stream;
+	for (int round = 0; round < rounds; round++) {
+		size_t size = next_random() % 4096;
+		random_plane(data, size);
+		packbits_encode(data, stream);
+
+		check_packbits(packbits.data(), packbits.size(), stream, size, "valid");
+		// output larger or smaller than the stream decodes to
+		check_packbits(packbits.data(), packbits.size(), stream, size + 1 + next_random() % 200, "short");
+		if (size > 0)
+			check_packbits(packbits.data(), packbits.size(), stream, next_random() % size, "overlong");
+		// cut anywhere, headers and runs included
+		if (!stream.empty()) {
+			std::vector<uint8_t> truncated(stream.begin(), stream.begin() + next_random() % stream.size());
+			check_packbits(packbits.data(), packbits.size(), truncated, size, "truncated");
+		}
+		// bytes that were never PackBits
+		std::vector<uint8_t> noise(next_random() % 2048);
+		for (size_t i = 0; i < noise.size(); i++)
+			noise[i] = next_random();
+		check_packbits(packbits.data(), packbits.size(), noise, next_random() % 8192, "random");
+
+		check_planar(planar.data(), planar.size(), next_random() % 1100);
+	}
+
+	printf("pixel_ops: %d rounds of", rounds);
+	for (size_t v = 0; v < packbits.size(); v++)
+		printf(" %s", packbits[v].name);
+	printf(", %d failures\n", failures);
+	return failures == 0? 0 : 1;
+}
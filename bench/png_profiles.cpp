@@ -0,0 +1,89 @@
+// Time and size of every PNG encode profile on synthetic sprite-like layers:
+// mostly transparent canvases with flat shapes, gradients and some noise.
+//
+//   make bench-png
+
+#include "psd_parser.h"
+#include "psd_png.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+struct bench_image {
+	const char * name;
+	int width;
+	int height;
+	std::vector<unsigned char> rgba;
+};
+
+static void make_sprite(bench_image & image, unsigned seed)
+{
+	image.rgba.assign((size_t) image.width * image.height * 4, 0);
+	srand(seed);
+	int cx = image.width / 2;
+	int cy = image.height / 2;
+	int radius = (image.width < image.height? image.width : image.height) * 2 / 5;
+	for (int y = 0; y < image.height; y++) {
+		for (int x = 0; x < image.width; x++) {
+			int dx = x - cx;
+			int dy = y - cy;
+			if (dx * dx + dy * dy > radius * radius)
+				continue;
+			unsigned char * p = &image.rgba[((size_t) y * image.width + x) * 4];
+			p[0] = (unsigned char) (x * 255 / image.width);
+			p[1] = (unsigned char) (y * 255 / image.height);
+			p[2] = (unsigned char) ((dx * dy) & 0x3f) + (rand() & 0x7);
+			p[3] = 255;
+		}
+	}
+}
+
+static void make_noise(bench_image & image, unsigned seed)
+{
+	image.rgba.resize((size_t) image.width * image.height * 4);
+	srand(seed);
+	for (size_t i = 0; i < image.rgba.size(); i++)
+		image.rgba[i] = (unsigned char) rand();
+}
+
+int main(int argc, char ** argv)
+{
+	int repeat = argc > 1? atoi(argv[1]) : 5;
+	if (repeat < 1)
+		repeat = 1;
+
+	std::vector<bench_image> images(3);
+	images[0].name = "sprite256";
+	images[0].width = images[0].height = 256;
+	make_sprite(images[0], 1);
+	images[1].name = "sprite2048";
+	images[1].width = images[1].height = 2048;
+	make_sprite(images[1], 2);
+	images[2].name = "noise512";
+	images[2].width = images[2].height = 512;
+	make_noise(images[2], 3);
+
+	static const char * const profile_names[] = { "default", "fast", "store", "small" };
+	static const int profiles[] = { psd_png_default, psd_png_fast, psd_png_store, psd_png_small };
+
+	printf("%-12s %-8s %12s %12s %10s\n", "image", "profile", "ms/encode", "bytes", "MB/s");
+	for (size_t i = 0; i < images.size(); i++) {
+		const bench_image & image = images[i];
+		for (size_t p = 0; p < sizeof(profiles) / sizeof(profiles[0]); p++) {
+			std::vector<unsigned char> png;
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			for (int r = 0; r < repeat; r++) {
+				if (!psd_png_encode(image.rgba.data(), image.width, image.height, profiles[p], png)) {
+					fprintf(stderr, "%s: %s encoding failed\n", image.name, profile_names[p]);
+					return 1;
+				}
+			}
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / repeat;
+			double mb = image.rgba.size() / (1024.0 * 1024.0);
+			printf("%-12s %-8s %12.2f %12zu %10.1f\n", image.name, profile_names[p], ms, png.size(), mb / (ms / 1000.0));
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,291 @@
+// Times the import path on generated PSDs of various sizes, layer counts,
+// nesting depths and channel compressions, and prints the results as JSON.
+//
+//   make bench                  # writes bench_results.json
+//   bench/psd_bench [-q] [-j threads] [-d tmpdir] [-o results.json]
+//
+// Stages, each with its wall time and the peak RSS reached during it:
+//   parse_eager  libpsd parse, which decodes every layer; left out of the
+//                16-bit cases libpsd cannot read
+//   composite    psd_composite_load, the flattened image alone
+//   parse        lazy parse, layer records only
+//   frame_names  walk of the animation groups, as get_sprite_frame_names
+//   decode       pixels of every layer, from the lazy document
+//   decode_native  the same at the depth of the file, without the dithering
+//                down to bytes, for 16-bit cases only
+//   encode       PNG encoding of the decoded layers, in memory
+//   encode_etc2  the same layers as ETC2 StreamTextures, in memory
+//   export       psd_document_export_layers from the lazy document
+//
+// Peak RSS is per stage where the kernel lets it be reset, see per_stage_rss.
+
+#include "psd_parser.h"
+#include "psd_png.h"
+#include "psd_stex.h"
+#include "synth_psd.h"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+struct bench_case {
+	const char * name;
+	synth_psd_config config;
+};
+
+static const bench_case cases[] = {
+	{ "small_flat_rle", { 512, 512, 16, 0, 0, true, 8 } },
+	{ "small_flat_raw", { 512, 512, 16, 0, 0, false, 8 } },
+	{ "medium_groups_rle", { 2048, 2048, 32, 4, 1, true, 8 } },
+	{ "medium_groups_raw", { 2048, 2048, 32, 4, 1, false, 8 } },
+	{ "medium_groups_rle_16", { 2048, 2048, 32, 4, 1, true, 16 } },
+	{ "medium_nested_rle", { 2048, 2048, 128, 8, 3, true, 8 } },
+	{ "large_rle", { 4096, 4096, 16, 2, 2, true, 8 } },
+};
+
+static const size_t quick_cases = 2;
+
+// Linux resets the peak RSS when 5 is written to clear_refs. Where that is
+// not possible the reported peaks are process-wide, which the results say.
+static bool reset_peak_rss()
+{
+	FILE * fp = fopen("/proc/self/clear_refs", "w");
+	if (fp == NULL)
+		return false;
+	bool written = fputs("5", fp) >= 0;
+	return fclose(fp) == 0 && written;
+}
+
+static long peak_rss_kb()
+{
+	FILE * fp = fopen("/proc/self/status", "r");
+	if (fp) {
+		char line[256];
+		while (fgets(line, sizeof(line), fp)) {
+			if (strncmp(line, "VmHWM:", 6) == 0) {
+				fclose(fp);
+				return atol(line + 6);
+			}
+		}
+		fclose(fp);
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+class stage_timer {
+public:
+	stage_timer() { reset_peak_rss(); m_start = std::chrono::steady_clock::now(); }
+
+	// "name": {"ms": ..., "peak_rss_kb": ...}
+	std::string json(const char * name) const
+	{
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_start).count();
+		char out[256];
+		snprintf(out, sizeof(out), "\"%s\": {\"ms\": %.3f, \"peak_rss_kb\": %ld}", name, ms, peak_rss_kb());
+		return out;
+	}
+
+private:
+	std::chrono::steady_clock::time_point m_start;
+};
+
+static struct psd_document * parse(const std::string & path, bool lazy)
+{
+	struct psd_parse_options options;
+	psd_parse_options_init(&options);
+	options.lazy = lazy;
+	struct psd_parser * parser = psd_parser_new(path.c_str());
+	struct psd_document * doc = psd_parser_parse_with_options(parser, &options);
+	psd_parser_free(parser);
+	return doc;
+}
+
+static int count_frame_names(const struct psd_document * doc)
+{
+	int n = 0;
+	struct psd_node_iter animations;
+	psd_node_iter_children(&animations, doc, -1);
+	for (const struct psd_node * animation = psd_node_iter_next(&animations); animation; animation = psd_node_iter_next(&animations)) {
+		if (!animation->is_group)
+			continue;
+		struct psd_node_iter frames;
+		psd_node_iter_children(&frames, doc, psd_document_node_index(doc, animation));
+		for (const struct psd_node * frame = psd_node_iter_next(&frames); frame; frame = psd_node_iter_next(&frames))
+			n += psd_document_node_name(doc, frame)[0] != 0;
+	}
+	return n;
+}
+
+static bool run_case(const bench_case & bench, const std::string & tmp_dir, int threads, std::string & json)
+{
+	std::string path = tmp_dir + "/" + bench.name + ".psd";
+	std::string out_dir = tmp_dir + "/" + bench.name;
+	if (!synth_psd_write(path, bench.config)) {
+		fprintf(stderr, "%s: cannot write %s\n", bench.name, path.c_str());
+		return false;
+	}
+
+	struct stat st;
+	stat(path.c_str(), &st);
+
+	const synth_psd_config & c = bench.config;
+	char header[512];
+	snprintf(header, sizeof(header),
+	         "{\"name\": \"%s\", \"width\": %d, \"height\": %d, \"layers\": %d, \"groups\": %d, \"depth\": %d, "
+	         "\"bits\": %d, \"compression\": \"%s\", \"file_bytes\": %lld, \"stages\": {",
+	         bench.name, c.width, c.height, c.layers, c.groups, c.depth, c.bits, c.rle? "rle" : "raw", (long long) st.st_size);
+	json = header;
+
+	std::vector<std::string> stages;
+	{
+		stage_timer timer;
+		struct psd_document * doc = parse(path, false);
+		if (doc == NULL && c.bits == 8) {
+			fprintf(stderr, "%s: libpsd cannot parse it\n", bench.name);
+			return false;
+		}
+		if (doc) {
+			stages.push_back(timer.json("parse_eager"));
+			psd_document_free(doc);
+		}
+	}
+
+	{
+		// the flattened image alone, for comparison with parse + decode
+		stage_timer timer;
+		struct psd_composite composite;
+		if (psd_composite_load(path.c_str(), &composite) != 0) {
+			fprintf(stderr, "%s: cannot read the composite\n", bench.name);
+			return false;
+		}
+		stages.push_back(timer.json("composite"));
+		psd_composite_free(&composite);
+	}
+
+	stage_timer parse_timer;
+	struct psd_document * doc = parse(path, true);
+	if (doc == NULL) {
+		fprintf(stderr, "%s: cannot parse it lazily\n", bench.name);
+		return false;
+	}
+	stages.push_back(parse_timer.json("parse"));
+
+	stage_timer names_timer;
+	count_frame_names(doc);
+	stages.push_back(names_timer.json("frame_names"));
+
+	int n_layers = psd_document_pixel_layer_count(doc);
+	std::vector<std::vector<unsigned char> > pixels(n_layers);
+	std::vector<struct psd_pixel_layer_info> infos(n_layers);
+	stage_timer decode_timer;
+	for (int i = 0; i < n_layers; i++) {
+		psd_document_pixel_layer_info(doc, i, &infos[i]);
+		pixels[i].resize((size_t) infos[i].width * infos[i].height * 4);
+		psd_document_pixel_layer_read_rgba(doc, i, pixels[i].data());
+	}
+	stages.push_back(decode_timer.json("decode"));
+
+	if (c.bits > 8) {
+		struct psd_pixel_format format;
+		psd_document_native_pixel_format(doc, &format);
+		std::vector<unsigned char> samples;
+		stage_timer native_timer;
+		for (int i = 0; i < n_layers; i++) {
+			samples.resize(psd_document_pixel_layer_size(doc, i, &format));
+			psd_document_pixel_layer_read(doc, i, &format, samples.data());
+		}
+		stages.push_back(native_timer.json("decode_native"));
+	}
+
+	stage_timer encode_timer;
+	std::vector<unsigned char> png;
+	for (int i = 0; i < n_layers; i++)
+		psd_png_encode(pixels[i].data(), infos[i].width, infos[i].height, psd_png_default, png);
+	stages.push_back(encode_timer.json("encode"));
+
+	stage_timer etc2_timer;
+	std::vector<unsigned char> stex;
+	for (int i = 0; i < n_layers; i++)
+		psd_stex_encode(pixels[i].data(), infos[i].width, infos[i].height, psd_texture_etc2, threads, stex);
+	stages.push_back(etc2_timer.json("encode_etc2"));
+	pixels.clear();
+
+	struct psd_export_options options;
+	psd_export_options_init(&options);
+	options.threads = threads;
+	stage_timer export_timer;
+	bool exported = psd_document_export_layers(doc, out_dir.c_str(), &options, NULL) >= 0;
+	stages.push_back(export_timer.json("export"));
+	psd_document_free(doc);
+	if (!exported) {
+		fprintf(stderr, "%s: export failed\n", bench.name);
+		return false;
+	}
+
+	for (size_t i = 0; i < stages.size(); i++)
+		json += (i? ", " : "") + stages[i];
+	json += "}}";
+	remove(path.c_str());
+	return true;
+}
+
+int main(int argc, char ** argv)
+{
+	bool quick = false;
+	int threads = 0;
+	std::string tmp_dir = "bench/tmp";
+	std::string out_path;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-q") == 0)
+			quick = true;
+		else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+			tmp_dir = argv[++i];
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+			out_path = argv[++i];
+		else {
+			fprintf(stderr, "usage: %s [-q] [-j threads] [-d tmpdir] [-o results.json]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if (mkdir(tmp_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "cannot create %s\n", tmp_dir.c_str());
+		return 1;
+	}
+
+	size_t n_cases = quick? quick_cases : sizeof(cases) / sizeof(cases[0]);
+	std::string results = "{\"format\": 1, \"threads\": " + std::to_string(threads)
+	                      + ", \"per_stage_rss\": " + (reset_peak_rss()? "true" : "false") + ", \"cases\": [\n";
+	int n_failed = 0;
+	for (size_t i = 0; i < n_cases; i++) {
+		fprintf(stderr, "%s...\n", cases[i].name);
+		std::string json;
+		if (!run_case(cases[i], tmp_dir, threads, json)) {
+			n_failed++;
+			continue;
+		}
+		results += (results.back() == '\n'? "\t" : ",\n\t") + json;
+	}
+	results += "\n]}\n";
+
+	if (out_path.empty()) {
+		std::cout << results;
+	} else {
+		std::ofstream out(out_path.c_str(), std::ios::trunc);
+		out << results;
+	}
+	return n_failed? 1 : 0;
+}
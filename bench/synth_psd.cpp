@@ -0,0 +1,258 @@
+#include "synth_psd.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+namespace {
+
+class byte_writer {
+public:
+	std::vector<uint8_t> bytes;
+
+	void u8(uint8_t v) { bytes.push_back(v); }
+	void u16(uint16_t v) { u8(v >> 8); u8(v & 0xff); }
+	void u32(uint32_t v) { u16(v >> 16); u16(v & 0xffff); }
+	void raw(const void * data, size_t size) { bytes.insert(bytes.end(), (const uint8_t *) data, (const uint8_t *) data + size); }
+	void key(const char * k) { raw(k, 4); }
+	void append(const byte_writer & other) { raw(other.bytes.data(), other.bytes.size()); }
+};
+
+void pack_bits(const uint8_t * row, int width, byte_writer & out)
+{
+	int i = 0;
+	while (i < width) {
+		int run = 1;
+		while (i + run < width && run < 128 && row[i + run] == row[i])
+			run++;
+		if (run >= 2) {
+			out.u8((uint8_t) (1 - run));
+			out.u8(row[i]);
+			i += run;
+			continue;
+		}
+		int literal = 1;
+		while (i + literal < width && literal < 128
+		       && !(i + literal + 1 < width && row[i + literal] == row[i + literal + 1]))
+			literal++;
+		out.u8((uint8_t) (literal - 1));
+		out.raw(row + i, literal);
+		i += literal;
+	}
+}
+
+// compression tag and data of one channel plane
+void write_channel(const std::vector<uint8_t> & plane, int width, int height, bool rle, byte_writer & out)
+{
+	if (!rle || width == 0) {
+		out.u16(0);
+		out.raw(plane.data(), plane.size());
+		return;
+	}
+	std::vector<byte_writer> rows(height);
+	for (int y = 0; y < height; y++)
+		pack_bits(&plane[(size_t) y * width], width, rows[y]);
+	out.u16(1);
+	for (int y = 0; y < height; y++)
+		out.u16((uint16_t) rows[y].bytes.size());
+	for (int y = 0; y < height; y++)
+		out.append(rows[y]);
+}
+
+struct synth_layer {
+	std::string name;
+	int section; // 0 pixels, 1 folder, 3 divider
+	int top;
+	int left;
+	int bottom;
+	int right;
+	int seed;
+};
+
+// big-endian samples of bits per channel
+void put_sample(std::vector<uint8_t> & plane, size_t i, int bits, int value, int range)
+{
+	if (bits == 16) {
+		uint16_t sample = (uint16_t) ((int64_t) value * 65535 / range);
+		plane[i * 2] = sample >> 8;
+		plane[i * 2 + 1] = sample & 0xff;
+	} else {
+		plane[i] = (uint8_t) (value * 255 / range);
+	}
+}
+
+// a sprite-like disc with a gradient on a transparent background
+void layer_planes(const synth_layer & layer, int bits, std::vector<uint8_t> planes[4])
+{
+	int width = layer.right - layer.left;
+	int height = layer.bottom - layer.top;
+	for (int c = 0; c < 4; c++)
+		planes[c].assign((size_t) width * height * (bits / 8), 0);
+
+	int cx = width / 2 + (layer.seed * 7) % (width / 8 + 1);
+	int cy = height / 2;
+	int radius = (width < height? width : height) / 3;
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			int dx = x - cx;
+			int dy = y - cy;
+			if (dx * dx + dy * dy > radius * radius)
+				continue;
+			size_t i = (size_t) y * width + x;
+			put_sample(planes[0], i, bits, x, width);
+			put_sample(planes[1], i, bits, y, height);
+			put_sample(planes[2], i, bits, (layer.seed * 37) & 0xff, 255);
+			put_sample(planes[3], i, bits, 1, 1);
+		}
+	}
+}
+
+// layers of a quarter of the canvas each, at scattered offsets
+void add_frames(const synth_psd_config & config, int first, int count, std::vector<synth_layer> & out)
+{
+	for (int i = first; i < first + count; i++) {
+		char layer_name[32];
+		snprintf(layer_name, sizeof(layer_name), "frame%d", i - first);
+		int w = config.width / 2;
+		int h = config.height / 2;
+		int left = (i * 13) % (config.width - w + 1);
+		int top = (i * 29) % (config.height - h + 1);
+		synth_layer layer = { layer_name, 0, top, left, top + h, left + w, i };
+		out.push_back(layer);
+	}
+}
+
+// records are bottom-up: the divider, the content, then the named folder
+void add_group(const synth_psd_config & config, int depth, int first, int count, const std::string & name,
+               std::vector<synth_layer> & out)
+{
+	synth_layer divider = { "</Layer group>", 3, 0, 0, 0, 0, 0 };
+	out.push_back(divider);
+	if (depth > 1)
+		add_group(config, depth - 1, first, count, name + "_sub", out);
+	else
+		add_frames(config, first, count, out);
+	synth_layer folder = { name, 1, 0, 0, 0, 0, 0 };
+	out.push_back(folder);
+}
+
+}
+
+bool synth_psd_write(const std::string & path, const synth_psd_config & config)
+{
+	std::vector<synth_layer> layers;
+	if (config.groups <= 0) {
+		add_frames(config, 0, config.layers, layers);
+	} else {
+		int per_group = config.layers / config.groups;
+		for (int g = 0; g < config.groups; g++) {
+			int count = g + 1 == config.groups? config.layers - per_group * g : per_group;
+			char name[32];
+			snprintf(name, sizeof(name), "anim%d", g);
+			add_group(config, config.depth > 0? config.depth : 1, per_group * g, count, name, layers);
+		}
+	}
+
+	int sample_size = config.bits / 8;
+	byte_writer records;
+	byte_writer channel_data;
+	records.u16((uint16_t) layers.size());
+	for (size_t i = 0; i < layers.size(); i++) {
+		const synth_layer & layer = layers[i];
+		int width = layer.right - layer.left;
+		int height = layer.bottom - layer.top;
+
+		std::vector<uint8_t> planes[4];
+		layer_planes(layer, config.bits, planes);
+		static const int ids[4] = { 0, 1, 2, -1 };
+		byte_writer channels[4];
+		for (int c = 0; c < 4; c++)
+			write_channel(planes[c], width * sample_size, height, config.rle, channels[c]);
+
+		records.u32(layer.top);
+		records.u32(layer.left);
+		records.u32(layer.bottom);
+		records.u32(layer.right);
+		records.u16(4);
+		for (int c = 0; c < 4; c++) {
+			records.u16((uint16_t) ids[c]);
+			records.u32((uint32_t) channels[c].bytes.size());
+			channel_data.append(channels[c]);
+		}
+		records.key("8BIM");
+		records.key("norm");
+		records.u8(255); // opacity
+		records.u8(0); // clipping
+		records.u8(layer.section == 3? 0x02 : 0); // flags
+		records.u8(0);
+
+		byte_writer extra;
+		extra.u32(0); // mask
+		extra.u32(0); // blending ranges
+		size_t name_length = layer.name.size() < 255? layer.name.size() : 255;
+		extra.u8((uint8_t) name_length);
+		extra.raw(layer.name.data(), name_length);
+		while ((name_length + 1) % 4) {
+			extra.u8(0);
+			name_length++;
+		}
+		if (layer.section) {
+			extra.key("8BIM");
+			extra.key("lsct");
+			extra.u32(4);
+			extra.u32(layer.section);
+		}
+		records.u32((uint32_t) extra.bytes.size());
+		records.append(extra);
+	}
+
+	byte_writer layer_info;
+	layer_info.append(records);
+	layer_info.append(channel_data);
+	if (layer_info.bytes.size() % 2)
+		layer_info.u8(0);
+
+	byte_writer file;
+	file.key("8BPS");
+	file.u16(1);
+	file.raw("\0\0\0\0\0\0", 6);
+	file.u16(4);
+	file.u32(config.height);
+	file.u32(config.width);
+	file.u16(config.bits);
+	file.u16(3); // RGB
+	file.u32(0); // color mode data
+	file.u32(0); // image resources
+	if (config.bits == 8) {
+		file.u32((uint32_t) (4 + layer_info.bytes.size() + 4));
+		file.u32((uint32_t) layer_info.bytes.size());
+		file.append(layer_info);
+		file.u32(0); // global layer mask
+	} else {
+		file.u32((uint32_t) (4 + 4 + 12 + layer_info.bytes.size()));
+		file.u32(0); // empty layer info
+		file.u32(0); // global layer mask
+		file.key("8BIM");
+		file.key("Lr16");
+		file.u32((uint32_t) layer_info.bytes.size());
+		file.append(layer_info);
+	}
+
+	// transparent merged image, PackBits
+	std::vector<uint8_t> empty_row((size_t) config.width * sample_size, 0);
+	byte_writer packed_row;
+	pack_bits(empty_row.data(), (int) empty_row.size(), packed_row);
+	file.u16(1);
+	for (int r = 0; r < config.height * 4; r++)
+		file.u16((uint16_t) packed_row.bytes.size());
+	for (int r = 0; r < config.height * 4; r++)
+		file.append(packed_row);
+
+	FILE * fp = fopen(path.c_str(), "wb");
+	if (fp == NULL)
+		return false;
+	bool ok = fwrite(file.bytes.data(), 1, file.bytes.size(), fp) == file.bytes.size();
+	return fclose(fp) == 0 && ok;
+}
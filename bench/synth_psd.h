@@ -0,0 +1,22 @@
+#ifndef SYNTH_PSD_H
+#define SYNTH_PSD_H
+
+#include <string>
+
+// Layout of a generated PSD: `groups` top-level groups, each nested `depth`
+// levels deep, share `layers` pixel layers between their innermost levels.
+// With no groups the layers sit at the top level. 16-bit files keep their
+// layers in a Lr16 block, as Photoshop writes them.
+struct synth_psd_config {
+	int width;
+	int height;
+	int layers;
+	int groups;
+	int depth;
+	bool rle; // PackBits channels, raw otherwise
+	int bits; // per channel, 8 or 16
+};
+
+bool synth_psd_write(const std::string & path, const synth_psd_config & config);
+
+#endif // SYNTH_PSD_H
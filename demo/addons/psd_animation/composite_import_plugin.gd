@@ -0,0 +1,89 @@
+# composite_import_plugin.gd
+tool
+extends EditorImportPlugin
+
+var PsdImporterClass = preload('res://addons/psd_animation/psd_importer.gdns')
+
+enum Presets { PRESET_DEFAULT }
+
+func get_importer_name():
+	return "stoneveil.psdcomposite"
+
+func get_visible_name():
+	return "PSD Composite Texture"
+
+func get_recognized_extensions():
+	return ["psd"]
+
+func get_save_extension():
+	return "res"
+
+func get_resource_type():
+	return "ImageTexture"
+
+func get_preset_count():
+	return Presets.size()
+
+func get_preset_name(preset):
+	match preset:
+		Presets.PRESET_DEFAULT:
+			return "Default"
+		_:
+			return "Unknown"
+
+func get_import_options(preset):
+	match preset:
+		Presets.PRESET_DEFAULT:
+			return [{
+					"name": "filter",
+					"default_value": true
+				},{
+					"name": "mipmaps",
+					"default_value": false
+				},{
+					"name": "repeat",
+					"default_value": false
+				},{
+					"name": "log_import_stats",
+					"default_value": false
+				}]
+		_:
+			return []
+
+func get_option_visibility(option, options):
+	return true
+
+# Only the flattened image stored in the file is read: no layer is decoded
+# and no layer tree is built.
+func import(source_file, save_path, options, r_platform_variants, r_gen_files):
+	var file = File.new()
+	var err = file.open(source_file, File.READ)
+	if err != OK:
+		return err
+	var real_path = file.get_path_absolute()
+	file.close()
+
+	var PsdImporter = PsdImporterClass.new()
+	var composite = PsdImporter.load_composite(real_path)
+	if typeof(composite) != TYPE_DICTIONARY:
+		return ERR_PARSE_ERROR
+
+	var image = Image.new()
+	image.create_from_data(composite.width, composite.height, false, Image.FORMAT_RGBA8, composite.data)
+	if options.mipmaps:
+		image.generate_mipmaps()
+
+	var flags = 0
+	if options.filter:
+		flags |= Texture.FLAG_FILTER
+	if options.mipmaps:
+		flags |= Texture.FLAG_MIPMAPS
+	if options.repeat:
+		flags |= Texture.FLAG_REPEAT
+	var texture = ImageTexture.new()
+	texture.create_from_image(image, flags)
+
+	if options.log_import_stats:
+		print('%s: composite %dx%d read in %.1f ms' % [
+				source_file, composite.width, composite.height, PsdImporter.get_import_stats().file_load_ms])
+	return ResourceSaver.save("%s.%s" % [save_path, get_save_extension()], texture)
@@ -6,6 +6,14 @@ var PsdImporterClass = preload('res://addons/psd_animation/psd_importer.gdns')
 
 enum Presets { PRESET_DEFAULT }
 
+const PNG_PROFILES = ["default", "fast", "store", "small"]
+# VRAM formats are written as StreamTextures, skipping the PNG import
+const TEXTURE_FORMATS = ["png", "dxt5", "etc2"]
+const TEXTURE_EXTENSIONS = [".png", ".stex", ".stex"]
+
+# serialized layer trees of the document cache
+const TREE_CACHE_DIR = "res://.import/psd_trees"
+
 func get_importer_name():
 	return "stoneveil.psdanimation"
 
@@ -37,6 +45,85 @@ func get_import_options(preset):
 			return [{
 					"name": "just_extract_layers",
 					"default_value": false
+				},{
+					"name": "lazy_parse",
+					"default_value": false
+				},{
+					"name": "cache_documents",
+					"default_value": false
+				},{
+					"name": "cache_max_mb",
+					"default_value": 256,
+					"property_hint": PROPERTY_HINT_RANGE,
+					"hint_string": "0,65536"
+				},{
+					"name": "include_layers",
+					"default_value": "",
+					"hint_string": "Comma-separated layer path globs, such as walk/* or **/frame_?"
+				},{
+					"name": "exclude_layers",
+					"default_value": "",
+					"hint_string": "Comma-separated layer path globs"
+				},{
+					"name": "visible_layers_only",
+					"default_value": false
+				},{
+					"name": "in_memory_textures",
+					"default_value": false
+				},{
+					"name": "pack_atlas",
+					"default_value": false
+				},{
+					"name": "atlas_max_size",
+					"default_value": 2048,
+					"property_hint": PROPERTY_HINT_RANGE,
+					"hint_string": "64,16384"
+				},{
+					"name": "atlas_padding",
+					"default_value": 2,
+					"property_hint": PROPERTY_HINT_RANGE,
+					"hint_string": "0,64"
+				},{
+					"name": "export_threads",
+					"default_value": 0,
+					"property_hint": PROPERTY_HINT_RANGE,
+					"hint_string": "0,64"
+				},{
+					"name": "export_memory_budget_mb",
+					"default_value": 0,
+					"property_hint": PROPERTY_HINT_RANGE,
+					"hint_string": "0,65536"
+				},{
+					"name": "png_profile",
+					"default_value": 0,
+					"property_hint": PROPERTY_HINT_ENUM,
+					"hint_string": "default,fast,store,small"
+				},{
+					"name": "texture_format",
+					"default_value": 0,
+					"property_hint": PROPERTY_HINT_ENUM,
+					"hint_string": "png,dxt5,etc2"
+				},{
+					"name": "incremental",
+					"default_value": true
+				},{
+					"name": "async_extract",
+					"default_value": true
+				},{
+					"name": "trim_frames",
+					"default_value": false
+				},{
+					"name": "dedup_frames",
+					"default_value": false
+				},{
+					"name": "bake_layer_properties",
+					"default_value": false
+				},{
+					"name": "group_frames",
+					"default_value": false
+				},{
+					"name": "log_import_stats",
+					"default_value": false
 				},{
 					"name": "default_fps",
 					"default_value": 5,
@@ -66,33 +153,143 @@ func import(source_file, save_path, options, r_platform_variants, r_gen_files):
 	
 	var PsdImporter = PsdImporterClass.new()
 
-	var success = PsdImporter.file_load(real_path)
+	# a memory budget only bounds anything when pixels are decoded on demand
+	var lazy = options.lazy_parse or options.export_memory_budget_mb > 0
+	if options.cache_documents:
+		Directory.new().make_dir_recursive(TREE_CACHE_DIR)
+		PsdImporter.configure_cache({
+				"max_mb": options.cache_max_mb,
+				"directory": ProjectSettings.globalize_path(TREE_CACHE_DIR)
+			})
+	var success = PsdImporter.file_load(real_path, {"lazy": lazy, "cache": options.cache_documents})
 	if !success:
 		return false
 
-	success = PsdImporter.extract_psd(dir)
-	if options.just_extract_layers:
-		return success
+	var layer_filter = _layer_filter(options)
+
+	var report = {}
+	var atlas = {}
+	var atlas_pages = []
+	var textures = {}
+	if options.pack_atlas and not options.just_extract_layers:
+		var atlas_options = {
+				"max_size": options.atlas_max_size,
+				"padding": options.atlas_padding,
+				"threads": options.export_threads,
+				"png_profile": PNG_PROFILES[options.png_profile],
+				"texture_format": TEXTURE_FORMATS[options.texture_format],
+				"bake": options.bake_layer_properties
+			}
+		for key in layer_filter:
+			atlas_options[key] = layer_filter[key]
+		atlas = PsdImporter.pack_atlas(dir, atlas_options)
+		if typeof(atlas) != TYPE_DICTIONARY:
+			return false
+		for page in atlas.pages:
+			atlas_pages.append(ResourceLoader.load(page, "", true))
+	elif options.in_memory_textures and not options.just_extract_layers:
+		# build_sprite_frames decodes the layers itself
+		pass
+	else:
+		var export_options = {
+				"threads": options.export_threads,
+				"incremental": options.incremental,
+				"trim": options.trim_frames,
+				"dedup": options.dedup_frames,
+				"memory_budget_mb": options.export_memory_budget_mb,
+				"png_profile": PNG_PROFILES[options.png_profile],
+				"texture_format": TEXTURE_FORMATS[options.texture_format],
+				"bake": options.bake_layer_properties
+			}
+		for key in layer_filter:
+			export_options[key] = layer_filter[key]
+		if options.async_extract and not options.just_extract_layers:
+			report = _extract_async(PsdImporter, dir, export_options, TEXTURE_EXTENSIONS[options.texture_format], textures)
+		else:
+			report = PsdImporter.extract_psd(dir, export_options)
+		if typeof(report) != TYPE_DICTIONARY:
+			return false
+		if options.just_extract_layers:
+			return true
 
-	if not PsdImporter.is_sprite_frames():
+	var sprite_frames_options = {
+			"default_fps": options.default_fps,
+			"loop": options.loop
+		}
+	for key in layer_filter:
+		sprite_frames_options[key] = layer_filter[key]
+	if options.pack_atlas:
+		sprite_frames_options.atlas = atlas
+		sprite_frames_options.pages = atlas_pages
+	elif options.in_memory_textures:
+		sprite_frames_options.bake = options.bake_layer_properties
+	else:
+		sprite_frames_options.report = report
+		sprite_frames_options.dir = dir
+		sprite_frames_options.textures = textures
+		sprite_frames_options.trim = options.trim_frames
+
+	# the frames get their textures, and group names such as "walk@12!"
+	# their speed and looping, in native code
+	var sprframes = PsdImporter.build_sprite_frames(sprite_frames_options)
+	if typeof(sprframes) != TYPE_OBJECT:
 		return false
-	print('is sprite frames')
-
-	var animations = PsdImporter.get_sprite_frame_names()
-
-	var sprframes = SpriteFrames.new()
-	if sprframes.has_animation('default'):
-		sprframes.remove_animation('default')
-	for anim in animations.keys():
-		print('animation: ', anim)
-		sprframes.add_animation(anim)
-		sprframes.set_animation_loop(anim, options.loop)
-		sprframes.set_animation_speed(anim, options.default_fps)
-		for frame in animations[anim]:
-			var filename = anim + '/' + frame + '.png'
-			if dir.length() > 0:
-				filename = dir + '/' + filename
-			var texture = load(filename)
-			sprframes.add_frame(anim, texture)
-#		print(ResourceSaver.get_recognized_extensions(sprframes))
+	if options.log_import_stats:
+		_log_import_stats(source_file, PsdImporter.get_import_stats())
 	return ResourceSaver.save("%s.%s" % [save_path, get_save_extension()], sprframes)
+
+# the include/exclude/visible_only keys the importer methods take, and
+# group_frames, which flattens the groups inside animations into frames
+func _layer_filter(options):
+	return {
+		"include": _split_patterns(options.include_layers),
+		"exclude": _split_patterns(options.exclude_layers),
+		"visible_only": options.visible_layers_only,
+		"group_frames": options.group_frames
+	}
+
+func _split_patterns(text):
+	var patterns = PoolStringArray()
+	for pattern in text.split(","):
+		pattern = pattern.strip_edges()
+		if not pattern.empty():
+			patterns.append(pattern)
+	return patterns
+
+func _layer_file_path(dir, file, extension):
+	if dir.length() > 0:
+		return dir + '/' + file + extension
+	return file + extension
+
+# Exports on a worker thread and loads each texture as soon as its file is
+# written, while the remaining layers are still being encoded
+func _extract_async(importer, dir, export_options, extension, textures):
+	if not importer.extract_psd_async(dir, export_options):
+		return false
+	while true:
+		var progress = importer.poll_extract()
+		if typeof(progress) != TYPE_DICTIONARY:
+			break
+		for file in progress.written:
+			textures[file] = ResourceLoader.load(_layer_file_path(dir, file, extension), "", true)
+		if not progress.running:
+			break
+		if progress.written.empty():
+			OS.delay_msec(1)
+	return importer.finish_extract()
+
+func _log_import_stats(source_file, stats):
+	if typeof(stats) != TYPE_DICTIONARY or not stats.has("parse_ms"):
+		return
+	print('%s: file_load %.1f ms (parse %.1f), extract %.1f ms (decode %.1f, encode %.1f, write %.1f), frame names %.1f ms, sprite frames %.1f ms' % [
+			source_file, stats.file_load_ms, stats.parse_ms, stats.extract_ms,
+			stats.decode_ms, stats.encode_ms, stats.write_ms, stats.frame_names_ms, stats.sprite_frames_ms])
+	print('%s: %d layers decoded (%d bytes), %d files written (%d bytes), %d allocations (%d bytes)' % [
+			source_file, stats.decoded_layers, stats.decoded_bytes, stats.written_files,
+			stats.encoded_bytes, stats.allocations, stats.allocated_bytes])
+	print('%s: parse arena %d allocations in %d blocks (%d of %d bytes used)' % [
+			source_file, stats.arena_allocations, stats.arena_blocks,
+			stats.arena_used_bytes, stats.arena_reserved_bytes])
+	print('%s: document cache %d documents (%d bytes), %d hits, %d tree hits, %d misses, %d evictions' % [
+			source_file, stats.cache_documents, stats.cache_bytes, stats.cache_hits,
+			stats.cache_tree_hits, stats.cache_misses, stats.cache_evictions])
@@ -2,11 +2,16 @@ tool
 extends EditorPlugin
 
 var import_plugin
+var composite_import_plugin
 
 func _enter_tree():
 	import_plugin = preload("import_plugin.gd").new()
 	add_import_plugin(import_plugin)
+	composite_import_plugin = preload("composite_import_plugin.gd").new()
+	add_import_plugin(composite_import_plugin)
 
 func _exit_tree():
 	remove_import_plugin(import_plugin)
 	import_plugin = null
+	remove_import_plugin(composite_import_plugin)
+	composite_import_plugin = null
@@ -0,0 +1,65 @@
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+
+arena::arena(size_t block_size)
+	: m_cursor(NULL), m_end(NULL), m_block_size(block_size), m_allocations(0), m_reserved(0), m_used(0)
+{
+}
+
+arena::~arena()
+{
+	for (size_t i = 0; i < m_blocks.size(); i++)
+		free(m_blocks[i]);
+}
+
+char * arena::new_block(size_t size)
+{
+	char * block = (char *) malloc(size);
+	if (block == NULL)
+		throw std::bad_alloc();
+	m_blocks.push_back(block);
+	m_reserved += size;
+	return block;
+}
+
+void * arena::allocate(size_t size, size_t align)
+{
+	m_allocations++;
+	m_used += size;
+
+	uintptr_t aligned = ((uintptr_t) m_cursor + align - 1) & ~(uintptr_t) (align - 1);
+	if (m_cursor && aligned + size <= (uintptr_t) m_end) {
+		m_cursor = (char *) aligned + size;
+		return (void *) aligned;
+	}
+
+	// big requests get a block of their own and leave the current one open
+	if (size + align > m_block_size / 4) {
+		char * block = new_block(size + align);
+		return (void *) (((uintptr_t) block + align - 1) & ~(uintptr_t) (align - 1));
+	}
+
+	char * block = new_block(m_block_size);
+	m_end = block + m_block_size;
+	aligned = ((uintptr_t) block + align - 1) & ~(uintptr_t) (align - 1);
+	m_cursor = (char *) aligned + size;
+	return (void *) aligned;
+}
+
+const char * arena::copy_string(const char * str, size_t length)
+{
+	char * copy = (char *) allocate(length + 1, 1);
+	memcpy(copy, str, length);
+	copy[length] = 0;
+	return copy;
+}
+
+const char * arena::copy_string(const char * str)
+{
+	return copy_string(str, strlen(str));
+}
@@ -0,0 +1,66 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#include <cstddef>
+#include <vector>
+
+// Bump allocator: memory is carved out of large blocks and only given back,
+// all at once, when the arena is destroyed. Not thread-safe.
+class arena {
+public:
+	explicit arena(size_t block_size = 64 * 1024);
+	~arena();
+
+	void * allocate(size_t size, size_t align = alignof(std::max_align_t));
+	// copies length bytes of str and a terminating zero
+	const char * copy_string(const char * str, size_t length);
+	const char * copy_string(const char * str);
+
+	size_t allocation_count() const { return m_allocations; }
+	size_t block_count() const { return m_blocks.size(); }
+	size_t reserved_bytes() const { return m_reserved; }
+	size_t used_bytes() const { return m_used; }
+
+private:
+	arena(const arena &);
+	arena & operator=(const arena &);
+
+	char * new_block(size_t size);
+
+	std::vector<char *> m_blocks;
+	char * m_cursor;
+	char * m_end;
+	size_t m_block_size;
+	size_t m_allocations;
+	size_t m_reserved;
+	size_t m_used;
+};
+
+// Lets standard containers allocate from an arena. Deallocation is a no-op,
+// so containers should be reserved to their final size where possible.
+template <typename T>
+class arena_allocator {
+public:
+	typedef T value_type;
+
+	arena_allocator(arena & memory) : m_arena(&memory) {}
+	template <typename U>
+	arena_allocator(const arena_allocator<U> & other) : m_arena(other.m_arena) {}
+
+	T * allocate(size_t n) { return static_cast<T *>(m_arena->allocate(n * sizeof(T), alignof(T))); }
+	void deallocate(T *, size_t) {}
+
+	template <typename U>
+	bool operator==(const arena_allocator<U> & other) const { return m_arena == other.m_arena; }
+	template <typename U>
+	bool operator!=(const arena_allocator<U> & other) const { return m_arena != other.m_arena; }
+
+	arena * m_arena;
+};
+
+template <typename T>
+using arena_vector = std::vector<T, arena_allocator<T> >;
+
+#endif // ARENA_H
@@ -0,0 +1,182 @@
+#include "atlas_packer.h"
+
+#include <algorithm>
+#include <climits>
+
+namespace {
+
+struct free_rect {
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+class maxrects_bin {
+public:
+	explicit maxrects_bin(int size)
+	{
+		free_rect all = {0, 0, size, size};
+		free_rects.push_back(all);
+		used_width = 0;
+		used_height = 0;
+	}
+
+	bool insert(int width, int height, int & x, int & y)
+	{
+		int best = -1;
+		int best_short = INT_MAX;
+		int best_long = INT_MAX;
+		for (size_t i = 0; i < free_rects.size(); i++) {
+			const free_rect & r = free_rects[i];
+			if (r.width < width || r.height < height)
+				continue;
+			int short_side = std::min(r.width - width, r.height - height);
+			int long_side = std::max(r.width - width, r.height - height);
+			if (short_side < best_short || (short_side == best_short && long_side < best_long)) {
+				best = i;
+				best_short = short_side;
+				best_long = long_side;
+			}
+		}
+		if (best < 0)
+			return false;
+
+		free_rect placed = {free_rects[best].x, free_rects[best].y, width, height};
+		split(placed);
+		prune();
+
+		x = placed.x;
+		y = placed.y;
+		used_width = std::max(used_width, x + width);
+		used_height = std::max(used_height, y + height);
+		return true;
+	}
+
+	int used_width;
+	int used_height;
+
+private:
+	static bool intersects(const free_rect & a, const free_rect & b)
+	{
+		return a.x < b.x + b.width && b.x < a.x + a.width && a.y < b.y + b.height && b.y < a.y + a.height;
+	}
+
+	static bool contains(const free_rect & outer, const free_rect & inner)
+	{
+		return inner.x >= outer.x && inner.y >= outer.y
+		    && inner.x + inner.width <= outer.x + outer.width
+		    && inner.y + inner.height <= outer.y + outer.height;
+	}
+
+	void split(const free_rect & placed)
+	{
+		std::vector<free_rect> result;
+		for (size_t i = 0; i < free_rects.size(); i++) {
+			const free_rect & r = free_rects[i];
+			if (!intersects(r, placed)) {
+				result.push_back(r);
+				continue;
+			}
+			if (placed.x > r.x) {
+				free_rect left = {r.x, r.y, placed.x - r.x, r.height};
+				result.push_back(left);
+			}
+			if (placed.x + placed.width < r.x + r.width) {
+				free_rect right = {placed.x + placed.width, r.y, r.x + r.width - placed.x - placed.width, r.height};
+				result.push_back(right);
+			}
+			if (placed.y > r.y) {
+				free_rect top = {r.x, r.y, r.width, placed.y - r.y};
+				result.push_back(top);
+			}
+			if (placed.y + placed.height < r.y + r.height) {
+				free_rect bottom = {r.x, placed.y + placed.height, r.width, r.y + r.height - placed.y - placed.height};
+				result.push_back(bottom);
+			}
+		}
+		free_rects.swap(result);
+	}
+
+	void prune()
+	{
+		for (size_t i = 0; i < free_rects.size(); i++) {
+			for (size_t j = i + 1; j < free_rects.size(); j++) {
+				if (contains(free_rects[j], free_rects[i])) {
+					free_rects.erase(free_rects.begin() + i);
+					i--;
+					break;
+				}
+				if (contains(free_rects[i], free_rects[j])) {
+					free_rects.erase(free_rects.begin() + j);
+					j--;
+				}
+			}
+		}
+	}
+
+	std::vector<free_rect> free_rects;
+};
+
+struct larger_first {
+	const std::vector<atlas_rect> * rects;
+
+	bool operator()(size_t a, size_t b) const
+	{
+		const atlas_rect & ra = (*rects)[a];
+		const atlas_rect & rb = (*rects)[b];
+		int max_a = std::max(ra.width, ra.height);
+		int max_b = std::max(rb.width, rb.height);
+		if (max_a != max_b)
+			return max_a > max_b;
+		return ra.width * ra.height > rb.width * rb.height;
+	}
+};
+
+}
+
+bool atlas_pack(std::vector<atlas_rect> & rects, int max_size, int padding, std::vector<atlas_page> & pages)
+{
+	if (max_size <= 0 || padding < 0)
+		return false;
+
+	// every rect reserves its padding on the right and bottom; the bin is
+	// offset by padding so the top and left borders get it as well
+	int bin_size = max_size - padding;
+
+	std::vector<size_t> order(rects.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	larger_first compare = {&rects};
+	std::stable_sort(order.begin(), order.end(), compare);
+
+	std::vector<maxrects_bin> bins;
+	for (size_t n = 0; n < order.size(); n++) {
+		atlas_rect & rect = rects[order[n]];
+		int width = rect.width + padding;
+		int height = rect.height + padding;
+		if (rect.width <= 0 || rect.height <= 0 || width > bin_size || height > bin_size)
+			return false;
+
+		size_t page = 0;
+		int x = 0;
+		int y = 0;
+		while (page < bins.size() && !bins[page].insert(width, height, x, y))
+			page++;
+		if (page == bins.size()) {
+			bins.push_back(maxrects_bin(bin_size));
+			bins.back().insert(width, height, x, y);
+		}
+
+		rect.page = page;
+		rect.x = x + padding;
+		rect.y = y + padding;
+	}
+
+	pages.resize(bins.size());
+	for (size_t i = 0; i < bins.size(); i++) {
+		pages[i].width = bins[i].used_width + padding;
+		pages[i].height = bins[i].used_height + padding;
+	}
+	return true;
+}
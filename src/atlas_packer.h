@@ -0,0 +1,25 @@
+#ifndef ATLAS_PACKER_H
+#define ATLAS_PACKER_H
+
+#include <vector>
+
+struct atlas_rect {
+	int width;
+	int height;
+	// filled by atlas_pack
+	int page;
+	int x;
+	int y;
+};
+
+struct atlas_page {
+	int width;
+	int height;
+};
+
+// MaxRects packing (best short side fit) of the rects into as many pages of
+// at most max_size x max_size as needed, keeping padding pixels between
+// rects and around the page borders. Fails if a rect cannot fit on a page.
+bool atlas_pack(std::vector<atlas_rect> & rects, int max_size, int padding, std::vector<atlas_page> & pages);
+
+#endif // ATLAS_PACKER_H
@@ -0,0 +1,30 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <stdint.h>
+
+// Read-only memory mapping of a whole file
+class mapped_file {
+public:
+	mapped_file();
+	~mapped_file();
+
+	bool open(const char * filename);
+	void close();
+
+	const uint8_t * data() const { return m_data; }
+	uint64_t size() const { return m_size; }
+
+private:
+	mapped_file(const mapped_file &);
+	mapped_file & operator=(const mapped_file &);
+
+	const uint8_t * m_data;
+	uint64_t m_size;
+#ifdef _WIN32
+	void * m_file;
+	void * m_mapping;
+#endif
+};
+
+#endif // MAPPED_FILE_H
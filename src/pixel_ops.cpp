@@ -0,0 +1,505 @@
+#include "pixel_ops.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <mutex>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PIXEL_OPS_SSE2
+#endif
+
+// AVX2 kernels are compiled for the target with function attributes and
+// picked at runtime, so the library still loads on CPUs without AVX2.
+#if defined(PIXEL_OPS_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PIXEL_OPS_AVX2
+#define PIXEL_OPS_TARGET_AVX2 __attribute__((target("avx2")))
+
+static bool cpu_has_avx2()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#ifdef PIXEL_OPS_SSE2
+// one bit per pixel of the 4 at p, set when its alpha is not zero
+static inline int opaque_mask4(const uint32_t * p)
+{
+	__m128i alpha = _mm_and_si128(_mm_loadu_si128((const __m128i *) p), _mm_set1_epi32((int) 0xff000000));
+	__m128i transparent = _mm_cmpeq_epi32(alpha, _mm_setzero_si128());
+	return ~_mm_movemask_ps(_mm_castsi128_ps(transparent)) & 0xf;
+}
+#endif
+
+// index of the first pixel of row[begin, end) with non-zero alpha, or end
+static int first_opaque(const uint32_t * row, int begin, int end)
+{
+	int x = begin;
+#ifdef PIXEL_OPS_SSE2
+	for (; x + 4 <= end; x += 4) {
+		int mask = opaque_mask4(row + x);
+		if (mask) {
+			while (!(mask & 1)) {
+				mask >>= 1;
+				x++;
+			}
+			return x;
+		}
+	}
+#endif
+	for (; x < end; x++) {
+		if (row[x] >> 24)
+			return x;
+	}
+	return end;
+}
+
+// index of the last pixel of row[begin, end) with non-zero alpha, or begin - 1
+static int last_opaque(const uint32_t * row, int begin, int end)
+{
+	int x = end;
+#ifdef PIXEL_OPS_SSE2
+	for (; x - 4 >= begin; x -= 4) {
+		int mask = opaque_mask4(row + x - 4);
+		if (mask) {
+			int last = x - 1;
+			while (!(mask & 0x8)) {
+				mask <<= 1;
+				last--;
+			}
+			return last;
+		}
+	}
+#endif
+	for (; x > begin; x--) {
+		if (row[x - 1] >> 24)
+			return x - 1;
+	}
+	return begin - 1;
+}
+
+pixel_rect argb_alpha_bounds(const uint32_t * pixels, int width, int height)
+{
+	pixel_rect bounds = {0, 0, 1, 1};
+
+	int top = 0;
+	while (top < height && first_opaque(pixels + (size_t) top * width, 0, width) == width)
+		top++;
+	if (top == height)
+		return bounds;
+
+	int bottom = height - 1;
+	while (first_opaque(pixels + (size_t) bottom * width, 0, width) == width)
+		bottom--;
+
+	// only the columns outside of the bounds found so far need scanning
+	int left = width;
+	int right = -1;
+	for (int y = top; y <= bottom; y++) {
+		const uint32_t * row = pixels + (size_t) y * width;
+		left = first_opaque(row, 0, left);
+		if (right < width - 1) {
+			int last = last_opaque(row, right + 1, width);
+			if (last > right)
+				right = last;
+		}
+	}
+	if (right < left)
+		right = left;
+
+	bounds.x = left;
+	bounds.y = top;
+	bounds.width = right - left + 1;
+	bounds.height = bottom - top + 1;
+	return bounds;
+}
+
+void argb_to_rgba(const uint32_t * src, size_t src_stride, int width, int height, unsigned char * dst, size_t dst_stride)
+{
+	for (int y = 0; y < height; y++) {
+		const uint32_t * in = src + y * src_stride;
+		unsigned char * out = dst + y * dst_stride;
+		int x = 0;
+#ifdef PIXEL_OPS_SSE2
+		// as little-endian words RGBA8 is 0xAABBGGRR: swap the R and B bytes
+		const __m128i ag = _mm_set1_epi32((int) 0xff00ff00);
+		const __m128i low = _mm_set1_epi32(0xff);
+		for (; x + 4 <= width; x += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i *) (in + x));
+			__m128i r = _mm_and_si128(_mm_srli_epi32(v, 16), low);
+			__m128i b = _mm_slli_epi32(_mm_and_si128(v, low), 16);
+			v = _mm_or_si128(_mm_and_si128(v, ag), _mm_or_si128(r, b));
+			_mm_storeu_si128((__m128i *) (out + x * 4), v);
+		}
+#endif
+		for (; x < width; x++) {
+			uint32_t color = in[x];
+			out[x * 4 + 0] = (color >> 16) & 0xff;
+			out[x * 4 + 1] = (color >> 8) & 0xff;
+			out[x * 4 + 2] = color & 0xff;
+			out[x * 4 + 3] = (color >> 24) & 0xff;
+		}
+	}
+}
+
+// a * b / 255 rounded to nearest, for a and b in [0, 255]
+static inline uint32_t mul_255(uint32_t a, uint32_t b)
+{
+	uint32_t t = a * b + 128;
+	return (t + (t >> 8)) >> 8;
+}
+
+static void argb_scale_alpha_scalar(uint32_t * pixels, size_t count, const uint8_t * coverage, uint8_t factor, size_t i)
+{
+	for (; i < count; i++) {
+		uint32_t alpha = mul_255(pixels[i] >> 24, factor);
+		if (coverage)
+			alpha = mul_255(alpha, coverage[i]);
+		pixels[i] = (pixels[i] & 0x00ffffff) | alpha << 24;
+	}
+}
+
+#ifdef PIXEL_OPS_SSE2
+// the products fit the low 16 bits of every 32-bit lane
+static inline __m128i mul_255_sse2(__m128i a, __m128i b)
+{
+	__m128i t = _mm_add_epi32(_mm_mullo_epi16(a, b), _mm_set1_epi32(128));
+	return _mm_srli_epi32(_mm_add_epi32(t, _mm_srli_epi32(t, 8)), 8);
+}
+#endif
+
+void argb_scale_alpha(uint32_t * pixels, size_t count, const uint8_t * coverage, uint8_t factor)
+{
+	size_t i = 0;
+#ifdef PIXEL_OPS_SSE2
+	const __m128i vfactor = _mm_set1_epi32(factor);
+	const __m128i color_mask = _mm_set1_epi32(0x00ffffff);
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 4 <= count; i += 4) {
+		__m128i p = _mm_loadu_si128((const __m128i *) (pixels + i));
+		__m128i alpha = mul_255_sse2(_mm_srli_epi32(p, 24), vfactor);
+		if (coverage) {
+			int32_t bytes;
+			memcpy(&bytes, coverage + i, 4);
+			__m128i c = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+			alpha = mul_255_sse2(alpha, c);
+		}
+		p = _mm_or_si128(_mm_and_si128(p, color_mask), _mm_slli_epi32(alpha, 24));
+		_mm_storeu_si128((__m128i *) (pixels + i), p);
+	}
+#endif
+	argb_scale_alpha_scalar(pixels, count, coverage, factor, i);
+}
+
+static void planar_to_argb_scalar(const uint8_t * r, const uint8_t * g, const uint8_t * b, const uint8_t * a, size_t count, uint32_t * dst)
+{
+	for (size_t i = 0; i < count; i++)
+		dst[i] = (uint32_t) a[i] << 24 | (uint32_t) r[i] << 16 | (uint32_t) g[i] << 8 | b[i];
+}
+
+#ifdef PIXEL_OPS_SSE2
+// little-endian 0xAARRGGBB words are the bytes B, G, R, A
+static void planar_to_argb_sse2(const uint8_t * r, const uint8_t * g, const uint8_t * b, const uint8_t * a, size_t count, uint32_t * dst)
+{
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m128i vr = _mm_loadu_si128((const __m128i *) (r + i));
+		__m128i vg = _mm_loadu_si128((const __m128i *) (g + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+		__m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+		__m128i bg_lo = _mm_unpacklo_epi8(vb, vg);
+		__m128i bg_hi = _mm_unpackhi_epi8(vb, vg);
+		__m128i ra_lo = _mm_unpacklo_epi8(vr, va);
+		__m128i ra_hi = _mm_unpackhi_epi8(vr, va);
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_unpacklo_epi16(bg_lo, ra_lo));
+		_mm_storeu_si128((__m128i *) (dst + i + 4), _mm_unpackhi_epi16(bg_lo, ra_lo));
+		_mm_storeu_si128((__m128i *) (dst + i + 8), _mm_unpacklo_epi16(bg_hi, ra_hi));
+		_mm_storeu_si128((__m128i *) (dst + i + 12), _mm_unpackhi_epi16(bg_hi, ra_hi));
+	}
+	planar_to_argb_scalar(r + i, g + i, b + i, a + i, count - i, dst + i);
+}
+#endif
+
+#ifdef PIXEL_OPS_AVX2
+PIXEL_OPS_TARGET_AVX2
+static void planar_to_argb_avx2(const uint8_t * r, const uint8_t * g, const uint8_t * b, const uint8_t * a, size_t count, uint32_t * dst)
+{
+	size_t i = 0;
+	for (; i + 32 <= count; i += 32) {
+		__m256i vr = _mm256_loadu_si256((const __m256i *) (r + i));
+		__m256i vg = _mm256_loadu_si256((const __m256i *) (g + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+		__m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+		__m256i bg_lo = _mm256_unpacklo_epi8(vb, vg);
+		__m256i bg_hi = _mm256_unpackhi_epi8(vb, vg);
+		__m256i ra_lo = _mm256_unpacklo_epi8(vr, va);
+		__m256i ra_hi = _mm256_unpackhi_epi8(vr, va);
+		// the unpacks work within 128-bit lanes: pixels 0-3 | 16-19, 4-7 | 20-23, ...
+		__m256i p0 = _mm256_unpacklo_epi16(bg_lo, ra_lo);
+		__m256i p1 = _mm256_unpackhi_epi16(bg_lo, ra_lo);
+		__m256i p2 = _mm256_unpacklo_epi16(bg_hi, ra_hi);
+		__m256i p3 = _mm256_unpackhi_epi16(bg_hi, ra_hi);
+		_mm256_storeu_si256((__m256i *) (dst + i), _mm256_permute2x128_si256(p0, p1, 0x20));
+		_mm256_storeu_si256((__m256i *) (dst + i + 8), _mm256_permute2x128_si256(p2, p3, 0x20));
+		_mm256_storeu_si256((__m256i *) (dst + i + 16), _mm256_permute2x128_si256(p0, p1, 0x31));
+		_mm256_storeu_si256((__m256i *) (dst + i + 24), _mm256_permute2x128_si256(p2, p3, 0x31));
+	}
+	planar_to_argb_sse2(r + i, g + i, b + i, a + i, count - i, dst + i);
+}
+#endif
+
+typedef void (* planar_to_argb_fn)(const uint8_t *, const uint8_t *, const uint8_t *, const uint8_t *, size_t, uint32_t *);
+
+static planar_to_argb_fn select_planar_to_argb()
+{
+#ifdef PIXEL_OPS_AVX2
+	if (cpu_has_avx2())
+		return planar_to_argb_avx2;
+#endif
+#ifdef PIXEL_OPS_SSE2
+	return planar_to_argb_sse2;
+#else
+	return planar_to_argb_scalar;
+#endif
+}
+
+void planar_to_argb(const uint8_t * r, const uint8_t * g, const uint8_t * b, const uint8_t * a, size_t count, uint32_t * dst)
+{
+	static const planar_to_argb_fn impl = select_planar_to_argb();
+	impl(r, g, b, a, count, dst);
+}
+
+// Thresholds of a 4x4 Bayer matrix, centred in the 1/65536 steps that
+// dither_sample drops
+static const uint32_t dither_thresholds[4][4] = {
+	{ 0 * 4096 + 2048, 8 * 4096 + 2048, 2 * 4096 + 2048, 10 * 4096 + 2048},
+	{12 * 4096 + 2048, 4 * 4096 + 2048, 14 * 4096 + 2048, 6 * 4096 + 2048},
+	{ 3 * 4096 + 2048, 11 * 4096 + 2048, 1 * 4096 + 2048, 9 * 4096 + 2048},
+	{15 * 4096 + 2048, 7 * 4096 + 2048, 13 * 4096 + 2048, 5 * 4096 + 2048},
+};
+
+// v * 255 / 65535 in 16.16 fixed point is t + t / 65536 with t = v * 255,
+// short of the exact value by less than 1/65536
+static inline uint8_t dither_sample(uint16_t value, uint32_t threshold)
+{
+	uint32_t t = (uint32_t) value * 255;
+	return (uint8_t) ((t + (t >> 16) + threshold) >> 16);
+}
+
+static void dither_u16_to_u8_scalar(const uint16_t * src, size_t count, int y, uint8_t * dst, size_t x)
+{
+	const uint32_t * thresholds = dither_thresholds[y & 3];
+	for (; x < count; x++)
+		dst[x] = dither_sample(src[x], thresholds[x & 3]);
+}
+
+#ifdef PIXEL_OPS_SSE2
+static inline __m128i dither_sse2(__m128i value, __m128i threshold)
+{
+	__m128i t = _mm_sub_epi32(_mm_slli_epi32(value, 8), value);
+	t = _mm_add_epi32(t, _mm_srli_epi32(t, 16));
+	return _mm_srli_epi32(_mm_add_epi32(t, threshold), 16);
+}
+
+static void dither_u16_to_u8_sse2(const uint16_t * src, size_t count, int y, uint8_t * dst)
+{
+	const uint32_t * row = dither_thresholds[y & 3];
+	const __m128i threshold = _mm_setr_epi32(row[0], row[1], row[2], row[3]);
+	const __m128i zero = _mm_setzero_si128();
+	size_t x = 0;
+	for (; x + 16 <= count; x += 16) {
+		__m128i lo = _mm_loadu_si128((const __m128i *) (src + x));
+		__m128i hi = _mm_loadu_si128((const __m128i *) (src + x + 8));
+		__m128i v0 = dither_sse2(_mm_unpacklo_epi16(lo, zero), threshold);
+		__m128i v1 = dither_sse2(_mm_unpackhi_epi16(lo, zero), threshold);
+		__m128i v2 = dither_sse2(_mm_unpacklo_epi16(hi, zero), threshold);
+		__m128i v3 = dither_sse2(_mm_unpackhi_epi16(hi, zero), threshold);
+		// every value is at most 255, the saturating packs keep them as is
+		__m128i bytes = _mm_packus_epi16(_mm_packs_epi32(v0, v1), _mm_packs_epi32(v2, v3));
+		_mm_storeu_si128((__m128i *) (dst + x), bytes);
+	}
+	dither_u16_to_u8_scalar(src, count, y, dst, x);
+}
+#endif
+
+void dither_u16_to_u8(const uint16_t * src, size_t count, int y, uint8_t * dst)
+{
+#ifdef PIXEL_OPS_SSE2
+	dither_u16_to_u8_sse2(src, count, y, dst);
+#else
+	dither_u16_to_u8_scalar(src, count, y, dst, 0);
+#endif
+}
+
+// Linear to sRGB, fine enough that the steps stay well below one 8-bit level
+static const int srgb_table_size = 16384;
+
+// a plain array, as statics with destructors would need __dso_handle and
+// run at library unload
+static uint16_t srgb_values[srgb_table_size];
+static std::once_flag srgb_filled;
+
+static const uint16_t * srgb_table()
+{
+	std::call_once(srgb_filled, []() {
+		for (int i = 0; i < srgb_table_size; i++) {
+			double linear = (double) i / (srgb_table_size - 1);
+			double encoded = linear <= 0.0031308? linear * 12.92 : 1.055 * pow(linear, 1 / 2.4) - 0.055;
+			srgb_values[i] = (uint16_t) (encoded * 65535 + 0.5);
+		}
+	});
+	return srgb_values;
+}
+
+static void float_to_u16_scalar(const float * src, size_t count, const uint16_t * table, uint16_t * dst, size_t i)
+{
+	for (; i < count; i++) {
+		float value = src[i] > 0? (src[i] < 1? src[i] : 1) : 0;
+		if (table)
+			dst[i] = table[(int) (value * (srgb_table_size - 1) + 0.5f)];
+		else
+			dst[i] = (uint16_t) (value * 65535 + 0.5f);
+	}
+}
+
+void float_to_u16(const float * src, size_t count, bool srgb, uint16_t * dst)
+{
+	const uint16_t * table = srgb? srgb_table() : NULL;
+	size_t i = 0;
+#ifdef PIXEL_OPS_SSE2
+	// _mm_max_ps returns its second operand when the first is NaN
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 scale = _mm_set1_ps(table? srgb_table_size - 1 : 65535);
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128i bias = _mm_set1_epi32(32768);
+	for (; i + 8 <= count; i += 8) {
+		__m128 lo = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i), zero), one);
+		__m128 hi = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i + 4), zero), one);
+		__m128i lo_scaled = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(lo, scale), half));
+		__m128i hi_scaled = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(hi, scale), half));
+		if (table) {
+			int32_t index[8];
+			_mm_storeu_si128((__m128i *) index, lo_scaled);
+			_mm_storeu_si128((__m128i *) (index + 4), hi_scaled);
+			for (int k = 0; k < 8; k++)
+				dst[i + k] = table[index[k]];
+		} else {
+			// packs_epi32 saturates to signed 16 bits, so pack around 32768
+			__m128i packed = _mm_packs_epi32(_mm_sub_epi32(lo_scaled, bias), _mm_sub_epi32(hi_scaled, bias));
+			_mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(packed, _mm_set1_epi16((short) 0x8000)));
+		}
+	}
+#endif
+	float_to_u16_scalar(src, count, table, dst, i);
+}
+
+// PackBits: a header byte n >= 0 is followed by n + 1 literal bytes, a
+// header in [-127, -1] repeats the next byte 1 - n times, -128 is a no-op.
+//
+// Runs and literals are at most 128 bytes. While there is room for the
+// longest one plus a vector on both sides, the vector versions copy and fill
+// whole vectors and let the next run overwrite the bytes past the end.
+static bool packbits_decode_scalar(const uint8_t * in, size_t in_size, uint8_t * out, size_t out_size, size_t i, size_t o)
+{
+	while (o < out_size && i < in_size) {
+		int n = (int8_t) in[i++];
+		if (n >= 0) {
+			size_t count = n + 1;
+			if (count > in_size - i || count > out_size - o)
+				return false;
+			memcpy(out + o, in + i, count);
+			i += count;
+			o += count;
+		} else if (n != -128) {
+			size_t count = 1 - n;
+			if (i >= in_size || count > out_size - o)
+				return false;
+			memset(out + o, in[i++], count);
+			o += count;
+		}
+	}
+	return o == out_size;
+}
+
+#ifdef PIXEL_OPS_SSE2
+static bool packbits_decode_sse2(const uint8_t * in, size_t in_size, uint8_t * out, size_t out_size)
+{
+	size_t i = 0;
+	size_t o = 0;
+	while (in_size - i >= 1 + 128 + 16 && out_size - o >= 128 + 16) {
+		int n = (int8_t) in[i++];
+		if (n >= 0) {
+			size_t count = n + 1;
+			for (size_t k = 0; k < count; k += 16)
+				_mm_storeu_si128((__m128i *) (out + o + k), _mm_loadu_si128((const __m128i *) (in + i + k)));
+			i += count;
+			o += count;
+		} else if (n != -128) {
+			size_t count = 1 - n;
+			__m128i fill = _mm_set1_epi8((char) in[i++]);
+			for (size_t k = 0; k < count; k += 16)
+				_mm_storeu_si128((__m128i *) (out + o + k), fill);
+			o += count;
+		}
+	}
+	return packbits_decode_scalar(in, in_size, out, out_size, i, o);
+}
+#endif
+
+#ifdef PIXEL_OPS_AVX2
+PIXEL_OPS_TARGET_AVX2
+static bool packbits_decode_avx2(const uint8_t * in, size_t in_size, uint8_t * out, size_t out_size)
+{
+	size_t i = 0;
+	size_t o = 0;
+	while (in_size - i >= 1 + 128 + 32 && out_size - o >= 128 + 32) {
+		int n = (int8_t) in[i++];
+		if (n >= 0) {
+			size_t count = n + 1;
+			for (size_t k = 0; k < count; k += 32)
+				_mm256_storeu_si256((__m256i *) (out + o + k), _mm256_loadu_si256((const __m256i *) (in + i + k)));
+			i += count;
+			o += count;
+		} else if (n != -128) {
+			size_t count = 1 - n;
+			__m256i fill = _mm256_set1_epi8((char) in[i++]);
+			for (size_t k = 0; k < count; k += 32)
+				_mm256_storeu_si256((__m256i *) (out + o + k), fill);
+			o += count;
+		}
+	}
+	return packbits_decode_scalar(in, in_size, out, out_size, i, o);
+}
+#endif
+
+typedef bool (* packbits_decode_fn)(const uint8_t *, size_t, uint8_t *, size_t);
+
+#ifndef PIXEL_OPS_SSE2
+static bool packbits_decode_plain(const uint8_t * in, size_t in_size, uint8_t * out, size_t out_size)
+{
+	return packbits_decode_scalar(in, in_size, out, out_size, 0, 0);
+}
+#endif
+
+static packbits_decode_fn select_packbits_decode()
+{
+#ifdef PIXEL_OPS_AVX2
+	if (cpu_has_avx2())
+		return packbits_decode_avx2;
+#endif
+#ifdef PIXEL_OPS_SSE2
+	return packbits_decode_sse2;
+#else
+	return packbits_decode_plain;
+#endif
+}
+
+bool packbits_decode(const uint8_t * in, size_t in_size, uint8_t * out, size_t out_size)
+{
+	static const packbits_decode_fn impl = select_packbits_decode();
+	return impl(in, in_size, out, out_size);
+}
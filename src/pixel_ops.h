@@ -0,0 +1,45 @@
+#ifndef PIXEL_OPS_H
+#define PIXEL_OPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Pixel buffers are rows of 32-bit 0xAARRGGBB words, as libpsd decodes them.
+
+struct pixel_rect {
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+// Smallest rect holding every pixel with non-zero alpha. Fully transparent
+// images keep their top-left pixel so that they still have a texture.
+pixel_rect argb_alpha_bounds(const uint32_t * pixels, int width, int height);
+
+// Converts width x height pixels to RGBA8 bytes. src_stride is in pixels,
+// dst_stride in bytes.
+void argb_to_rgba(const uint32_t * src, size_t src_stride, int width, int height, unsigned char * dst, size_t dst_stride);
+
+// Multiplies the alpha of count pixels by factor / 255 and, unless coverage
+// is NULL, by coverage[i] / 255, rounding to nearest
+void argb_scale_alpha(uint32_t * pixels, size_t count, const uint8_t * coverage, uint8_t factor);
+
+// Interleaves count bytes of each of the red, green, blue and alpha planes
+// into 0xAARRGGBB words. The color planes may alias each other.
+void planar_to_argb(const uint8_t * r, const uint8_t * g, const uint8_t * b, const uint8_t * a, size_t count, uint32_t * dst);
+
+// Reduces count 16-bit samples of row y to bytes with a 4x4 ordered dither,
+// so that smooth gradients do not band. Samples that are exact multiples of
+// 257, 0 and 65535 among them, keep their 8-bit value.
+void dither_u16_to_u8(const uint16_t * src, size_t count, int y, uint8_t * dst);
+
+// Clamps count floats to [0, 1] and scales them to 16 bits; NaN is 0. With
+// srgb the values are linear light and get the sRGB transfer curve first.
+void float_to_u16(const float * src, size_t count, bool srgb, uint16_t * dst);
+
+// Decodes a PackBits stream into exactly out_size bytes. Returns false on
+// truncated or overlong input.
+bool packbits_decode(const uint8_t * in, size_t in_size, uint8_t * out, size_t out_size);
+
+#endif // PIXEL_OPS_H
@@ -0,0 +1,491 @@
+#include "psd_parser.h"
+#include "psd_document.h"
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+namespace {
+
+struct cache_entry {
+	document_key key;
+	struct psd_document * doc;
+	long long bytes;
+};
+
+struct document_cache {
+	std::mutex mutex;
+	long long max_bytes;
+	std::string directory;
+	std::list<cache_entry> entries; // most recently used first
+	long long bytes;
+	long long hits;
+	long long tree_hits;
+	long long misses;
+	long long evictions;
+
+	document_cache() : max_bytes(0), bytes(0), hits(0), tree_hits(0), misses(0), evictions(0) {}
+};
+
+// Never destroyed: documents may only be freed while the allocator they came
+// from is alive, so the GDNative terminate hook empties the cache instead of
+// a destructor running at library unload.
+document_cache & cache = *new document_cache();
+
+// tells apart the trees written at once, as they are written outside the lock
+std::atomic<unsigned> tree_writes(0);
+
+// Serialized trees start with this header, followed by the source path, the
+// node array, the record of every node, the node string table, the group
+// paths as offsets into the path table, the pixel layers and finally the
+// path table itself. Integers are in host byte order: a tree written
+// elsewhere fails the magic check and is simply parsed again.
+const uint32_t tree_magic = 0x54445350; // "PSDT"
+const uint32_t tree_version = 6;
+
+struct tree_header {
+	uint32_t magic;
+	uint32_t version;
+	int64_t mtime; // in nanoseconds
+	int64_t size;
+	int32_t lazy;
+	int32_t width;
+	int32_t height;
+	int32_t depth;
+	int32_t children_count;
+	uint32_t path_size;
+	uint32_t node_count;
+	uint32_t names_size;
+	uint32_t group_count;
+	uint32_t layer_count;
+	uint32_t paths_size;
+};
+
+struct tree_layer {
+	int32_t record;
+	int32_t node;
+	uint32_t name; // into the path table
+	int32_t visible;
+	int32_t x;
+	int32_t y;
+	int32_t width;
+	int32_t height;
+};
+
+}
+
+// Estimate of the memory a cached document keeps alive. Eager documents hold
+// every layer decoded by libpsd plus the merged image.
+static long long document_footprint(const struct psd_document * doc)
+{
+	long long bytes = sizeof(struct psd_document) + doc->memory.reserved_bytes();
+	if (!doc->lazy) {
+		bytes += (long long) doc->width * doc->height * 4;
+		for (size_t i = 0; i < doc->layers.size(); i++)
+			bytes += (long long) doc->layers[i].width * doc->layers[i].height * 4;
+	}
+	return bytes;
+}
+
+static std::string tree_path(const std::string & directory, const document_key & key)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < key.path.size(); i++) {
+		hash ^= (unsigned char) key.path[i];
+		hash *= 1099511628211ULL;
+	}
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx%s.psdtree", (unsigned long long) hash, key.lazy? "-lazy" : "");
+	return directory + "/" + name;
+}
+
+static void append(std::vector<char> & out, const void * data, size_t size)
+{
+	out.insert(out.end(), (const char *) data, (const char *) data + size);
+}
+
+static void append_path(std::vector<char> & paths, const char * path, uint32_t & offset)
+{
+	offset = paths.size();
+	paths.insert(paths.end(), path, path + strlen(path) + 1);
+}
+
+static bool write_tree(const std::string & directory, const document_key & key, const struct psd_document * doc)
+{
+	std::vector<char> paths;
+	std::vector<uint32_t> groups(doc->groups.size());
+	std::vector<tree_layer> layers(doc->layers.size());
+	for (size_t i = 0; i < doc->groups.size(); i++)
+		append_path(paths, doc->groups[i], groups[i]);
+	for (size_t i = 0; i < doc->layers.size(); i++) {
+		const pixel_layer & layer = doc->layers[i];
+		layers[i].record = layer.record;
+		layers[i].node = layer.node;
+		append_path(paths, layer.name, layers[i].name);
+		layers[i].visible = layer.visible? 1 : 0;
+		layers[i].x = layer.x;
+		layers[i].y = layer.y;
+		layers[i].width = layer.width;
+		layers[i].height = layer.height;
+	}
+
+	tree_header header;
+	memset(&header, 0, sizeof(header));
+	header.magic = tree_magic;
+	header.version = tree_version;
+	header.mtime = key.mtime;
+	header.size = key.size;
+	header.lazy = doc->lazy? 1 : 0;
+	header.width = doc->width;
+	header.height = doc->height;
+	header.depth = doc->depth;
+	header.children_count = doc->children_count;
+	header.path_size = key.path.size();
+	header.node_count = doc->nodes.size();
+	header.names_size = doc->names.size();
+	header.group_count = groups.size();
+	header.layer_count = layers.size();
+	header.paths_size = paths.size();
+
+	std::vector<char> out;
+	append(out, &header, sizeof(header));
+	append(out, key.path.data(), key.path.size());
+	append(out, doc->nodes.data(), doc->nodes.size() * sizeof(psd_node));
+	append(out, doc->node_records.data(), doc->node_records.size() * sizeof(int32_t));
+	append(out, doc->names.data(), doc->names.size());
+	append(out, groups.data(), groups.size() * sizeof(uint32_t));
+	append(out, layers.data(), layers.size() * sizeof(tree_layer));
+	append(out, paths.data(), paths.size());
+
+	// written aside and renamed so a reader never sees half a tree
+	std::string path = tree_path(directory, key);
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%u.tmp", tree_writes++);
+	std::string tmp = path + suffix;
+	FILE * file = fopen(tmp.c_str(), "wb");
+	if (file == NULL)
+		return false;
+	bool ok = fwrite(out.data(), 1, out.size(), file) == out.size();
+	ok = fclose(file) == 0 && ok;
+	if (ok && rename(tmp.c_str(), path.c_str()) != 0) {
+		remove(path.c_str());
+		ok = rename(tmp.c_str(), path.c_str()) == 0;
+	}
+	if (!ok)
+		remove(tmp.c_str());
+	return ok;
+}
+
+static bool read_file(const std::string & path, std::vector<char> & data)
+{
+	FILE * file = fopen(path.c_str(), "rb");
+	if (file == NULL)
+		return false;
+	bool ok = fseek(file, 0, SEEK_END) == 0;
+	long size = ok? ftell(file) : -1;
+	ok = size >= 0 && fseek(file, 0, SEEK_SET) == 0;
+	if (ok) {
+		data.resize(size);
+		ok = fread(data.data(), 1, data.size(), file) == data.size();
+	}
+	fclose(file);
+	return ok;
+}
+
+static bool valid_string_table(const char * table, uint32_t size, uint32_t offset)
+{
+	return offset < size && table[size - 1] == 0;
+}
+
+static struct psd_document * read_tree(const std::string & directory, const document_key & key)
+{
+	std::vector<char> data;
+	if (!read_file(tree_path(directory, key), data) || data.size() < sizeof(tree_header))
+		return NULL;
+
+	tree_header header;
+	memcpy(&header, data.data(), sizeof(header));
+	if (header.magic != tree_magic || header.version != tree_version
+			|| header.mtime != key.mtime || header.size != key.size
+			|| header.path_size != key.path.size())
+		return NULL;
+
+	uint64_t expected = sizeof(header) + (uint64_t) header.path_size
+		+ (uint64_t) header.node_count * (sizeof(psd_node) + sizeof(int32_t)) + header.names_size
+		+ (uint64_t) header.group_count * sizeof(uint32_t)
+		+ (uint64_t) header.layer_count * sizeof(tree_layer) + header.paths_size;
+	if (expected != data.size())
+		return NULL;
+
+	const char * cursor = data.data() + sizeof(header);
+	if (memcmp(cursor, key.path.data(), key.path.size()) != 0)
+		return NULL;
+	cursor += header.path_size;
+	const char * nodes = cursor;
+	cursor += header.node_count * sizeof(psd_node);
+	const char * node_records = cursor;
+	cursor += header.node_count * sizeof(int32_t);
+	const char * names = cursor;
+	cursor += header.names_size;
+	const char * groups = cursor;
+	cursor += header.group_count * sizeof(uint32_t);
+	const char * layers = cursor;
+	cursor += header.layer_count * sizeof(tree_layer);
+	const char * paths = cursor;
+
+	if (header.children_count < 0 || (uint32_t) header.children_count > header.node_count)
+		return NULL;
+
+	struct psd_document * doc = new psd_document();
+	doc->filename = doc->memory.copy_string(key.path.c_str());
+	doc->width = header.width;
+	doc->height = header.height;
+	doc->depth = header.depth;
+	doc->lazy = header.lazy != 0;
+	doc->children_count = header.children_count;
+
+	doc->nodes.resize(header.node_count);
+	memcpy(doc->nodes.data(), nodes, header.node_count * sizeof(psd_node));
+	doc->node_records.resize(header.node_count);
+	memcpy(doc->node_records.data(), node_records, header.node_count * sizeof(int32_t));
+	for (size_t i = 0; i < doc->nodes.size(); i++) {
+		const psd_node & node = doc->nodes[i];
+		if (node.parent < -1 || node.parent >= (int) i || node.children_count < 0 || node.first_child < 0 || doc->node_records[i] < 0
+				|| (uint32_t) node.first_child + node.children_count > header.node_count
+				|| !valid_string_table(names, header.names_size, node.name_offset)) {
+			psd_document_free(doc);
+			return NULL;
+		}
+	}
+	doc->names.assign(names, names + header.names_size);
+
+	// groups and layers are listed in node order, one for each node of their
+	// kind; the export and the compositor count nodes to index them
+	uint32_t group_nodes = 0;
+	for (size_t i = 0; i < doc->nodes.size(); i++)
+		group_nodes += doc->nodes[i].is_group? 1 : 0;
+	if (header.group_count != group_nodes || header.layer_count != header.node_count - group_nodes) {
+		psd_document_free(doc);
+		return NULL;
+	}
+
+	// the path table is kept as is and the groups and layers point into it
+	char * table = (char *) doc->memory.allocate(header.paths_size, 1);
+	memcpy(table, paths, header.paths_size);
+
+	doc->groups.reserve(header.group_count);
+	for (uint32_t i = 0; i < header.group_count; i++) {
+		uint32_t offset;
+		memcpy(&offset, groups + i * sizeof(uint32_t), sizeof(offset));
+		if (!valid_string_table(table, header.paths_size, offset)) {
+			psd_document_free(doc);
+			return NULL;
+		}
+		doc->groups.push_back(table + offset);
+	}
+
+	doc->layers.reserve(header.layer_count);
+	int32_t layer_node = -1;
+	for (uint32_t i = 0; i < header.layer_count; i++) {
+		tree_layer entry;
+		memcpy(&entry, layers + i * sizeof(tree_layer), sizeof(entry));
+		// the next node that is not a group
+		layer_node++;
+		while ((uint32_t) layer_node < header.node_count && doc->nodes[layer_node].is_group)
+			layer_node++;
+		if (entry.record < 0 || entry.width <= 0 || entry.height <= 0
+				|| entry.node != layer_node || (uint32_t) entry.node >= header.node_count
+				|| doc->node_records[entry.node] != entry.record
+				|| doc->nodes[entry.node].x != entry.x || doc->nodes[entry.node].y != entry.y
+				|| doc->nodes[entry.node].width != entry.width || doc->nodes[entry.node].height != entry.height
+				|| !valid_string_table(table, header.paths_size, entry.name)) {
+			psd_document_free(doc);
+			return NULL;
+		}
+		pixel_layer layer;
+		layer.record = entry.record;
+		layer.node = entry.node;
+		layer.name = table + entry.name;
+		layer.visible = entry.visible != 0;
+		layer.x = entry.x;
+		layer.y = entry.y;
+		layer.width = entry.width;
+		layer.height = entry.height;
+		doc->layers.push_back(layer);
+	}
+	return doc;
+}
+
+// Drops the cache's reference; the caller holds the lock
+static void release(std::list<cache_entry>::iterator it)
+{
+	cache.bytes -= it->bytes;
+	psd_document_free(it->doc);
+	cache.entries.erase(it);
+}
+
+static void evict_to(long long max_bytes)
+{
+	while (!cache.entries.empty() && cache.bytes > max_bytes) {
+		release(--cache.entries.end());
+		cache.evictions++;
+	}
+}
+
+// Takes a reference for the cache; the caller holds the lock
+static void insert(const document_key & key, struct psd_document * doc)
+{
+	for (std::list<cache_entry>::iterator it = cache.entries.begin(); it != cache.entries.end(); ++it) {
+		if (it->key.path == key.path && it->key.lazy == key.lazy)
+			return; // parsed twice at once; the first one stays
+	}
+
+	long long bytes = document_footprint(doc);
+	if (bytes > cache.max_bytes)
+		return;
+
+	doc->refs++;
+	cache_entry entry;
+	entry.key = key;
+	entry.doc = doc;
+	entry.bytes = bytes;
+	cache.entries.push_front(entry);
+	cache.bytes += bytes;
+	evict_to(cache.max_bytes);
+}
+
+// Nanoseconds where the platform keeps them, so that a file saved again with
+// the same size within the same second is not taken for the cached one
+static long long file_mtime_ns(const struct stat & st)
+{
+#if defined(__APPLE__)
+	return (long long) st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+	return (long long) st.st_mtime * 1000000000;
+#else
+	return (long long) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+}
+
+bool document_key_init(document_key & key, const char * filename, bool lazy)
+{
+	{
+		std::lock_guard<std::mutex> lock(cache.mutex);
+		if (cache.max_bytes <= 0 && cache.directory.empty())
+			return false;
+	}
+
+	struct stat st;
+	if (filename == NULL || stat(filename, &st) != 0)
+		return false;
+	key.path = filename;
+	key.mtime = file_mtime_ns(st);
+	key.size = st.st_size;
+	key.lazy = lazy;
+	return true;
+}
+
+struct psd_document * document_cache_acquire(const document_key & key)
+{
+	std::string directory;
+	{
+		std::lock_guard<std::mutex> lock(cache.mutex);
+
+		for (std::list<cache_entry>::iterator it = cache.entries.begin(); it != cache.entries.end(); ++it) {
+			if (it->key.path != key.path || it->key.lazy != key.lazy)
+				continue;
+			if (it->key.mtime != key.mtime || it->key.size != key.size) {
+				// the file changed since; this entry will never be hit again
+				release(it);
+				break;
+			}
+			cache.entries.splice(cache.entries.begin(), cache.entries, it);
+			cache.hits++;
+			it->doc->refs++;
+			return it->doc;
+		}
+		directory = cache.directory;
+	}
+
+	// trees are read and written without the lock, so that loads of other
+	// files do not wait on the disk
+	struct psd_document * doc = NULL;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if (!directory.empty())
+		doc = read_tree(directory, key);
+	if (doc)
+		doc->stats.parse_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	if (doc == NULL) {
+		cache.misses++;
+		return NULL;
+	}
+	cache.tree_hits++;
+	insert(key, doc);
+	return doc;
+}
+
+void document_cache_store(const document_key & key, struct psd_document * doc)
+{
+	std::string directory;
+	{
+		std::lock_guard<std::mutex> lock(cache.mutex);
+		directory = cache.directory;
+	}
+	if (!directory.empty())
+		write_tree(directory, key, doc);
+
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	insert(key, doc);
+}
+
+void psd_cache_options_init(struct psd_cache_options * options)
+{
+	if (options == NULL)
+		return;
+	options->max_bytes = 0;
+	options->directory = NULL;
+}
+
+int psd_cache_configure(const struct psd_cache_options * options)
+{
+	if (options == NULL)
+		return -1;
+
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	cache.max_bytes = options->max_bytes > 0? options->max_bytes : 0;
+	cache.directory = options->directory? options->directory : "";
+	evict_to(cache.max_bytes);
+	return 0;
+}
+
+void psd_cache_clear(void)
+{
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	while (!cache.entries.empty())
+		release(cache.entries.begin());
+}
+
+int psd_cache_get_stats(struct psd_cache_stats * stats)
+{
+	if (stats == NULL)
+		return -1;
+
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	stats->documents = cache.entries.size();
+	stats->bytes = cache.bytes;
+	stats->hits = cache.hits;
+	stats->tree_hits = cache.tree_hits;
+	stats->misses = cache.misses;
+	stats->evictions = cache.evictions;
+	return 0;
+}
@@ -0,0 +1,383 @@
+// Headless batch exporter: writes the layer PNGs of many PSD files and a
+// sprite-frame manifest for each, without Godot.
+//
+//   psd_cli [-j jobs] [-o dir] [--lazy] [--trim] [--dedup] [--incremental]
+//           [--bake] [--group-frames] [--metadata]
+//           [--png-profile default|fast|store|small]
+//           [--texture-format png|dxt5|etc2] [--include glob]... [--exclude glob]...
+//           [--visible-only] file.psd...
+//
+// The layers of a.psd go to <dir>/a/, next to a.psd when no -o is given,
+// along with <dir>/a/frames.json, and <dir>/a/a.psdmeta with --metadata.
+
+#include "psd_parser.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+struct cli_options {
+	int jobs;
+	std::string out_dir;
+	struct psd_parse_options parse;
+	struct psd_export_options export_options;
+	std::vector<const char *> include; // point into argv
+	std::vector<const char *> exclude;
+	struct psd_layer_filter filter;
+};
+
+// Every worker owns a deque of task indices. It takes work from the front of
+// its own deque and, once that is empty, steals from the back of the others.
+class work_stealing_pool {
+public:
+	explicit work_stealing_pool(size_t n_workers) : m_queues(n_workers) {}
+
+	// deals the tasks round-robin, in order, so that each worker starts
+	// with the front of the list
+	void deal(size_t n_tasks)
+	{
+		for (size_t i = 0; i < n_tasks; i++)
+			m_queues[i % m_queues.size()].tasks.push_back(i);
+	}
+
+	template <typename F>
+	void run(F task)
+	{
+		std::vector<std::thread> workers;
+		for (size_t w = 1; w < m_queues.size(); w++)
+			workers.push_back(std::thread([this, w, &task]() { work(w, task); }));
+		work(0, task);
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+	}
+
+private:
+	struct task_queue {
+		std::mutex mutex;
+		std::deque<size_t> tasks;
+	};
+
+	bool pop(size_t worker, size_t & task)
+	{
+		task_queue & own = m_queues[worker];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (own.tasks.empty())
+			return false;
+		task = own.tasks.front();
+		own.tasks.pop_front();
+		return true;
+	}
+
+	bool steal(size_t thief, size_t & task)
+	{
+		for (size_t k = 1; k < m_queues.size(); k++) {
+			task_queue & victim = m_queues[(thief + k) % m_queues.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (!victim.tasks.empty()) {
+				task = victim.tasks.back();
+				victim.tasks.pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	template <typename F>
+	void work(size_t worker, F & task)
+	{
+		size_t index;
+		while (pop(worker, index) || steal(worker, index))
+			task(index);
+	}
+
+	std::vector<task_queue> m_queues;
+};
+
+static std::string json_string(const std::string & value)
+{
+	std::string out = "\"";
+	for (size_t i = 0; i < value.size(); i++) {
+		unsigned char c = value[i];
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if (c < 0x20) {
+			char escaped[8];
+			snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+			out += escaped;
+		} else {
+			out += c;
+		}
+	}
+	return out + "\"";
+}
+
+static std::string basename_without_extension(const std::string & path)
+{
+	std::string name = path;
+	size_t sep = name.find_last_of("/\\");
+	if (sep != std::string::npos)
+		name = name.substr(sep + 1);
+	size_t ext = name.rfind('.');
+	if (ext != std::string::npos && ext > 0)
+		name = name.substr(0, ext);
+	return name;
+}
+
+static std::string directory_of(const std::string & path)
+{
+	size_t sep = path.find_last_of("/\\");
+	return sep == std::string::npos? std::string() : path.substr(0, sep);
+}
+
+static long long file_size(const std::string & path)
+{
+	struct stat st;
+	return stat(path.c_str(), &st) == 0? (long long) st.st_size : 0;
+}
+
+// Same rule as the importer: every top-level group holds layers only, or
+// groups too when they are written as frames
+static bool is_sprite_frames(const struct psd_document * doc, bool group_frames)
+{
+	struct psd_node_iter animations;
+	psd_node_iter_children(&animations, doc, -1);
+	for (const struct psd_node * animation = psd_node_iter_next(&animations); animation; animation = psd_node_iter_next(&animations)) {
+		if (!animation->is_group)
+			continue;
+
+		struct psd_node_iter frames;
+		psd_node_iter_children(&frames, doc, psd_document_node_index(doc, animation));
+		for (const struct psd_node * frame = psd_node_iter_next(&frames); frame; frame = psd_node_iter_next(&frames)) {
+			if (frame->is_group && !group_frames)
+				return false;
+		}
+	}
+	return true;
+}
+
+static bool write_frames_manifest(const std::string & path, const std::string & source, const struct psd_document * doc,
+                                  const struct psd_export_options * options, const struct psd_export_report * report)
+{
+	std::map<std::string, const struct psd_export_frame *> frames_by_name;
+	for (int i = 0; i < report->frame_count; i++)
+		frames_by_name[report->frames[i].name] = &report->frames[i];
+
+	std::ofstream out(path.c_str(), std::ios::trunc);
+	bool sprite_frames = is_sprite_frames(doc, options->group_frames != 0);
+	out << "{\n";
+	out << "\t\"source\": " << json_string(source) << ",\n";
+	out << "\t\"width\": " << psd_document_width(doc) << ",\n";
+	out << "\t\"height\": " << psd_document_height(doc) << ",\n";
+	out << "\t\"sprite_frames\": " << (sprite_frames? "true" : "false") << ",\n";
+	out << "\t\"animations\": {";
+
+	const char * animation_sep = "\n";
+	struct psd_node_iter animations;
+	psd_node_iter_children(&animations, doc, -1);
+	for (const struct psd_node * animation = psd_node_iter_next(&animations); sprite_frames && animation; animation = psd_node_iter_next(&animations)) {
+		if (!animation->is_group)
+			continue;
+
+		std::string animation_name = psd_document_node_name(doc, animation);
+		out << animation_sep << "\t\t" << json_string(animation_name) << ": [";
+		animation_sep = ",\n";
+
+		const char * frame_sep = "\n";
+		struct psd_node_iter frames;
+		psd_node_iter_children(&frames, doc, psd_document_node_index(doc, animation));
+		for (const struct psd_node * frame = psd_node_iter_next(&frames); frame; frame = psd_node_iter_next(&frames)) {
+			std::string name = animation_name + "/" + psd_document_node_name(doc, frame);
+			std::map<std::string, const struct psd_export_frame *>::const_iterator found = frames_by_name.find(name);
+			if (found == frames_by_name.end())
+				continue;
+			const struct psd_export_frame * f = found->second;
+			out << frame_sep << "\t\t\t{\"name\": " << json_string(name)
+			    << ", \"file\": " << json_string(std::string(f->file) + psd_texture_format_extension(report->texture_format))
+			    << ", \"region\": [" << f->offset_x << ", " << f->offset_y << ", " << f->width << ", " << f->height << "]"
+			    << ", \"layer_size\": [" << f->layer_width << ", " << f->layer_height << "]}";
+			frame_sep = ",\n";
+		}
+		out << "\n\t\t]";
+	}
+	out << "\n\t}\n}\n";
+	return out.good();
+}
+
+static bool process_file(const std::string & path, const cli_options & options, int threads)
+{
+	std::string name = basename_without_extension(path);
+	std::string dir = options.out_dir.empty()? directory_of(path) : options.out_dir;
+	dir = dir.empty()? name : dir + "/" + name;
+
+	struct psd_parser * parser = psd_parser_new(path.c_str());
+	struct psd_document * doc = parser? psd_parser_parse_with_options(parser, &options.parse) : NULL;
+	psd_parser_free(parser);
+	if (doc == NULL) {
+		fprintf(stderr, "%s: cannot parse\n", path.c_str());
+		return false;
+	}
+
+	struct psd_export_options export_options = options.export_options;
+	export_options.threads = threads;
+	struct psd_export_report report;
+	bool ok = psd_document_export_layers(doc, dir.c_str(), &export_options, &report) >= 0;
+	if (!ok) {
+		fprintf(stderr, "%s: cannot export layers to %s\n", path.c_str(), dir.c_str());
+	} else {
+		ok = write_frames_manifest(dir + "/frames.json", path, doc, &export_options, &report);
+		if (!ok) {
+			fprintf(stderr, "%s: cannot write %s/frames.json\n", path.c_str(), dir.c_str());
+		} else if (report.metadata_failed) {
+			fprintf(stderr, "%s: cannot write %s/%s.psdmeta\n", path.c_str(), dir.c_str(), name.c_str());
+			ok = false;
+		} else {
+			printf("%s: %d layers, %d changed\n", path.c_str(), report.frame_count, report.changed_count);
+		}
+		psd_export_report_free(&report);
+	}
+	psd_document_free(doc);
+	return ok;
+}
+
+static void usage(const char * program)
+{
+	fprintf(stderr,
+	        "usage: %s [-j jobs] [-o dir] [--lazy] [--trim] [--dedup] [--incremental]\n"
+	        "       [--bake] [--group-frames] [--metadata]\n"
+	        "       [--png-profile default|fast|store|small]\n"
+	        "       [--texture-format png|dxt5|etc2] [--include glob]... [--exclude glob]...\n"
+	        "       [--visible-only] file.psd...\n", program);
+}
+
+static bool parse_png_profile(const char * name, int * profile)
+{
+	static const char * const names[] = { "default", "fast", "store", "small" };
+	static const int profiles[] = { psd_png_default, psd_png_fast, psd_png_store, psd_png_small };
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (strcmp(name, names[i]) == 0) {
+			*profile = profiles[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool parse_texture_format(const char * name, int * format)
+{
+	static const char * const names[] = { "png", "dxt5", "etc2" };
+	static const int formats[] = { psd_texture_png, psd_texture_dxt5, psd_texture_etc2 };
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (strcmp(name, names[i]) == 0) {
+			*format = formats[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+int main(int argc, char ** argv)
+{
+	cli_options options;
+	options.jobs = 0;
+	psd_parse_options_init(&options.parse);
+	psd_export_options_init(&options.export_options);
+	psd_layer_filter_init(&options.filter);
+
+	std::vector<std::string> files;
+	for (int i = 1; i < argc; i++) {
+		const char * arg = argv[i];
+		if (strcmp(arg, "-j") == 0 && i + 1 < argc) {
+			options.jobs = atoi(argv[++i]);
+		} else if (strcmp(arg, "-o") == 0 && i + 1 < argc) {
+			options.out_dir = argv[++i];
+		} else if (strcmp(arg, "--lazy") == 0) {
+			options.parse.lazy = 1;
+		} else if (strcmp(arg, "--trim") == 0) {
+			options.export_options.trim = 1;
+		} else if (strcmp(arg, "--bake") == 0) {
+			options.export_options.bake = 1;
+		} else if (strcmp(arg, "--group-frames") == 0) {
+			options.export_options.group_frames = 1;
+		} else if (strcmp(arg, "--metadata") == 0) {
+			options.export_options.metadata = 1;
+		} else if (strcmp(arg, "--dedup") == 0) {
+			options.export_options.dedup = 1;
+		} else if (strcmp(arg, "--incremental") == 0) {
+			options.export_options.incremental = 1;
+		} else if (strcmp(arg, "--png-profile") == 0 && i + 1 < argc) {
+			if (!parse_png_profile(argv[++i], &options.export_options.png_profile)) {
+				usage(argv[0]);
+				return 2;
+			}
+		} else if (strcmp(arg, "--texture-format") == 0 && i + 1 < argc) {
+			if (!parse_texture_format(argv[++i], &options.export_options.texture_format)) {
+				usage(argv[0]);
+				return 2;
+			}
+		} else if (strcmp(arg, "--include") == 0 && i + 1 < argc) {
+			options.include.push_back(argv[++i]);
+		} else if (strcmp(arg, "--exclude") == 0 && i + 1 < argc) {
+			options.exclude.push_back(argv[++i]);
+		} else if (strcmp(arg, "--visible-only") == 0) {
+			options.filter.visible_only = 1;
+		} else if (arg[0] == '-') {
+			usage(argv[0]);
+			return 2;
+		} else {
+			files.push_back(arg);
+		}
+	}
+	if (files.empty()) {
+		usage(argv[0]);
+		return 2;
+	}
+	if (!options.include.empty() || !options.exclude.empty() || options.filter.visible_only) {
+		options.filter.include = options.include.empty()? NULL : options.include.data();
+		options.filter.include_count = options.include.size();
+		options.filter.exclude = options.exclude.empty()? NULL : options.exclude.data();
+		options.filter.exclude_count = options.exclude.size();
+		options.export_options.filter = &options.filter;
+	}
+
+	size_t jobs = options.jobs > 0? options.jobs : std::thread::hardware_concurrency();
+	if (jobs == 0)
+		jobs = 1;
+	if (jobs > files.size())
+		jobs = files.size();
+
+	// biggest files first, so that they do not end up last on a worker
+	std::vector<std::pair<long long, std::string> > by_size;
+	for (size_t i = 0; i < files.size(); i++)
+		by_size.push_back(std::make_pair(-file_size(files[i]), files[i]));
+	std::sort(by_size.begin(), by_size.end());
+
+	// a single file gets all the threads for its layers, several files one
+	// thread each
+	int layer_threads = files.size() == 1? options.jobs : 1;
+
+	std::atomic<int> n_failed(0);
+	work_stealing_pool pool(jobs);
+	pool.deal(by_size.size());
+	pool.run([&](size_t i) {
+		if (!process_file(by_size[i].second, options, layer_threads))
+			n_failed++;
+	});
+
+	if (n_failed != 0) {
+		fprintf(stderr, "%d of %d files failed\n", (int) n_failed, (int) files.size());
+		return 1;
+	}
+	return 0;
+}
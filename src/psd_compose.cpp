@@ -0,0 +1,949 @@
+#include "psd_compose.h"
+
+#include "psd_reader.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PSD_COMPOSE_SSE2
+#endif
+
+namespace {
+
+enum blend_mode {
+	blend_normal,
+	blend_darken,
+	blend_multiply,
+	blend_color_burn,
+	blend_linear_burn,
+	blend_darker_color,
+	blend_lighten,
+	blend_screen,
+	blend_color_dodge,
+	blend_linear_dodge,
+	blend_lighter_color,
+	blend_overlay,
+	blend_soft_light,
+	blend_hard_light,
+	blend_vivid_light,
+	blend_linear_light,
+	blend_pin_light,
+	blend_hard_mix,
+	blend_difference,
+	blend_exclusion,
+	blend_subtract,
+	blend_divide,
+	blend_hue,
+	blend_saturation,
+	blend_color,
+	blend_luminosity,
+	blend_pass_through,
+};
+
+struct blend_key {
+	const char * key;
+	int mode;
+};
+
+// dissolve needs a random pattern nobody wants in a sprite, it is drawn normally
+const blend_key blend_keys[] = {
+	{"norm", blend_normal}, {"diss", blend_normal}, {"dark", blend_darken}, {"mul ", blend_multiply},
+	{"idiv", blend_color_burn}, {"lbrn", blend_linear_burn}, {"dkCl", blend_darker_color}, {"lite", blend_lighten},
+	{"scrn", blend_screen}, {"div ", blend_color_dodge}, {"lddg", blend_linear_dodge}, {"lgCl", blend_lighter_color},
+	{"over", blend_overlay}, {"sLit", blend_soft_light}, {"hLit", blend_hard_light}, {"vLit", blend_vivid_light},
+	{"lLit", blend_linear_light}, {"pLit", blend_pin_light}, {"hMix", blend_hard_mix}, {"diff", blend_difference},
+	{"smud", blend_exclusion}, {"fsub", blend_subtract}, {"fdiv", blend_divide}, {"hue ", blend_hue},
+	{"sat ", blend_saturation}, {"colr", blend_color}, {"lum ", blend_luminosity}, {"pass", blend_pass_through},
+};
+
+int blend_mode_from_key(const char * key)
+{
+	for (size_t i = 0; i < sizeof(blend_keys) / sizeof(blend_keys[0]); i++) {
+		if (memcmp(key, blend_keys[i].key, 4) == 0)
+			return blend_keys[i].mode;
+	}
+	return blend_normal;
+}
+
+int blend_mode_from_libpsd(psd_blend_mode mode)
+{
+	switch (mode) {
+	case psd_blend_mode_darken: return blend_darken;
+	case psd_blend_mode_multiply: return blend_multiply;
+	case psd_blend_mode_color_burn: return blend_color_burn;
+	case psd_blend_mode_linear_burn: return blend_linear_burn;
+	case psd_blend_mode_lighten: return blend_lighten;
+	case psd_blend_mode_screen: return blend_screen;
+	case psd_blend_mode_color_dodge: return blend_color_dodge;
+	case psd_blend_mode_linear_dodge: return blend_linear_dodge;
+	case psd_blend_mode_overlay: return blend_overlay;
+	case psd_blend_mode_soft_light: return blend_soft_light;
+	case psd_blend_mode_hard_light: return blend_hard_light;
+	case psd_blend_mode_vivid_light: return blend_vivid_light;
+	case psd_blend_mode_linear_light: return blend_linear_light;
+	case psd_blend_mode_pin_light: return blend_pin_light;
+	case psd_blend_mode_hard_mix: return blend_hard_mix;
+	case psd_blend_mode_difference: return blend_difference;
+	case psd_blend_mode_exclusion: return blend_exclusion;
+	case psd_blend_mode_hue: return blend_hue;
+	case psd_blend_mode_saturation: return blend_saturation;
+	case psd_blend_mode_color: return blend_color;
+	case psd_blend_mode_luminosity: return blend_luminosity;
+	case psd_blend_mode_pass_through: return blend_pass_through;
+	default: return blend_normal;
+	}
+}
+
+// What compositing needs from a layer or folder record
+struct layer_style {
+	bool visible; // the record's own flag, not folded with its groups
+	int blend_mode;
+	float opacity; // layer opacity times fill opacity
+	bool clipping;
+	bool mask; // has an enabled user mask
+	pixel_rect mask_rect; // in document coordinates
+	uint8_t mask_default; // outside mask_rect
+};
+
+bool load_style(const struct psd_document * doc, int record, layer_style & style)
+{
+	if (!open_pixel_source(doc))
+		return false;
+
+	if (doc->reader) {
+		if (record < 0 || record >= (int) doc->reader->layers().size())
+			return false;
+		const psd_layer_ref & layer = doc->reader->layers()[record];
+		style.visible = layer.visible();
+		style.blend_mode = blend_mode_from_key(layer.blend_mode);
+		style.opacity = layer.opacity / 255.0f * (layer.fill_opacity / 255.0f);
+		style.clipping = layer.clipping != 0;
+		style.mask = layer.mask_enabled() && layer.mask_width() > 0 && layer.mask_height() > 0;
+		pixel_rect mask_rect = {layer.mask_left, layer.mask_top, layer.mask_width(), layer.mask_height()};
+		style.mask_rect = mask_rect;
+		style.mask_default = layer.mask_default_color;
+		return true;
+	}
+
+	if (record < 0 || record >= doc->context->layer_count)
+		return false;
+	const psd_layer_record & layer = doc->context->layer_records[record];
+	const psd_layer_mask_info & mask = layer.layer_mask_info;
+	style.visible = layer.visible != 0;
+	style.blend_mode = blend_mode_from_libpsd(layer.blend_mode);
+	style.opacity = layer.opacity / 255.0f * (layer.fill_opacity / 255.0f);
+	style.clipping = layer.clipping != 0;
+	style.mask = mask.mask_data != NULL && !mask.disabled && mask.width > 0 && mask.height > 0;
+	pixel_rect mask_rect = {mask.left, mask.top, mask.width, mask.height};
+	style.mask_rect = mask_rect;
+	style.mask_default = mask.default_color;
+	return true;
+}
+
+bool load_mask(const struct psd_document * doc, int record, const layer_style & style, std::vector<uint8_t> & mask)
+{
+	mask.resize((size_t) style.mask_rect.width * style.mask_rect.height);
+	if (doc->reader)
+		return doc->reader->decode_layer_mask(record, mask.data());
+	memcpy(mask.data(), doc->context->layer_records[record].layer_mask_info.mask_data, mask.size());
+	return true;
+}
+
+// Coverage of count pixels of document row y from x on, 255 without a mask
+void mask_row(const layer_style & style, const std::vector<uint8_t> & mask, int x, int y, int count, uint8_t * coverage)
+{
+	if (!style.mask) {
+		memset(coverage, 255, count);
+		return;
+	}
+	const pixel_rect & rect = style.mask_rect;
+	if (y < rect.y || y >= rect.y + rect.height) {
+		memset(coverage, style.mask_default, count);
+		return;
+	}
+	const uint8_t * row = &mask[(size_t) (y - rect.y) * rect.width];
+	for (int i = 0; i < count; i++) {
+		int mx = x + i - rect.x;
+		coverage[i] = mx >= 0 && mx < rect.width? row[mx] : style.mask_default;
+	}
+}
+
+bool intersect(const pixel_rect & a, const pixel_rect & b, pixel_rect & out)
+{
+	int left = a.x > b.x? a.x : b.x;
+	int top = a.y > b.y? a.y : b.y;
+	int right = a.x + a.width < b.x + b.width? a.x + a.width : b.x + b.width;
+	int bottom = a.y + a.height < b.y + b.height? a.y + a.height : b.y + b.height;
+	out.x = left;
+	out.y = top;
+	out.width = right > left? right - left : 0;
+	out.height = bottom > top? bottom - top : 0;
+	return out.width > 0 && out.height > 0;
+}
+
+pixel_rect unite(const pixel_rect & a, const pixel_rect & b)
+{
+	if (a.width <= 0 || a.height <= 0)
+		return b;
+	if (b.width <= 0 || b.height <= 0)
+		return a;
+	int left = a.x < b.x? a.x : b.x;
+	int top = a.y < b.y? a.y : b.y;
+	int right = a.x + a.width > b.x + b.width? a.x + a.width : b.x + b.width;
+	int bottom = a.y + a.height > b.y + b.height? a.y + a.height : b.y + b.height;
+	pixel_rect out = {left, top, right - left, bottom - top};
+	return out;
+}
+
+pixel_layer node_layer(const struct psd_document * doc, int node)
+{
+	const psd_node & n = doc->nodes[node];
+	pixel_layer layer = {doc->node_records[node], node, NULL, n.visible != 0, n.x, n.y, n.width, n.height};
+	return layer;
+}
+
+// Four floats, one pixel in the byte order of 0xAARRGGBB words: blue, green,
+// red, alpha. Masks from the comparisons select lanes.
+#ifdef PSD_COMPOSE_SSE2
+struct vec4 {
+	__m128 v;
+
+	vec4() {}
+	vec4(__m128 value) : v(value) {}
+	explicit vec4(float value) : v(_mm_set1_ps(value)) {}
+
+	static vec4 load(const float * p) { return _mm_loadu_ps(p); }
+	void store(float * p) const { _mm_storeu_ps(p, v); }
+	float alpha() const { return _mm_cvtss_f32(_mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3))); }
+	vec4 splat_alpha() const { return _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3)); }
+};
+
+inline vec4 operator+(vec4 a, vec4 b) { return _mm_add_ps(a.v, b.v); }
+inline vec4 operator-(vec4 a, vec4 b) { return _mm_sub_ps(a.v, b.v); }
+inline vec4 operator*(vec4 a, vec4 b) { return _mm_mul_ps(a.v, b.v); }
+inline vec4 operator/(vec4 a, vec4 b) { return _mm_div_ps(a.v, b.v); }
+inline vec4 vmin(vec4 a, vec4 b) { return _mm_min_ps(a.v, b.v); }
+inline vec4 vmax(vec4 a, vec4 b) { return _mm_max_ps(a.v, b.v); }
+inline vec4 vsqrt(vec4 a) { return _mm_sqrt_ps(a.v); }
+inline vec4 less_equal(vec4 a, vec4 b) { return _mm_cmple_ps(a.v, b.v); }
+inline vec4 select(vec4 mask, vec4 a, vec4 b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+
+inline vec4 with_alpha(vec4 color, vec4 alpha)
+{
+	const __m128 lane = _mm_castsi128_ps(_mm_setr_epi32(0, 0, 0, -1));
+	return select(lane, alpha, color);
+}
+
+inline vec4 unpack_argb(uint32_t color)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i bytes = _mm_cvtsi32_si128((int) color);
+	return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero));
+}
+
+// from values already rounded and clamped to [0, 255]
+inline uint32_t pack_argb(vec4 value)
+{
+	__m128i words = _mm_cvttps_epi32(value.v);
+	words = _mm_packs_epi32(words, words);
+	return (uint32_t) _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+}
+#else
+struct vec4 {
+	float v[4];
+
+	vec4() {}
+	explicit vec4(float value) { v[0] = v[1] = v[2] = v[3] = value; }
+
+	static vec4 load(const float * p) { vec4 r; memcpy(r.v, p, sizeof(r.v)); return r; }
+	void store(float * p) const { memcpy(p, v, sizeof(v)); }
+	float alpha() const { return v[3]; }
+	vec4 splat_alpha() const { return vec4(v[3]); }
+};
+
+#define VEC4_LANES(expr) vec4 r; for (int i = 0; i < 4; i++) r.v[i] = (expr); return r
+
+inline vec4 operator+(vec4 a, vec4 b) { VEC4_LANES(a.v[i] + b.v[i]); }
+inline vec4 operator-(vec4 a, vec4 b) { VEC4_LANES(a.v[i] - b.v[i]); }
+inline vec4 operator*(vec4 a, vec4 b) { VEC4_LANES(a.v[i] * b.v[i]); }
+inline vec4 operator/(vec4 a, vec4 b) { VEC4_LANES(a.v[i] / b.v[i]); }
+inline vec4 vmin(vec4 a, vec4 b) { VEC4_LANES(a.v[i] < b.v[i]? a.v[i] : b.v[i]); }
+inline vec4 vmax(vec4 a, vec4 b) { VEC4_LANES(a.v[i] > b.v[i]? a.v[i] : b.v[i]); }
+inline vec4 vsqrt(vec4 a) { VEC4_LANES(sqrtf(a.v[i])); }
+inline vec4 less_equal(vec4 a, vec4 b) { VEC4_LANES(a.v[i] <= b.v[i]? 1.0f : 0.0f); }
+inline vec4 select(vec4 mask, vec4 a, vec4 b) { VEC4_LANES(mask.v[i] != 0? a.v[i] : b.v[i]); }
+
+#undef VEC4_LANES
+
+inline vec4 with_alpha(vec4 color, vec4 alpha)
+{
+	color.v[3] = alpha.v[3];
+	return color;
+}
+
+inline vec4 unpack_argb(uint32_t color)
+{
+	vec4 r;
+	for (int i = 0; i < 4; i++)
+		r.v[i] = (float) ((color >> (i * 8)) & 0xff);
+	return r;
+}
+
+inline uint32_t pack_argb(vec4 value)
+{
+	uint32_t color = 0;
+	for (int i = 0; i < 4; i++)
+		color |= (uint32_t) value.v[i] << (i * 8);
+	return color;
+}
+#endif
+
+// Separable blend functions of the backdrop cb and the source cs, as in the
+// W3C compositing spec, which follows Photoshop
+const float epsilon = 1e-6f;
+
+inline vec4 blend_screen_fn(vec4 cb, vec4 cs) { return cb + cs - cb * cs; }
+
+inline vec4 blend_hard_light_fn(vec4 cb, vec4 cs)
+{
+	vec4 twice = cs + cs;
+	return select(less_equal(cs, vec4(0.5f)), cb * twice, blend_screen_fn(cb, twice - vec4(1.0f)));
+}
+
+inline vec4 blend_color_dodge_fn(vec4 cb, vec4 cs)
+{
+	vec4 r = vmin(vec4(1.0f), cb / vmax(vec4(1.0f) - cs, vec4(epsilon)));
+	return select(less_equal(cb, vec4(0.0f)), vec4(0.0f), r);
+}
+
+inline vec4 blend_color_burn_fn(vec4 cb, vec4 cs)
+{
+	vec4 r = vec4(1.0f) - vmin(vec4(1.0f), (vec4(1.0f) - cb) / vmax(cs, vec4(epsilon)));
+	return select(less_equal(vec4(1.0f), cb), vec4(1.0f), r);
+}
+
+inline vec4 blend_soft_light_fn(vec4 cb, vec4 cs)
+{
+	vec4 d = select(less_equal(cb, vec4(0.25f)), ((cb * vec4(16.0f) - vec4(12.0f)) * cb + vec4(4.0f)) * cb, vsqrt(cb));
+	vec4 twice = cs + cs;
+	return select(less_equal(cs, vec4(0.5f)),
+		cb - (vec4(1.0f) - twice) * cb * (vec4(1.0f) - cb),
+		cb + (twice - vec4(1.0f)) * (d - cb));
+}
+
+// The non-separable modes mix the channels of a pixel, one pixel at a time
+inline float lum(const float * c) { return 0.11f * c[0] + 0.59f * c[1] + 0.3f * c[2]; }
+
+void clip_color(float * c)
+{
+	float l = lum(c);
+	float n = c[0] < c[1]? (c[0] < c[2]? c[0] : c[2]) : (c[1] < c[2]? c[1] : c[2]);
+	float x = c[0] > c[1]? (c[0] > c[2]? c[0] : c[2]) : (c[1] > c[2]? c[1] : c[2]);
+	for (int i = 0; i < 3; i++) {
+		if (n < 0 && l - n > epsilon)
+			c[i] = l + (c[i] - l) * l / (l - n);
+		if (x > 1 && x - l > epsilon)
+			c[i] = l + (c[i] - l) * (1 - l) / (x - l);
+	}
+}
+
+void set_lum(float * c, float l)
+{
+	float d = l - lum(c);
+	for (int i = 0; i < 3; i++)
+		c[i] += d;
+	clip_color(c);
+}
+
+inline float sat(const float * c)
+{
+	float n = c[0] < c[1]? (c[0] < c[2]? c[0] : c[2]) : (c[1] < c[2]? c[1] : c[2]);
+	float x = c[0] > c[1]? (c[0] > c[2]? c[0] : c[2]) : (c[1] > c[2]? c[1] : c[2]);
+	return x - n;
+}
+
+void set_sat(float * c, float s)
+{
+	float n = c[0] < c[1]? (c[0] < c[2]? c[0] : c[2]) : (c[1] < c[2]? c[1] : c[2]);
+	float range = sat(c);
+	for (int i = 0; i < 3; i++)
+		c[i] = range > epsilon? (c[i] - n) * s / range : 0;
+}
+
+vec4 blend_nonseparable(vec4 cb, vec4 cs, int mode)
+{
+	float b[4];
+	float s[4];
+	cb.store(b);
+	cs.store(s);
+	float * r = b;
+	switch (mode) {
+	case blend_hue:
+		set_sat(s, sat(b));
+		set_lum(s, lum(b));
+		r = s;
+		break;
+	case blend_saturation: {
+		float l = lum(b);
+		set_sat(b, sat(s));
+		set_lum(b, l);
+		break;
+	}
+	case blend_color:
+		set_lum(s, lum(b));
+		r = s;
+		break;
+	case blend_luminosity:
+		set_lum(b, lum(s));
+		break;
+	case blend_darker_color:
+		r = lum(s) < lum(b)? s : b;
+		break;
+	case blend_lighter_color:
+		r = lum(s) > lum(b)? s : b;
+		break;
+	}
+	return vec4::load(r);
+}
+
+// Blends count premultiplied pixels of src, scaled by opacity, onto dst.
+// Over is source-over; atop keeps the coverage of dst, which is how clipped
+// layers are drawn onto the layer they are clipped to.
+template <typename F>
+void blend_span(const float * src, float * dst, int count, float opacity, bool atop, F blend)
+{
+	const vec4 one(1.0f);
+	const vec4 scale(opacity);
+	for (int i = 0; i < count; i++) {
+		vec4 s = vec4::load(src + i * 4) * scale;
+		float as = s.alpha();
+		if (as <= 0)
+			continue;
+		vec4 b = vec4::load(dst + i * 4);
+		float ab = b.alpha();
+		if (ab <= 0) {
+			if (!atop)
+				s.store(dst + i * 4);
+			continue;
+		}
+		vec4 vas(as);
+		vec4 vab(ab);
+		vec4 cs = s / vas;
+		vec4 mixed = blend(b / vab, cs);
+		vec4 r;
+		if (atop)
+			r = with_alpha((cs * (one - vab) + mixed * vab) * (vas * vab) + b * (one - vas), vab);
+		else
+			r = with_alpha(s * (one - vab) + b * (one - vas) + mixed * (vas * vab), vec4(as + ab - as * ab));
+		r.store(dst + i * 4);
+	}
+}
+
+// normal needs neither the division nor the branches
+void blend_span_normal(const float * src, float * dst, int count, float opacity, bool atop)
+{
+	const vec4 one(1.0f);
+	const vec4 scale(opacity);
+	for (int i = 0; i < count; i++) {
+		vec4 s = vec4::load(src + i * 4) * scale;
+		vec4 b = vec4::load(dst + i * 4);
+		vec4 keep = one - s.splat_alpha();
+		vec4 r = atop? s * b.splat_alpha() + b * keep : s + b * keep;
+		r.store(dst + i * 4);
+	}
+}
+
+void blend_span_mode(int mode, const float * src, float * dst, int count, float opacity, bool atop)
+{
+	switch (mode) {
+	case blend_darken:
+		blend_span(src, dst, count, opacity, atop, [](vec4 cb, vec4 cs) { return vmin(cb, cs); });
+		break;
+	case blend_multiply:
+		blend_span(src, dst, count, opacity, atop, [](vec4 cb, vec4 cs) { return cb * cs; });
+		break;
+	case blend_color_burn:
+		blend_span(src, dst, count, opacity, atop, blend_color_burn_fn);
+		break;
+	case blend_linear_burn:
+		blend_span(src, dst, count, opacity, atop, [](vec4 cb, vec4 cs) { return vmax(vec4(0.0f), cb + cs - vec4(1.0f)); });
+		break;
+	case blend_lighten:
+		blend_span(src, dst, count, opacity, atop, [](vec4 cb, vec4 cs) { return vmax(cb, cs); });
+		break;
+	case blend_screen:
+		blend_span(src, dst, count, opacity, atop, blend_screen_fn);
+		break;
+	case blend_color_dodge:
+		blend_span(src, dst, count, opacity, atop, blend_color_dodge_fn);
+		break;
+	case blend_linear_dodge:
+		blend_span(src, dst, count, opacity, atop, [](vec4 cb, vec4 cs) { return vmin(vec4(1.0f), cb + cs); });
+		break;
+	case blend_overlay:
+		blend_span(src, dst, count, opacity, atop, [](vec4 cb, vec4 cs) { return blend_hard_light_fn(cs, cb); });
+		break;
+	case blend_soft_light:
+		blend_span(src, dst, count, opacity, atop, blend_soft_light_fn);
+		break;
+	case blend_hard_light:
+		blend_span(src, dst, count, opacity, atop, blend_hard_light_fn);
+		break;
+	case blend_vivid_light:
+		blend_span(src, dst, count, opacity, atop, [](vec4 cb, vec4 cs) {
+			vec4 twice = cs + cs;
+			return select(less_equal(cs, vec4(0.5f)), blend_color_burn_fn(cb, twice), blend_color_dodge_fn(cb, twice - vec4(1.0f)));
+		});
+		break;
+	case blend_linear_light:
+		blend_span(src, dst, count, opacity, atop, [](vec4 cb, vec4 cs) {
+			return vmin(vec4(1.0f), vmax(vec4(0.0f), cb + cs + cs - vec4(1.0f)));
+		});
+		break;
+	case blend_pin_light:
+		blend_span(src, dst, count, opacity, atop, [](vec4 cb, vec4 cs) {
+			vec4 twice = cs + cs;
+			return select(less_equal(cs, vec4(0.5f)), vmin(cb, twice), vmax(cb, twice - vec4(1.0f)));
+		});
+		break;
+	case blend_hard_mix:
+		blend_span(src, dst, count, opacity, atop, [](vec4 cb, vec4 cs) {
+			return select(less_equal(vec4(1.0f), cb + cs), vec4(1.0f), vec4(0.0f));
+		});
+		break;
+	case blend_difference:
+		blend_span(src, dst, count, opacity, atop, [](vec4 cb, vec4 cs) { return vmax(cb - cs, cs - cb); });
+		break;
+	case blend_exclusion:
+		blend_span(src, dst, count, opacity, atop, [](vec4 cb, vec4 cs) { return cb + cs - (cb + cb) * cs; });
+		break;
+	case blend_subtract:
+		blend_span(src, dst, count, opacity, atop, [](vec4 cb, vec4 cs) { return vmax(vec4(0.0f), cb - cs); });
+		break;
+	case blend_divide:
+		blend_span(src, dst, count, opacity, atop, [](vec4 cb, vec4 cs) {
+			vec4 r = vmin(vec4(1.0f), cb / vmax(cs, vec4(epsilon)));
+			return select(less_equal(cs, vec4(0.0f)), select(less_equal(cb, vec4(0.0f)), vec4(0.0f), vec4(1.0f)), r);
+		});
+		break;
+	case blend_darker_color:
+	case blend_lighter_color:
+	case blend_hue:
+	case blend_saturation:
+	case blend_color:
+	case blend_luminosity:
+		blend_span(src, dst, count, opacity, atop, [mode](vec4 cb, vec4 cs) { return blend_nonseparable(cb, cs, mode); });
+		break;
+	default:
+		blend_span_normal(src, dst, count, opacity, atop);
+		break;
+	}
+}
+
+// Composition works on tiles of the output, each drawn from the bottom up in
+// premultiplied float pixels
+const int tile_size = 64;
+
+struct compose_item {
+	int node; // -1 for the document root
+	bool group;
+	layer_style style;
+	pixel_rect bounds; // what it may cover, in document coordinates
+	pixel_layer layer; // of layers
+	layer_pixels pixels;
+	std::vector<uint8_t> mask;
+	std::vector<size_t> children; // items, bottom-up
+};
+
+struct compose_state {
+	const struct psd_document * doc;
+	std::vector<compose_item> items;
+};
+
+// Adds the item of a node and, for visible groups, of everything inside it.
+// Hidden items stay in their group's list, since they hide the layers
+// clipped to them.
+bool add_item(compose_state & state, int node, size_t & index, bool shown = false)
+{
+	const struct psd_document * doc = state.doc;
+	compose_item item;
+	item.node = node;
+	item.group = doc->nodes[node].is_group != 0;
+	if (!load_style(doc, doc->node_records[node], item.style))
+		return false;
+	item.style.visible = item.style.visible || shown;
+	item.layer = node_layer(doc, node);
+	pixel_rect none = {0, 0, 0, 0};
+	item.bounds = none;
+	index = state.items.size();
+	state.items.push_back(item);
+
+	pixel_rect bounds = none;
+	if (!item.group) {
+		pixel_rect rect = {item.layer.x, item.layer.y, item.layer.width, item.layer.height};
+		bounds = rect;
+	} else if (item.style.visible) {
+		const psd_node & n = doc->nodes[node];
+		for (int i = 0; i < n.children_count; i++) {
+			size_t child;
+			if (!add_item(state, n.first_child + i, child))
+				return false;
+			state.items[index].children.push_back(child);
+			if (state.items[child].style.visible)
+				bounds = unite(bounds, state.items[child].bounds);
+		}
+	}
+	if (item.style.mask && item.style.mask_default == 0 && !intersect(bounds, item.style.mask_rect, bounds))
+		bounds = none;
+	state.items[index].bounds = bounds;
+	return true;
+}
+
+// Visible items below visible groups, the only ones that get drawn
+void collect_drawn(const compose_state & state, size_t index, std::vector<size_t> & drawn)
+{
+	const compose_item & item = state.items[index];
+	if (!item.style.visible)
+		return;
+	drawn.push_back(index);
+	for (size_t i = 0; i < item.children.size(); i++)
+		collect_drawn(state, item.children[i], drawn);
+}
+
+// Scratch tiles of one worker, two per level of nesting
+class tile_scratch {
+public:
+	float * buffer(size_t index)
+	{
+		if (m_buffers.size() <= index)
+			m_buffers.resize(index + 1);
+		if (m_buffers[index].empty())
+			m_buffers[index].resize(tile_size * tile_size * 4);
+		return m_buffers[index].data();
+	}
+
+private:
+	std::vector<std::vector<float> > m_buffers;
+};
+
+void render_item(const compose_state & state, const compose_item & item, const pixel_rect & tile, const pixel_rect & area, float * out, tile_scratch & scratch, size_t next);
+
+void render_layer(const compose_item & item, const pixel_rect & tile, const pixel_rect & area, float * out)
+{
+	memset(out, 0, sizeof(float) * 4 * tile.width * tile.height);
+	const vec4 scale(1 / 255.0f);
+	uint8_t coverage[tile_size];
+	for (int y = area.y; y < area.y + area.height; y++) {
+		const uint32_t * row = item.pixels.data() + (size_t) (y - item.layer.y) * item.layer.width + (area.x - item.layer.x);
+		float * dst = out + ((size_t) (y - tile.y) * tile.width + (area.x - tile.x)) * 4;
+		mask_row(item.style, item.mask, area.x, y, area.width, coverage);
+		for (int x = 0; x < area.width; x++) {
+			vec4 color = unpack_argb(row[x]) * scale;
+			float alpha = color.alpha() * coverage[x] * (1 / 255.0f);
+			with_alpha(color * vec4(alpha), vec4(alpha)).store(dst + x * 4);
+		}
+	}
+}
+
+// Multiplies premultiplied pixels by the mask of a group
+void apply_mask(const compose_item & item, const pixel_rect & tile, const pixel_rect & area, float * out)
+{
+	if (!item.style.mask)
+		return;
+	uint8_t coverage[tile_size];
+	for (int y = area.y; y < area.y + area.height; y++) {
+		float * dst = out + ((size_t) (y - tile.y) * tile.width + (area.x - tile.x)) * 4;
+		mask_row(item.style, item.mask, area.x, y, area.width, coverage);
+		for (int x = 0; x < area.width; x++)
+			(vec4::load(dst + x * 4) * vec4(coverage[x] * (1 / 255.0f))).store(dst + x * 4);
+	}
+}
+
+void blend_area(const float * src, float * dst, const pixel_rect & tile, const pixel_rect & area, const layer_style & style, bool atop)
+{
+	for (int y = area.y; y < area.y + area.height; y++) {
+		size_t offset = ((size_t) (y - tile.y) * tile.width + (area.x - tile.x)) * 4;
+		blend_span_mode(style.blend_mode, src + offset, dst + offset, area.width, style.opacity, atop);
+	}
+}
+
+// Draws the children of a group into out, each clipping group onto its base
+// before the base goes onto the rest. Pass-through groups are drawn on their
+// own like normal ones.
+void render_children(const compose_state & state, const compose_item & group, const pixel_rect & tile, float * out, tile_scratch & scratch, size_t next)
+{
+	memset(out, 0, sizeof(float) * 4 * tile.width * tile.height);
+	float * base_buffer = scratch.buffer(next);
+	float * clip_buffer = scratch.buffer(next + 1);
+	const compose_item * base = NULL;
+	pixel_rect base_area;
+	bool base_hidden = false;
+
+	for (size_t i = 0; i < group.children.size(); i++) {
+		const compose_item & child = state.items[group.children[i]];
+		pixel_rect area;
+		bool drawn = child.style.visible && intersect(child.bounds, tile, area);
+		if (child.style.clipping && (base || base_hidden)) {
+			if (base && drawn) {
+				render_item(state, child, tile, area, clip_buffer, scratch, next + 2);
+				blend_area(clip_buffer, base_buffer, tile, area, child.style, true);
+			}
+			continue;
+		}
+
+		if (base)
+			blend_area(base_buffer, out, tile, base_area, base->style, false);
+		base = NULL;
+		base_hidden = !drawn;
+		if (drawn) {
+			render_item(state, child, tile, area, base_buffer, scratch, next + 2);
+			base = &child;
+			base_area = area;
+		}
+	}
+	if (base)
+		blend_area(base_buffer, out, tile, base_area, base->style, false);
+}
+
+void render_item(const compose_state & state, const compose_item & item, const pixel_rect & tile, const pixel_rect & area, float * out, tile_scratch & scratch, size_t next)
+{
+	if (!item.group) {
+		render_layer(item, tile, area, out);
+		return;
+	}
+	render_children(state, item, tile, out, scratch, next);
+	apply_mask(item, tile, area, out);
+}
+
+void store_tile(const float * tile_pixels, const pixel_rect & tile, const pixel_rect & bounds, float opacity, uint32_t * pixels)
+{
+	const vec4 zero(0.0f);
+	const vec4 max(255.0f);
+	const vec4 half(0.5f);
+	for (int y = 0; y < tile.height; y++) {
+		const float * src = tile_pixels + (size_t) y * tile.width * 4;
+		uint32_t * dst = pixels + (size_t) (tile.y - bounds.y + y) * bounds.width + (tile.x - bounds.x);
+		for (int x = 0; x < tile.width; x++) {
+			vec4 p = vec4::load(src + x * 4);
+			float alpha = p.alpha() * opacity;
+			if (alpha <= 0) {
+				dst[x] = 0;
+				continue;
+			}
+			vec4 straight = with_alpha(p * vec4(255.0f / p.alpha()), vec4(alpha * 255.0f));
+			dst[x] = pack_argb(vmin(max, vmax(zero, straight)) + half);
+		}
+	}
+}
+
+// Items of a group node, or of the whole document for -1, the root first.
+// The group is drawn whatever its own visibility, but keeps its opacity and
+// mask; the document root is a group of the top-level nodes.
+bool build_items(const struct psd_document * doc, int node, compose_state & state)
+{
+	if (!open_pixel_source(doc))
+		return false;
+
+	state.doc = doc;
+	state.items.reserve(doc->nodes.size() + 1);
+	size_t root = 0;
+	if (node >= 0)
+		return node < (int) doc->nodes.size() && doc->nodes[node].is_group && add_item(state, node, root, true);
+
+	compose_item item;
+	item.node = -1;
+	item.group = true;
+	layer_style style = {true, blend_normal, 1.0f, false, false, {0, 0, 0, 0}, 255};
+	item.style = style;
+	pixel_rect none = {0, 0, 0, 0};
+	item.bounds = none;
+	state.items.push_back(item);
+	for (int i = 0; i < doc->children_count; i++) {
+		size_t child;
+		if (!add_item(state, i, child))
+			return false;
+		state.items[root].children.push_back(child);
+		if (state.items[child].style.visible)
+			state.items[root].bounds = unite(state.items[root].bounds, state.items[child].bounds);
+	}
+	return true;
+}
+
+// nothing visible still gives a pixel, like a transparent layer
+pixel_rect composite_bounds(const compose_state & state)
+{
+	pixel_rect bounds = state.items[0].bounds;
+	if (bounds.width <= 0 || bounds.height <= 0) {
+		int node = state.items[0].node;
+		pixel_rect pixel = {node >= 0? state.doc->nodes[node].x : 0, node >= 0? state.doc->nodes[node].y : 0, 1, 1};
+		bounds = pixel;
+	}
+	return bounds;
+}
+
+int find_group_node(const struct psd_document * doc, const char * path)
+{
+	size_t group = 0;
+	for (size_t i = 0; i < doc->nodes.size(); i++) {
+		if (!doc->nodes[i].is_group)
+			continue;
+		if (group < doc->groups.size() && strcmp(doc->groups[group], path) == 0)
+			return (int) i;
+		group++;
+	}
+	return -1;
+}
+
+}
+
+bool bake_layer(const struct psd_document * doc, const pixel_layer & layer, uint32_t * pixels)
+{
+	int node = layer.node;
+	layer_style style;
+	if (node < 0 || node >= (int) doc->nodes.size() || !load_style(doc, layer.record, style))
+		return false;
+	std::vector<uint8_t> mask;
+	if (style.mask && !load_mask(doc, layer.record, style, mask))
+		return false;
+
+	// a clipped layer is cut to the first layer below it that is not clipped
+	// itself; clipping to a group is left alone
+	int base_node = -1;
+	if (style.clipping) {
+		int parent = doc->nodes[node].parent;
+		int first = parent < 0? 0 : doc->nodes[parent].first_child;
+		for (int k = node - 1; k >= first; k--) {
+			layer_style sibling;
+			if (!load_style(doc, doc->node_records[k], sibling))
+				return false;
+			if (!sibling.clipping) {
+				if (!doc->nodes[k].is_group)
+					base_node = k;
+				break;
+			}
+		}
+	}
+
+	pixel_layer base = {0, -1, NULL, false, 0, 0, 0, 0};
+	layer_style base_style;
+	layer_pixels base_pixels;
+	std::vector<uint8_t> base_mask;
+	float opacity = style.opacity;
+	if (base_node >= 0) {
+		base = node_layer(doc, base_node);
+		if (!load_style(doc, base.record, base_style) || !base_pixels.load(doc, base))
+			return false;
+		if (base_style.mask && !load_mask(doc, base.record, base_style, base_mask))
+			return false;
+		opacity *= base_style.opacity;
+	}
+
+	uint8_t factor = (uint8_t) (opacity * 255 + 0.5f);
+	if (factor == 255 && !style.mask && base_node < 0)
+		return true;
+
+	std::vector<uint8_t> coverage(base_node >= 0 || style.mask? layer.width : 0);
+	std::vector<uint8_t> base_coverage(base_node >= 0? layer.width : 0);
+	for (int y = 0; y < layer.height; y++) {
+		uint32_t * row = pixels + (size_t) y * layer.width;
+		int doc_y = layer.y + y;
+		if (!coverage.empty())
+			mask_row(style, mask, layer.x, doc_y, layer.width, coverage.data());
+		if (base_node >= 0) {
+			mask_row(base_style, base_mask, layer.x, doc_y, layer.width, base_coverage.data());
+			const uint32_t * base_row = doc_y >= base.y && doc_y < base.y + base.height?
+				base_pixels.data() + (size_t) (doc_y - base.y) * base.width : NULL;
+			for (int x = 0; x < layer.width; x++) {
+				int base_x = layer.x + x - base.x;
+				uint32_t alpha = base_row && base_x >= 0 && base_x < base.width? base_row[base_x] >> 24 : 0;
+				uint32_t t = alpha * base_coverage[x] * coverage[x];
+				coverage[x] = (uint8_t) ((t + 255 * 255 / 2) / (255 * 255));
+			}
+		}
+		argb_scale_alpha(row, layer.width, coverage.empty()? NULL : coverage.data(), factor);
+	}
+	return true;
+}
+
+bool compose_group(const struct psd_document * doc, int node, int threads, pixel_rect & bounds, std::vector<uint32_t> & pixels)
+{
+	compose_state state;
+	if (!build_items(doc, node, state))
+		return false;
+	const size_t root = 0;
+
+	std::vector<size_t> drawn;
+	collect_drawn(state, root, drawn);
+	std::atomic<bool> failed(false);
+	run_parallel(drawn.size(), threads, [&](size_t i) {
+		compose_item & item = state.items[drawn[i]];
+		if (item.node < 0 || item.bounds.width <= 0)
+			return;
+		int record = doc->node_records[item.node];
+		if ((!item.group && !item.pixels.load(doc, item.layer)) || (item.style.mask && !load_mask(doc, record, item.style, item.mask)))
+			failed = true;
+	});
+	if (failed)
+		return false;
+
+	const compose_item & top = state.items[root];
+	bounds = composite_bounds(state);
+	pixels.assign((size_t) bounds.width * bounds.height, 0);
+	if (top.bounds.width <= 0 || top.bounds.height <= 0)
+		return true;
+
+	size_t columns = (bounds.width + tile_size - 1) / tile_size;
+	size_t rows = (bounds.height + tile_size - 1) / tile_size;
+	run_parallel(columns * rows, threads, [&](size_t i) {
+		pixel_rect tile;
+		tile.x = bounds.x + (int) (i % columns) * tile_size;
+		tile.y = bounds.y + (int) (i / columns) * tile_size;
+		tile.width = bounds.x + bounds.width - tile.x < tile_size? bounds.x + bounds.width - tile.x : tile_size;
+		tile.height = bounds.y + bounds.height - tile.y < tile_size? bounds.y + bounds.height - tile.y : tile_size;
+		tile_scratch scratch;
+		float * out = scratch.buffer(0);
+		render_item(state, top, tile, tile, out, scratch, 1);
+		store_tile(out, tile, bounds, top.style.opacity, pixels.data());
+	});
+	return true;
+}
+
+bool compose_bounds(const struct psd_document * doc, int node, pixel_rect & bounds)
+{
+	compose_state state;
+	if (!build_items(doc, node, state))
+		return false;
+	bounds = composite_bounds(state);
+	return true;
+}
+
+int psd_document_composite_group(const struct psd_document * doc, const char * group, int threads, struct psd_composite * composite)
+{
+	if (doc == NULL || composite == NULL)
+		return -1;
+	composite->x = 0;
+	composite->y = 0;
+	composite->width = 0;
+	composite->height = 0;
+	composite->rgba = NULL;
+
+	int node = -1;
+	if (group != NULL && (node = find_group_node(doc, group)) < 0)
+		return -1;
+	pixel_rect bounds;
+	std::vector<uint32_t> pixels;
+	if (!compose_group(doc, node, threads, bounds, pixels))
+		return -1;
+
+	composite->rgba = (unsigned char *) psd_alloc((size_t) bounds.width * bounds.height * 4);
+	if (composite->rgba == NULL)
+		return -1;
+	argb_to_rgba(pixels.data(), bounds.width, bounds.width, bounds.height, composite->rgba, (size_t) bounds.width * 4);
+	composite->x = bounds.x;
+	composite->y = bounds.y;
+	composite->width = bounds.width;
+	composite->height = bounds.height;
+	return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef PSD_COMPOSE_H
+#define PSD_COMPOSE_H
+
+#include "pixel_ops.h"
+#include "psd_document.h"
+
+#include <stdint.h>
+
+#include <vector>
+
+// Applies the opacity, fill opacity and user mask of a layer to its pixels,
+// and cuts a layer clipped to the one below it to the pixels of that layer.
+// Blend modes need a backdrop and are left to compose_group.
+bool bake_layer(const struct psd_document * doc, const pixel_layer & layer, uint32_t * pixels);
+
+// Flattens the visible children of a group node, or of the whole document
+// for -1, as Photoshop shows them: blend modes, opacities, masks and clipping
+// included. bounds is set to the area they cover, pixels to its 0xAARRGGBB
+// words. Tiles of the area are spread over threads, 0 meaning one per
+// hardware thread.
+bool compose_group(const struct psd_document * doc, int node, int threads, pixel_rect & bounds, std::vector<uint32_t> & pixels);
+
+// The bounds compose_group gives, without decoding anything
+bool compose_bounds(const struct psd_document * doc, int node, pixel_rect & bounds);
+
+#endif // PSD_COMPOSE_H
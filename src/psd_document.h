@@ -0,0 +1,188 @@
+#ifndef PSD_DOCUMENT_H
+#define PSD_DOCUMENT_H
+
+// Layout of psd_document shared by the C++ translation units behind
+// psd_parser.h. Nothing in here is part of the C API.
+
+#include "arena.h"
+#include "psd_parser.h"
+
+#include <libpsd.h>
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class psd_reader;
+
+struct pixel_layer {
+	int record; // index in the layer records of the context or of the reader
+	int node; // index in the node array; for frames made of groups, the group's
+	const char * name; // path from the document root, without extension
+	bool visible; // neither the layer nor a group around it is hidden
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+// Counters behind psd_document_get_stats. Times are summed over the threads
+// doing the work.
+struct document_stats {
+	std::atomic<int64_t> parse_ns;
+	std::atomic<int64_t> decode_ns;
+	std::atomic<int64_t> encode_ns;
+	std::atomic<int64_t> write_ns;
+	std::atomic<int64_t> decoded_layers;
+	std::atomic<int64_t> decoded_bytes;
+	std::atomic<int64_t> encoded_bytes;
+	std::atomic<int64_t> written_files;
+
+	document_stats()
+		: parse_ns(0), decode_ns(0), encode_ns(0), write_ns(0),
+		  decoded_layers(0), decoded_bytes(0), encoded_bytes(0), written_files(0)
+	{
+	}
+};
+
+// Adds the time spent in its scope to a counter
+class scoped_timer {
+public:
+	explicit scoped_timer(std::atomic<int64_t> & total) : m_total(total), m_start(std::chrono::steady_clock::now()) {}
+	~scoped_timer() { m_total += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count(); }
+
+private:
+	scoped_timer(const scoped_timer &);
+	scoped_timer & operator=(const scoped_timer &);
+
+	std::atomic<int64_t> & m_total;
+	std::chrono::steady_clock::time_point m_start;
+};
+
+// At most one of context and reader is set: documents parsed eagerly keep
+// libpsd's decoded pixels, lazy ones decode a layer each time it is needed.
+// Documents restored from a serialized tree have neither until their pixels
+// are first read, see open_pixel_source.
+// Everything built while parsing lives in memory and is freed in one go with
+// the document; libpsd's context keeps its own allocations.
+struct psd_document {
+	arena memory; // first, so it outlives the members allocated from it
+	arena depth_memory; // of depth_reader, opened while others may use memory
+	const char * filename;
+	int width;
+	int height;
+	int depth; // bits per channel of the file
+	bool lazy; // pixels come from reader rather than context
+	psd_context * context;
+	psd_reader * reader;
+	arena_vector<psd_node> nodes; // parents before their children
+	arena_vector<int> node_records; // layer record of every node, the folder record for groups
+	int children_count; // top-level nodes, at the start of nodes
+	arena_vector<char> names; // string table of the nodes
+	arena_vector<const char *> groups; // group paths, in node order
+	arena_vector<pixel_layer> layers; // layers with pixels, in node order
+	mutable document_stats stats; // the only state that changes after parsing
+	mutable std::once_flag source_once; // guards opening context or reader on first use
+	mutable bool source_ready;
+	mutable std::once_flag depth_once; // guards opening depth_reader, see open_depth_source
+	mutable psd_reader * depth_reader;
+	mutable std::atomic<int> refs; // the caller's, plus one while cached and one per running export task
+
+	psd_document()
+		: filename(NULL), width(0), height(0), depth(8), lazy(false), context(NULL), reader(NULL),
+		  nodes(memory), node_records(memory), children_count(0), names(memory), groups(memory), layers(memory),
+		  source_ready(false), depth_reader(NULL), refs(1)
+	{
+	}
+
+private:
+	psd_document(const psd_document &);
+	psd_document & operator=(const psd_document &);
+};
+
+// Makes sure context or reader is open; false when the source file cannot
+// be read the way it was when the document was parsed
+bool open_pixel_source(const struct psd_document * doc);
+
+// Reader of samples at the depth of the file: the pixel source of lazy
+// documents, a reader of its own for eager ones, whose libpsd context only
+// holds 8 bits. NULL when the file cannot be read that way.
+const psd_reader * open_depth_source(const struct psd_document * doc);
+
+// Pixels of one layer as 0xAARRGGBB words, width * height of them
+class layer_pixels {
+public:
+	layer_pixels() : m_data(NULL) {}
+
+	// with bake, the layer's opacity, mask and clipping are applied, see bake_layer
+	bool load(const struct psd_document * doc, const pixel_layer & layer, bool bake = false);
+	// a group node flattened by compose_group, over the bounds compose_bounds gives
+	bool compose(const struct psd_document * doc, int node, int threads);
+	const uint32_t * data() const { return m_data; }
+
+private:
+	const uint32_t * m_data; // borrowed from libpsd, or m_buffer
+	std::vector<uint32_t> m_buffer;
+};
+
+// threads as given in the options, 0 meaning one per hardware thread
+inline size_t worker_count(int threads)
+{
+	size_t n_threads = threads > 0? threads : std::thread::hardware_concurrency();
+	return n_threads > 0? n_threads : 1;
+}
+
+// Runs job(0) ... job(n_jobs - 1) on a pool of worker threads
+template <typename F>
+void run_parallel(size_t n_jobs, int threads, F job)
+{
+	size_t n_threads = worker_count(threads);
+	if (n_threads > n_jobs)
+		n_threads = n_jobs;
+
+	std::atomic<size_t> next_job(0);
+	auto worker = [&]() {
+		for (size_t i = next_job++; i < n_jobs; i = next_job++)
+			job(i);
+	};
+
+	if (n_threads <= 1) {
+		worker();
+		return;
+	}
+
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < n_threads; i++)
+		workers.push_back(std::thread(worker));
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+}
+
+// through the allocator set with psd_parser_set_allocator
+void * psd_alloc(size_t size);
+void psd_free(void * ptr);
+
+// copies src into a psd_alloc'd string
+bool psd_copy_string(const std::string & src, char ** dst);
+
+// Identity of a source file for the document cache: a document is reused
+// only while the file keeps the size and modification time it was parsed at.
+struct document_key {
+	std::string path;
+	long long mtime; // nanoseconds
+	long long size;
+	bool lazy;
+};
+
+// psd_cache.cpp; all of them do nothing while the cache is disabled
+bool document_key_init(document_key & key, const char * filename, bool lazy);
+// a new reference to the cached document, from memory or from a serialized tree
+struct psd_document * document_cache_acquire(const document_key & key);
+void document_cache_store(const document_key & key, struct psd_document * doc);
+
+#endif // PSD_DOCUMENT_H
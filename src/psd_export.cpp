@@ -0,0 +1,922 @@
+#include "psd_document.h"
+
+#include "atlas_packer.h"
+#include "pixel_ops.h"
+#include "psd_compose.h"
+#include "psd_png.h"
+#include "psd_stex.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+void psd_document_save_layers(const struct psd_document * doc, const char * dir)
+{
+	psd_document_export_layers(doc, dir, NULL, NULL);
+}
+
+void psd_export_options_init(struct psd_export_options * options)
+{
+	if (options == NULL)
+		return;
+	options->threads = 0;
+	options->incremental = 0;
+	options->trim = 0;
+	options->dedup = 0;
+	options->memory_budget_mb = 0;
+	options->png_profile = psd_png_default;
+	options->texture_format = psd_texture_png;
+	options->filter = NULL;
+	options->bake = 0;
+	options->group_frames = 0;
+	options->metadata = 0;
+}
+
+const char * psd_texture_format_extension(int format)
+{
+	return format == psd_texture_png? ".png" : ".stex";
+}
+
+void psd_export_report_free(struct psd_export_report * report)
+{
+	if (report == NULL)
+		return;
+	for (int i = 0; i < report->changed_count; i++)
+		psd_free(report->changed[i]);
+	psd_free(report->changed);
+	for (int i = 0; i < report->frame_count; i++) {
+		psd_free(report->frames[i].name);
+		psd_free(report->frames[i].file);
+	}
+	psd_free(report->frames);
+	report->changed = NULL;
+	report->changed_count = 0;
+	report->frames = NULL;
+	report->frame_count = 0;
+}
+
+struct export_job {
+	const pixel_layer * layer;
+	int node; // frame group composited into the file, -1 for a layer
+	std::string path;
+	pixel_rect rect; // part of the layer written to the file
+	uint64_t hash;
+	uint64_t content_hash;
+	size_t source; // job whose file holds this layer's pixels
+	bool changed;
+};
+
+typedef std::map<std::string, uint64_t> export_manifest;
+
+// after the document, as several may be exported to one dir
+static const char * const manifest_extension = ".manifest";
+static const char * const metadata_extension = ".psdmeta";
+
+static bool make_dir(const std::string & path)
+{
+#ifdef _WIN32
+	int err = _mkdir(path.c_str());
+#else
+	int err = mkdir(path.c_str(), 0755);
+#endif
+	return err == 0 || errno == EEXIST;
+}
+
+static bool make_dirs(const std::string & path)
+{
+	for (size_t pos = path.find('/', 1); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+		if (!make_dir(path.substr(0, pos)))
+			return false;
+	}
+	return path.empty() || make_dir(path);
+}
+
+static bool file_exists(const std::string & path)
+{
+	struct stat st;
+	return stat(path.c_str(), &st) == 0;
+}
+
+static std::string document_basename(const struct psd_document * doc)
+{
+	std::string name = doc->filename;
+	size_t sep = name.find_last_of("/\\");
+	if (sep != std::string::npos)
+		name = name.substr(sep + 1);
+	size_t ext = name.rfind('.');
+	if (ext != std::string::npos && ext > 0)
+		name = name.substr(0, ext);
+	return name;
+}
+
+static std::string join_path(const std::string & dir, const std::string & name)
+{
+	return dir.empty()? name : dir + "/" + name;
+}
+
+static void copy_layer_rgba_rect(const pixel_layer & layer, const uint32_t * pixels, const pixel_rect & rect, unsigned char * rgba, size_t stride)
+{
+	argb_to_rgba(pixels + (size_t) rect.y * layer.width + rect.x, layer.width, rect.width, rect.height, rgba, stride);
+}
+
+// Bytes held by the jobs in flight. Workers wait for room before decoding a
+// layer, except when nothing else is in flight, so that a layer larger than
+// the whole budget still gets through on its own.
+class memory_budget {
+public:
+	explicit memory_budget(size_t limit) : m_limit(limit), m_in_use(0) {}
+
+	void acquire(size_t bytes)
+	{
+		if (m_limit == 0)
+			return;
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_in_use != 0 && m_in_use + bytes > m_limit)
+			m_released.wait(lock);
+		m_in_use += bytes;
+	}
+
+	void release(size_t bytes)
+	{
+		if (m_limit == 0)
+			return;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_in_use -= bytes;
+		m_released.notify_all();
+	}
+
+private:
+	size_t m_limit; // 0 for no limit
+	size_t m_in_use;
+	std::mutex m_mutex;
+	std::condition_variable m_released;
+};
+
+class budget_lease {
+public:
+	budget_lease(memory_budget & budget, size_t bytes) : m_budget(budget), m_bytes(bytes) { m_budget.acquire(m_bytes); }
+	~budget_lease() { m_budget.release(m_bytes); }
+
+private:
+	budget_lease(const budget_lease &);
+	budget_lease & operator=(const budget_lease &);
+
+	memory_budget & m_budget;
+	size_t m_bytes;
+};
+
+// Upper bound of what exporting a layer holds at once: the RGBA copy and the
+// encoded PNG, plus the planes and the ARGB words of a lazy decode, and the
+// dithered bytes of deeper planes
+static size_t job_footprint(const struct psd_document * doc, const export_job & job)
+{
+	size_t n_pixels = (size_t) job.layer->width * job.layer->height;
+	if (doc->reader == NULL)
+		return n_pixels * 8;
+	return n_pixels * (12 + doc->depth / 2 + (doc->depth > 8? 4 : 0));
+}
+
+// FNV-1a over 32-bit words: the pixels are already word-sized, which keeps
+// hashing far cheaper than the PNG encoding it lets us skip.
+static const uint64_t hash_prime = 0x100000001b3ULL;
+static const uint64_t hash_basis = 0xcbf29ce484222325ULL;
+
+static uint64_t hash_rect(const pixel_layer & layer, const uint32_t * pixels, const pixel_rect & rect, uint64_t hash)
+{
+	hash = (hash ^ (uint32_t) rect.width) * hash_prime;
+	hash = (hash ^ (uint32_t) rect.height) * hash_prime;
+	for (int y = 0; y < rect.height; y++) {
+		const uint32_t * row = pixels + (size_t) (rect.y + y) * layer.width + rect.x;
+		for (int x = 0; x < rect.width; x++)
+			hash = (hash ^ row[x]) * hash_prime;
+	}
+	return hash;
+}
+
+static uint64_t hash_layer(const pixel_layer & layer, const uint32_t * pixels, uint64_t seed)
+{
+	uint64_t hash = hash_basis ^ seed;
+	hash = (hash ^ (uint32_t) layer.x) * hash_prime;
+	hash = (hash ^ (uint32_t) layer.y) * hash_prime;
+	pixel_rect all = {0, 0, layer.width, layer.height};
+	return hash_rect(layer, pixels, all, hash);
+}
+
+// Frame groups are the groups directly inside a top-level group
+static bool is_frame_group(const struct psd_document * doc, int node)
+{
+	const psd_node & n = doc->nodes[node];
+	return n.is_group && n.parent >= 0 && doc->nodes[n.parent].parent < 0;
+}
+
+static bool in_frame_group(const struct psd_document * doc, int node)
+{
+	for (int parent = doc->nodes[node].parent; parent >= 0; parent = doc->nodes[parent].parent) {
+		if (is_frame_group(doc, parent))
+			return true;
+	}
+	return false;
+}
+
+// The frames of an export or an atlas: every pixel layer or, with group
+// frames, the layers outside frame groups plus one frame per frame group,
+// named by its path and sized to its composite. nodes gets the frame group
+// of each frame, -1 for layers; groups holds the frames made up for them.
+static bool collect_frames(const struct psd_document * doc, bool group_frames, std::vector<const pixel_layer *> & frames, std::vector<int> & nodes, std::deque<pixel_layer> & groups)
+{
+	// layers and groups are in node order
+	size_t layer = 0;
+	size_t group = 0;
+	for (size_t i = 0; i < doc->nodes.size(); i++) {
+		const psd_node & node = doc->nodes[i];
+		if (node.is_group) {
+			if (group_frames && is_frame_group(doc, i)) {
+				pixel_rect bounds;
+				if (!compose_bounds(doc, i, bounds))
+					return false;
+				pixel_layer frame = {-1, (int) i, doc->groups[group], node.visible != 0, bounds.x, bounds.y, bounds.width, bounds.height};
+				groups.push_back(frame);
+				frames.push_back(&groups.back());
+				nodes.push_back(i);
+			}
+			group++;
+		} else {
+			if (!group_frames || !in_frame_group(doc, i)) {
+				frames.push_back(&doc->layers[layer]);
+				nodes.push_back(-1);
+			}
+			layer++;
+		}
+	}
+	return true;
+}
+
+// frame groups are always composited, which bakes their layers anyway
+static bool load_frame(const struct psd_document * doc, const pixel_layer & layer, int node, bool bake, int threads, layer_pixels & pixels)
+{
+	return node >= 0? pixels.compose(doc, node, threads) : pixels.load(doc, layer, bake);
+}
+
+// Lazy documents decode both layers again, which only happens on a hash match
+static bool same_pixels(const struct psd_document * doc, const export_job & a, const export_job & b, bool bake, int threads)
+{
+	if (a.rect.width != b.rect.width || a.rect.height != b.rect.height)
+		return false;
+	layer_pixels pa, pb;
+	if (!load_frame(doc, *a.layer, a.node, bake, threads, pa) || !load_frame(doc, *b.layer, b.node, bake, threads, pb))
+		return false;
+	for (int y = 0; y < a.rect.height; y++) {
+		const uint32_t * row_a = pa.data() + (size_t) (a.rect.y + y) * a.layer->width + a.rect.x;
+		const uint32_t * row_b = pb.data() + (size_t) (b.rect.y + y) * b.layer->width + b.rect.x;
+		if (memcmp(row_a, row_b, a.rect.width * sizeof(uint32_t)) != 0)
+			return false;
+	}
+	return true;
+}
+
+// Points every job at the first earlier job with byte-identical pixels
+static void find_duplicates(const struct psd_document * doc, std::vector<export_job> & jobs, bool bake, int threads)
+{
+	std::multimap<uint64_t, size_t> seen;
+	for (size_t i = 0; i < jobs.size(); i++) {
+		typedef std::multimap<uint64_t, size_t>::const_iterator iterator;
+		std::pair<iterator, iterator> range = seen.equal_range(jobs[i].content_hash);
+		for (iterator it = range.first; it != range.second; ++it) {
+			if (same_pixels(doc, jobs[it->second], jobs[i], bake, threads)) {
+				jobs[i].source = it->second;
+				break;
+			}
+		}
+		if (jobs[i].source == i)
+			seen.insert(std::make_pair(jobs[i].content_hash, i));
+	}
+}
+
+static void read_manifest(const std::string & path, export_manifest & manifest)
+{
+	std::ifstream file(path.c_str());
+	std::string line;
+	while (std::getline(file, line)) {
+		size_t sep = line.find(' ');
+		if (sep == std::string::npos)
+			continue;
+		manifest[line.substr(sep + 1)] = strtoull(line.substr(0, sep).c_str(), NULL, 16);
+	}
+}
+
+static bool write_manifest(const std::string & path, const std::vector<export_job> & jobs)
+{
+	std::ofstream file(path.c_str(), std::ios::trunc);
+	for (size_t i = 0; i < jobs.size(); i++) {
+		if (jobs[i].source != i)
+			continue;
+		char hash[17];
+		snprintf(hash, sizeof(hash), "%016llx", (unsigned long long) jobs[i].hash);
+		file << hash << ' ' << jobs[i].layer->name << '\n';
+	}
+	return file.good();
+}
+
+// How finished pixels are written. VRAM encoders may spread the blocks of
+// one image over block_threads, for when there are fewer images than workers.
+struct texture_settings {
+	int format; // psd_texture_format
+	int png_profile;
+	int block_threads;
+};
+
+static texture_settings make_texture_settings(int format, int png_profile, int threads, size_t n_images)
+{
+	texture_settings settings;
+	settings.format = format;
+	settings.png_profile = png_profile;
+	size_t n_threads = worker_count(threads);
+	settings.block_threads = n_images > 0 && n_images < n_threads? (int) (n_threads / n_images) : 1;
+	return settings;
+}
+
+static bool save_file(const std::string & path, const std::vector<unsigned char> & bytes)
+{
+	std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+	file.write((const char *) bytes.data(), bytes.size());
+	return file.good();
+}
+
+static bool write_texture(const struct psd_document * doc, const std::string & path, const unsigned char * rgba, int width, int height, const texture_settings & settings)
+{
+	std::vector<unsigned char> encoded;
+	{
+		scoped_timer timer(doc->stats.encode_ns);
+		bool encoded_ok = settings.format == psd_texture_png
+			? psd_png_encode(rgba, width, height, settings.png_profile, encoded)
+			: psd_stex_encode(rgba, width, height, settings.format, settings.block_threads, encoded);
+		if (!encoded_ok)
+			return false;
+	}
+	doc->stats.encoded_bytes += encoded.size();
+
+	scoped_timer timer(doc->stats.write_ns);
+	if (!(settings.format == psd_texture_png? psd_png_save(path, encoded) : save_file(path, encoded)))
+		return false;
+	doc->stats.written_files++;
+	return true;
+}
+
+static bool write_layer_texture(const struct psd_document * doc, const export_job & job, const uint32_t * pixels, const texture_settings & settings)
+{
+	const pixel_rect & rect = job.rect;
+	std::vector<unsigned char> rgba((size_t) rect.width * rect.height * 4);
+	copy_layer_rgba_rect(*job.layer, pixels, rect, rgba.data(), (size_t) rect.width * 4);
+
+	return write_texture(doc, job.path, rgba.data(), rect.width, rect.height, settings);
+}
+
+static bool fill_report(const std::vector<export_job> & jobs, struct psd_export_report * report)
+{
+	report->changed = NULL;
+	report->changed_count = 0;
+	report->frames = NULL;
+	report->frame_count = 0;
+
+	if (jobs.empty())
+		return true;
+
+	report->changed = (char **) psd_alloc(jobs.size() * sizeof(char *));
+	report->frames = (struct psd_export_frame *) psd_alloc(jobs.size() * sizeof(struct psd_export_frame));
+	if (report->changed == NULL || report->frames == NULL) {
+		psd_export_report_free(report);
+		return false;
+	}
+
+	for (size_t i = 0; i < jobs.size(); i++) {
+		const export_job & job = jobs[i];
+		const export_job & source = jobs[job.source];
+
+		if (source.changed) {
+			if (!psd_copy_string(job.layer->name, &report->changed[report->changed_count])) {
+				psd_export_report_free(report);
+				return false;
+			}
+			report->changed_count++;
+		}
+
+		struct psd_export_frame * frame = &report->frames[report->frame_count];
+		if (!psd_copy_string(job.layer->name, &frame->name)) {
+			psd_export_report_free(report);
+			return false;
+		}
+		if (!psd_copy_string(source.layer->name, &frame->file)) {
+			psd_free(frame->name);
+			psd_export_report_free(report);
+			return false;
+		}
+		report->frame_count++;
+		frame->offset_x = job.rect.x;
+		frame->offset_y = job.rect.y;
+		frame->width = job.rect.width;
+		frame->height = job.rect.height;
+		frame->layer_width = job.layer->width;
+		frame->layer_height = job.layer->height;
+	}
+	return true;
+}
+
+struct psd_export_task {
+	const struct psd_document * doc; // one reference, dropped when the task is freed
+	std::string dir;
+	struct psd_export_options options;
+	// the caller's filter may be gone before the export finishes
+	struct psd_layer_filter filter;
+	std::vector<std::string> patterns;
+	std::vector<const char *> include;
+	std::vector<const char *> exclude;
+	std::thread thread;
+	bool joined;
+	int result;
+	struct psd_export_report report; // until psd_export_task_wait hands it over
+
+	std::atomic<int> done;
+	std::atomic<int> total;
+	std::atomic<bool> cancelled;
+	std::atomic<bool> finished;
+	mutable std::mutex mutex;
+	std::deque<std::string> written; // a deque keeps the strings in place as it grows
+
+	// layers is the number of layers sharing the file, after deduplication
+	void finish(const export_job & job, int layers)
+	{
+		if (job.changed) {
+			std::lock_guard<std::mutex> lock(mutex);
+			written.push_back(job.layer->name);
+		}
+		done += layers;
+	}
+};
+
+static int export_layers(const struct psd_document * doc, const char * dir, const struct psd_export_options * options, struct psd_export_report * report, struct psd_export_task * task)
+{
+	struct psd_export_options default_options;
+	if (options == NULL) {
+		psd_export_options_init(&default_options);
+		options = &default_options;
+	}
+
+	std::vector<const pixel_layer *> frames;
+	std::vector<int> frame_nodes;
+	std::deque<pixel_layer> group_frames;
+	if (!collect_frames(doc, options->group_frames != 0, frames, frame_nodes, group_frames))
+		return -1;
+
+	// layers left out by the filter are never decoded
+	std::vector<export_job> jobs;
+	jobs.reserve(frames.size());
+	for (size_t i = 0; i < frames.size(); i++) {
+		const pixel_layer & layer = *frames[i];
+		if (!psd_layer_filter_accepts(options->filter, layer.name, layer.visible))
+			continue;
+		export_job job;
+		job.layer = &layer;
+		job.node = frame_nodes[i];
+		job.path = join_path(dir, layer.name) + psd_texture_format_extension(options->texture_format);
+		job.rect.x = 0;
+		job.rect.y = 0;
+		job.rect.width = layer.width;
+		job.rect.height = layer.height;
+		job.hash = 0;
+		job.content_hash = 0;
+		job.source = jobs.size();
+		job.changed = true;
+		jobs.push_back(job);
+	}
+
+	// only the groups something is written to
+	if (!make_dirs(dir))
+		return -1;
+	std::set<std::string> job_dirs;
+	for (size_t i = 0; i < jobs.size(); i++) {
+		const char * sep = strrchr(jobs[i].layer->name, '/');
+		if (sep)
+			job_dirs.insert(std::string(jobs[i].layer->name, sep - jobs[i].layer->name));
+	}
+	for (std::set<std::string>::const_iterator it = job_dirs.begin(); it != job_dirs.end(); ++it) {
+		if (!make_dirs(join_path(dir, *it)))
+			return -1;
+	}
+
+	// trimmed or baked files differ from plain ones for the same pixels
+	uint64_t hash_seed = (options->trim? 1 : 0) | (options->bake? 2 : 0);
+	auto analyse = [&](export_job & job, const uint32_t * pixels) {
+		if (options->trim)
+			job.rect = argb_alpha_bounds(pixels, job.layer->width, job.layer->height);
+		if (options->dedup)
+			job.content_hash = hash_rect(*job.layer, pixels, job.rect, hash_basis);
+		if (options->incremental)
+			job.hash = hash_layer(*job.layer, pixels, hash_seed);
+	};
+
+	// frame groups are composited on the threads the other jobs leave idle
+	bool bake = options->bake != 0;
+	int tile_threads = (int) (worker_count(options->threads) / (jobs.size() > 0? jobs.size() : 1));
+	if (tile_threads < 1)
+		tile_threads = 1;
+
+	memory_budget budget(options->memory_budget_mb > 0? (size_t) options->memory_budget_mb << 20 : 0);
+	std::atomic<int> n_failed(0);
+	auto cancelled = [task]() { return task && task->cancelled; };
+	if (task)
+		task->total = jobs.size();
+
+	// Deduplication has to see every layer before writing any of them. Without
+	// it each layer streams through decode, analysis, encoding and writing in
+	// one go, and its pixels are dropped as soon as its PNG is written.
+	if (options->dedup) {
+		run_parallel(jobs.size(), options->threads, [&](size_t i) {
+			export_job & job = jobs[i];
+			if (cancelled())
+				return;
+			budget_lease lease(budget, job_footprint(doc, job));
+			layer_pixels pixels;
+			if (!load_frame(doc, *job.layer, job.node, bake, tile_threads, pixels)) {
+				n_failed++;
+				return;
+			}
+			analyse(job, pixels.data());
+		});
+		if (n_failed != 0 || cancelled())
+			return -1;
+		find_duplicates(doc, jobs, bake, tile_threads);
+	}
+
+	std::vector<int> copies(jobs.size(), 0);
+	size_t n_sources = 0;
+	for (size_t i = 0; i < jobs.size(); i++) {
+		n_sources += jobs[i].source == i;
+		copies[jobs[i].source]++;
+	}
+	texture_settings texture = make_texture_settings(options->texture_format, options->png_profile, options->threads, n_sources);
+
+	std::string manifest_path = join_path(dir, "." + document_basename(doc) + manifest_extension);
+	export_manifest manifest;
+	if (options->incremental)
+		read_manifest(manifest_path, manifest);
+
+	run_parallel(jobs.size(), options->threads, [&](size_t i) {
+		export_job & job = jobs[i];
+		if (job.source != i)
+			return;
+		if (cancelled()) {
+			// not written, so the next run has to redo it
+			job.hash = 0;
+			return;
+		}
+
+		budget_lease lease(budget, job_footprint(doc, job));
+		layer_pixels pixels;
+		if (!options->dedup) {
+			if (!load_frame(doc, *job.layer, job.node, bake, tile_threads, pixels)) {
+				n_failed++;
+				return;
+			}
+			analyse(job, pixels.data());
+		}
+		if (options->incremental) {
+			export_manifest::const_iterator previous = manifest.find(job.layer->name);
+			job.changed = previous == manifest.end() || previous->second != job.hash || !file_exists(job.path);
+		}
+		if (job.changed && ((pixels.data() == NULL && !load_frame(doc, *job.layer, job.node, bake, tile_threads, pixels)) || !write_layer_texture(doc, job, pixels.data(), texture))) {
+			// leave it out of the manifest so that the next run retries it
+			job.hash = 0;
+			n_failed++;
+			return;
+		}
+		if (task)
+			task->finish(job, copies[i]);
+	});
+
+	if (options->incremental && !write_manifest(manifest_path, jobs))
+		n_failed++;
+	if (n_failed != 0 || cancelled())
+		return -1;
+
+	// the whole tree, whatever the filter left out; a side file, so losing
+	// it does not fail the layers written
+	bool metadata_failed = options->metadata && psd_document_write_metadata(doc, join_path(dir, document_basename(doc) + metadata_extension).c_str()) != 0;
+
+	if (report && !fill_report(jobs, report))
+		return -1;
+	if (report) {
+		report->texture_format = options->texture_format;
+		report->metadata_failed = metadata_failed? 1 : 0;
+	}
+	return (int) jobs.size();
+}
+
+int psd_document_export_layers(const struct psd_document * doc, const char * dir, const struct psd_export_options * options, struct psd_export_report * report)
+{
+	if (doc == NULL || dir == NULL)
+		return -1;
+	return export_layers(doc, dir, options, report, NULL);
+}
+
+struct psd_export_task * psd_document_export_layers_async(const struct psd_document * doc, const char * dir, const struct psd_export_options * options)
+{
+	if (doc == NULL || dir == NULL)
+		return NULL;
+
+	struct psd_export_task * task = new psd_export_task();
+	task->doc = doc;
+	doc->refs++;
+	task->dir = dir;
+	if (options)
+		task->options = *options;
+	else
+		psd_export_options_init(&task->options);
+	if (task->options.filter) {
+		const struct psd_layer_filter * filter = task->options.filter;
+		task->filter = *filter;
+		int include_count = filter->include? filter->include_count : 0;
+		int exclude_count = filter->exclude? filter->exclude_count : 0;
+		for (int i = 0; i < include_count; i++)
+			task->patterns.push_back(filter->include[i]? filter->include[i] : "");
+		for (int i = 0; i < exclude_count; i++)
+			task->patterns.push_back(filter->exclude[i]? filter->exclude[i] : "");
+		for (int i = 0; i < include_count + exclude_count; i++)
+			(i < include_count? task->include : task->exclude).push_back(task->patterns[i].c_str());
+		task->filter.include_count = include_count;
+		task->filter.exclude_count = exclude_count;
+		task->filter.include = task->include.empty()? NULL : task->include.data();
+		task->filter.exclude = task->exclude.empty()? NULL : task->exclude.data();
+		task->options.filter = &task->filter;
+	}
+	task->joined = false;
+	task->result = -1;
+	task->report.changed = NULL;
+	task->report.changed_count = 0;
+	task->report.frames = NULL;
+	task->report.frame_count = 0;
+	task->report.texture_format = psd_texture_png;
+	task->report.metadata_failed = 0;
+	task->done = 0;
+	task->total = doc->layers.size();
+	task->cancelled = false;
+	task->finished = false;
+
+	task->thread = std::thread([task]() {
+		task->result = export_layers(task->doc, task->dir.c_str(), &task->options, &task->report, task);
+		task->finished = true;
+	});
+	return task;
+}
+
+int psd_export_task_progress(const struct psd_export_task * task, int * done, int * total)
+{
+	if (task == NULL)
+		return -1;
+	if (done)
+		*done = task->done;
+	if (total)
+		*total = task->total;
+	return task->finished? 1 : 0;
+}
+
+int psd_export_task_written_count(const struct psd_export_task * task)
+{
+	if (task == NULL)
+		return -1;
+	std::lock_guard<std::mutex> lock(task->mutex);
+	return (int) task->written.size();
+}
+
+const char * psd_export_task_written(const struct psd_export_task * task, int index)
+{
+	if (task == NULL)
+		return NULL;
+	std::lock_guard<std::mutex> lock(task->mutex);
+	if (index < 0 || index >= (int) task->written.size())
+		return NULL;
+	return task->written[index].c_str();
+}
+
+void psd_export_task_cancel(struct psd_export_task * task)
+{
+	if (task)
+		task->cancelled = true;
+}
+
+int psd_export_task_wait(struct psd_export_task * task, struct psd_export_report * report)
+{
+	if (task == NULL)
+		return -1;
+
+	if (!task->joined) {
+		task->thread.join();
+		task->joined = true;
+	}
+
+	if (report) {
+		*report = task->report;
+		task->report.changed = NULL;
+		task->report.changed_count = 0;
+		task->report.frames = NULL;
+		task->report.frame_count = 0;
+	}
+	return task->result;
+}
+
+void psd_export_task_free(struct psd_export_task * task)
+{
+	if (task == NULL)
+		return;
+
+	if (!task->joined) {
+		task->cancelled = true;
+		task->thread.join();
+	}
+	psd_export_report_free(&task->report);
+	psd_document_free(const_cast<struct psd_document *>(task->doc));
+	delete task;
+}
+
+void psd_atlas_options_init(struct psd_atlas_options * options)
+{
+	if (options == NULL)
+		return;
+	options->max_size = 2048;
+	options->padding = 2;
+	options->threads = 0;
+	options->png_profile = psd_png_default;
+	options->texture_format = psd_texture_png;
+	options->filter = NULL;
+	options->bake = 0;
+	options->group_frames = 0;
+}
+
+void psd_atlas_report_free(struct psd_atlas_report * report)
+{
+	if (report == NULL)
+		return;
+	for (int i = 0; i < report->page_count; i++)
+		psd_free(report->pages[i]);
+	psd_free(report->pages);
+	for (int i = 0; i < report->frame_count; i++)
+		psd_free(report->frames[i].name);
+	psd_free(report->frames);
+	report->pages = NULL;
+	report->page_count = 0;
+	report->frames = NULL;
+	report->frame_count = 0;
+}
+
+static bool fill_atlas_report(const std::vector<const pixel_layer *> & frames, const std::vector<pixel_rect> & trims,
+                              const std::vector<atlas_rect> & rects, const std::vector<std::string> & pages,
+                              struct psd_atlas_report * report)
+{
+	report->pages = (char **) psd_alloc(pages.size() * sizeof(char *));
+	report->frames = (struct psd_atlas_frame *) psd_alloc(frames.size() * sizeof(struct psd_atlas_frame));
+	if (report->pages == NULL || report->frames == NULL) {
+		psd_atlas_report_free(report);
+		return false;
+	}
+
+	for (size_t i = 0; i < pages.size(); i++) {
+		if (!psd_copy_string(pages[i], &report->pages[i])) {
+			psd_atlas_report_free(report);
+			return false;
+		}
+		report->page_count++;
+	}
+
+	for (size_t i = 0; i < frames.size(); i++) {
+		struct psd_atlas_frame * frame = &report->frames[i];
+		if (!psd_copy_string(frames[i]->name, &frame->name)) {
+			psd_atlas_report_free(report);
+			return false;
+		}
+		report->frame_count++;
+		frame->page = rects[i].page;
+		frame->x = rects[i].x;
+		frame->y = rects[i].y;
+		frame->width = rects[i].width;
+		frame->height = rects[i].height;
+		frame->offset_x = trims[i].x;
+		frame->offset_y = trims[i].y;
+		frame->layer_width = frames[i]->width;
+		frame->layer_height = frames[i]->height;
+	}
+	return true;
+}
+
+int psd_document_pack_atlas(const struct psd_document * doc, const char * dir, const struct psd_atlas_options * options, struct psd_atlas_report * report)
+{
+	if (doc == NULL || dir == NULL || report == NULL)
+		return -1;
+
+	report->pages = NULL;
+	report->page_count = 0;
+	report->frames = NULL;
+	report->frame_count = 0;
+
+	struct psd_atlas_options default_options;
+	if (options == NULL) {
+		psd_atlas_options_init(&default_options);
+		options = &default_options;
+	}
+
+	std::vector<const pixel_layer *> candidates;
+	std::vector<int> candidate_nodes;
+	std::deque<pixel_layer> group_frames;
+	if (!collect_frames(doc, options->group_frames != 0, candidates, candidate_nodes, group_frames))
+		return -1;
+
+	// only layers inside a group are animation frames
+	std::vector<const pixel_layer *> frames;
+	std::vector<int> frame_nodes;
+	for (size_t i = 0; i < candidates.size(); i++) {
+		const pixel_layer & layer = *candidates[i];
+		if (strchr(layer.name, '/') != NULL && psd_layer_filter_accepts(options->filter, layer.name, layer.visible)) {
+			frames.push_back(&layer);
+			frame_nodes.push_back(candidate_nodes[i]);
+		}
+	}
+	bool bake = options->bake != 0;
+	int tile_threads = (int) (worker_count(options->threads) / (frames.size() > 0? frames.size() : 1));
+	if (tile_threads < 1)
+		tile_threads = 1;
+
+	std::vector<pixel_rect> trims(frames.size());
+	std::atomic<int> n_failed(0);
+	run_parallel(frames.size(), options->threads, [&](size_t i) {
+		layer_pixels pixels;
+		if (!load_frame(doc, *frames[i], frame_nodes[i], bake, tile_threads, pixels)) {
+			n_failed++;
+			return;
+		}
+		trims[i] = argb_alpha_bounds(pixels.data(), frames[i]->width, frames[i]->height);
+	});
+	if (n_failed != 0)
+		return -1;
+
+	std::vector<atlas_rect> rects(frames.size());
+	for (size_t i = 0; i < rects.size(); i++) {
+		rects[i].width = trims[i].width;
+		rects[i].height = trims[i].height;
+	}
+
+	std::vector<atlas_page> pages;
+	if (!atlas_pack(rects, options->max_size, options->padding, pages))
+		return -1;
+
+	if (!make_dirs(dir))
+		return -1;
+
+	std::vector<std::vector<size_t> > page_frames(pages.size());
+	for (size_t i = 0; i < rects.size(); i++)
+		page_frames[rects[i].page].push_back(i);
+
+	std::string basename = document_basename(doc);
+	std::vector<std::string> page_paths(pages.size());
+	texture_settings texture = make_texture_settings(options->texture_format, options->png_profile, options->threads, pages.size());
+	run_parallel(pages.size(), options->threads, [&](size_t page) {
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".atlas%d%s", (int) page, psd_texture_format_extension(options->texture_format));
+		page_paths[page] = join_path(dir, basename + suffix);
+
+		size_t stride = (size_t) pages[page].width * 4;
+		std::vector<unsigned char> rgba(stride * pages[page].height, 0);
+		for (size_t n = 0; n < page_frames[page].size(); n++) {
+			size_t i = page_frames[page][n];
+			layer_pixels pixels;
+			if (!load_frame(doc, *frames[i], frame_nodes[i], bake, tile_threads, pixels)) {
+				n_failed++;
+				return;
+			}
+			copy_layer_rgba_rect(*frames[i], pixels.data(), trims[i], &rgba[rects[i].y * stride + rects[i].x * 4], stride);
+		}
+
+		if (!write_texture(doc, page_paths[page], rgba.data(), pages[page].width, pages[page].height, texture))
+			n_failed++;
+	});
+
+	if (n_failed != 0)
+		return -1;
+	if (!fill_atlas_report(frames, trims, rects, page_paths, report))
+		return -1;
+	return (int) pages.size();
+}
@@ -0,0 +1,97 @@
+#include "psd_parser.h"
+
+#include <string.h>
+
+// '*' and '?' never match a '/', '**' matches anything, and "**/" also
+// matches no directory at all
+static bool glob_match(const char * pattern, const char * path)
+{
+	for (; *pattern; pattern++, path++) {
+		if (pattern[0] == '*' && pattern[1] == '*') {
+			pattern += 2;
+			if (*pattern == '/' && glob_match(pattern + 1, path))
+				return true;
+			for (;; path++) {
+				if (glob_match(pattern, path))
+					return true;
+				if (*path == 0)
+					return false;
+			}
+		}
+		if (*pattern == '*') {
+			pattern++;
+			for (;; path++) {
+				if (glob_match(pattern, path))
+					return true;
+				if (*path == 0 || *path == '/')
+					return false;
+			}
+		}
+		if (*path == 0)
+			return false;
+		if (*pattern == '?') {
+			if (*path == '/')
+				return false;
+			continue;
+		}
+		if (*pattern != *path)
+			return false;
+	}
+	return *path == 0;
+}
+
+// Matches the path itself or one of the groups above it
+static bool matches_any(const char * const * patterns, int count, const char * path)
+{
+	if (patterns == NULL || count <= 0)
+		return false;
+
+	size_t length = strlen(path);
+	char * prefix = new char[length + 1];
+	memcpy(prefix, path, length + 1);
+	bool found = false;
+	for (size_t end = length; !found; end--) {
+		if (end == length || path[end] == '/') {
+			prefix[end] = 0;
+			for (int i = 0; i < count && !found; i++)
+				found = patterns[i] && glob_match(patterns[i], prefix);
+		}
+		if (end == 0)
+			break;
+	}
+	delete[] prefix;
+	return found;
+}
+
+void psd_layer_filter_init(struct psd_layer_filter * filter)
+{
+	if (filter == NULL)
+		return;
+	filter->include = NULL;
+	filter->include_count = 0;
+	filter->exclude = NULL;
+	filter->exclude_count = 0;
+	filter->visible_only = 0;
+}
+
+int psd_layer_filter_accepts(const struct psd_layer_filter * filter, const char * path, int visible)
+{
+	if (filter == NULL)
+		return 1;
+	if (path == NULL || (filter->visible_only && !visible))
+		return 0;
+	if (matches_any(filter->exclude, filter->exclude_count, path))
+		return 0;
+	if (filter->include == NULL || filter->include_count <= 0)
+		return 1;
+	return matches_any(filter->include, filter->include_count, path)? 1 : 0;
+}
+
+int psd_layer_filter_rejects_group(const struct psd_layer_filter * filter, const char * path, int visible)
+{
+	if (filter == NULL)
+		return 0;
+	if (path == NULL || (filter->visible_only && !visible))
+		return 1;
+	return matches_any(filter->exclude, filter->exclude_count, path)? 1 : 0;
+}
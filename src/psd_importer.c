@@ -25,18 +25,53 @@
 #include "register_types.h"
 #include "psd_importer.h"
 #include <string.h>
+#include <time.h>
 
 #include "psd_parser.h"
 
 typedef struct {
 	godot_string filename;
 	struct psd_document * doc;
+
+	// extract_psd_async; written_polled counts the files already handed out by poll_extract
+	struct psd_export_task * task;
+	int written_polled;
+	double task_start;
+
+	// instrumentation, see get_import_stats
+	double file_load_ms;
+	double parse_ms; // of this load, next to nothing when the cache had the document
+	double extract_ms;
+	double frame_names_ms;
+	double sprite_frames_ms;
+	long long allocations_at_load;
+	long long allocated_bytes_at_load;
+	// counters of the document when it was loaded, as cached documents are
+	// shared with other importers and keep counting across loads
+	struct psd_stats stats_at_load;
 } data_struct;
 
+static double _now_ms(void) {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
 static GDCALLINGCONV void * constructor(godot_object *p_instance, void *p_method_data) {
 	data_struct *data = api->godot_alloc(sizeof(data_struct));
 	api->godot_string_new(&data->filename);
 	data->doc = NULL;
+	data->task = NULL;
+	data->written_polled = 0;
+	data->task_start = 0;
+	data->file_load_ms = 0;
+	data->parse_ms = 0;
+	data->extract_ms = 0;
+	data->frame_names_ms = 0;
+	data->sprite_frames_ms = 0;
+	data->allocations_at_load = 0;
+	data->allocated_bytes_at_load = 0;
+	memset(&data->stats_at_load, 0, sizeof(data->stats_at_load));
 
 	return data;
 }
@@ -46,19 +81,34 @@ static GDCALLINGCONV void destructor(godot_object *p_instance, void *p_method_da
 
 	api->godot_string_destroy(&data->filename);
 
+	psd_export_task_free(data->task);
 	if (data->doc)
 		psd_document_free(data->doc);
 
 	api->godot_free(p_user_data);
 }
 
+static void _read_parse_options(const godot_variant * arg, struct psd_parse_options * options);
+
 static GDCALLINGCONV godot_variant file_load(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
 	godot_variant ret;
 	data_struct * user_data = (data_struct *) p_user_data;
 	
 	bool success = false;
 
-	if (p_num_args == 1) {
+	if (p_num_args == 1 || p_num_args == 2) {
+		double start = _now_ms();
+		user_data->extract_ms = 0;
+		user_data->frame_names_ms = 0;
+		user_data->sprite_frames_ms = 0;
+		psd_allocation_counts(&user_data->allocations_at_load, &user_data->allocated_bytes_at_load);
+
+		struct psd_parse_options options;
+		if (p_num_args == 2)
+			_read_parse_options(p_args[1], &options);
+		else
+			psd_parse_options_init(&options);
+
 		api->godot_string_destroy(&user_data->filename);
 		user_data->filename = api->godot_variant_as_string(p_args[0]);
 
@@ -68,12 +118,22 @@ static GDCALLINGCONV godot_variant file_load(godot_object *p_instance, void *p_m
 		struct psd_parser * parser = psd_parser_new(filename);
 		api->godot_char_string_destroy(&cstr);
 
+		// documents may be shared through the cache, so drop ours first
+		psd_export_task_free(user_data->task);
+		user_data->task = NULL;
+		psd_document_free(user_data->doc);
+		user_data->doc = NULL;
+		double parse_start = _now_ms();
 		if (parser) {
-			user_data->doc = psd_parser_parse(parser);
+			user_data->doc = psd_parser_parse_with_options(parser, &options);
 		}
+		user_data->parse_ms = _now_ms() - parse_start;
 		psd_parser_free(parser);
 
 		success = user_data->doc != NULL;
+		if (success)
+			psd_document_get_stats(user_data->doc, &user_data->stats_at_load);
+		user_data->file_load_ms = _now_ms() - start;
 	}
 	
 	api->godot_variant_new_bool(&ret, success);
@@ -87,6 +147,8 @@ static GDCALLINGCONV godot_variant file_close(godot_object *p_instance, void *p_
 	api->godot_string_destroy(&user_data->filename);
 	api->godot_string_new(&user_data->filename);
 
+	psd_export_task_free(user_data->task);
+	user_data->task = NULL;
 	psd_document_free(user_data->doc);
 	user_data->doc = NULL;
 
@@ -106,157 +168,606 @@ static GDCALLINGCONV godot_variant get_layer_count(godot_object *p_instance, voi
 	return ret;
 }
 
+static bool _dictionary_get(const godot_dictionary * dict, const char * key, godot_variant * value) {
+	godot_string key_str;
+	api->godot_string_new(&key_str);
+	api->godot_string_parse_utf8(&key_str, key);
+
+	godot_variant key_var;
+	api->godot_variant_new_string(&key_var, &key_str);
+
+	bool found = api->godot_dictionary_has(dict, &key_var);
+	if (found)
+		*value = api->godot_dictionary_get(dict, &key_var);
+
+	api->godot_variant_destroy(&key_var);
+	api->godot_string_destroy(&key_str);
+	return found;
+}
+
+static int _dictionary_get_int(const godot_dictionary * dict, const char * key, int default_value) {
+	godot_variant value_var;
+	if (!_dictionary_get(dict, key, &value_var))
+		return default_value;
+
+	int value = api->godot_variant_as_int(&value_var);
+	api->godot_variant_destroy(&value_var);
+	return value;
+}
+
+static bool _dictionary_get_bool(const godot_dictionary * dict, const char * key, bool default_value) {
+	godot_variant value_var;
+	if (!_dictionary_get(dict, key, &value_var))
+		return default_value;
+
+	bool value = api->godot_variant_as_bool(&value_var);
+	api->godot_variant_destroy(&value_var);
+	return value;
+}
+
+static void _dictionary_set(godot_dictionary * dict, const char * key, godot_variant * value) {
+	godot_string key_str;
+	api->godot_string_new(&key_str);
+	api->godot_string_parse_utf8(&key_str, key);
+
+	godot_variant key_var;
+	api->godot_variant_new_string(&key_var, &key_str);
+
+	api->godot_dictionary_set(dict, &key_var, value);
+
+	api->godot_variant_destroy(value);
+	api->godot_variant_destroy(&key_var);
+	api->godot_string_destroy(&key_str);
+}
+
+// The value of names[i] is values[i]; unknown names keep default_value
+static int _dictionary_get_enum(const godot_dictionary * dict, const char * key, const char * const * names, const int * values, int count, int default_value) {
+	godot_variant value_var;
+	if (!_dictionary_get(dict, key, &value_var))
+		return default_value;
+
+	godot_string value_str = api->godot_variant_as_string(&value_var);
+	godot_char_string cstr = api->godot_string_utf8(&value_str);
+	const char * value = api->godot_char_string_get_data(&cstr);
+
+	int result = default_value;
+	for (int i = 0; i < count; i++) {
+		if (strcmp(value, names[i]) == 0)
+			result = values[i];
+	}
+
+	api->godot_char_string_destroy(&cstr);
+	api->godot_string_destroy(&value_str);
+	api->godot_variant_destroy(&value_var);
+	return result;
+}
+
+// "default", "fast", "store" or "small"
+static int _dictionary_get_png_profile(const godot_dictionary * dict, const char * key, int default_value) {
+	static const char * const names[] = { "default", "fast", "store", "small" };
+	static const int profiles[] = { psd_png_default, psd_png_fast, psd_png_store, psd_png_small };
+	return _dictionary_get_enum(dict, key, names, profiles, sizeof(names) / sizeof(names[0]), default_value);
+}
+
+// "png", "dxt5" or "etc2"
+static int _dictionary_get_texture_format(const godot_dictionary * dict, const char * key, int default_value) {
+	static const char * const names[] = { "png", "dxt5", "etc2" };
+	static const int formats[] = { psd_texture_png, psd_texture_dxt5, psd_texture_etc2 };
+	return _dictionary_get_enum(dict, key, names, formats, sizeof(names) / sizeof(names[0]), default_value);
+}
+
+static void _read_parse_options(const godot_variant * arg, struct psd_parse_options * options) {
+	psd_parse_options_init(options);
+
+	if (api->godot_variant_get_type(arg) != GODOT_VARIANT_TYPE_DICTIONARY)
+		return;
+
+	godot_dictionary dict = api->godot_variant_as_dictionary(arg);
+	options->lazy = _dictionary_get_bool(&dict, "lazy", options->lazy);
+	options->cache = _dictionary_get_bool(&dict, "cache", options->cache);
+	api->godot_dictionary_destroy(&dict);
+}
+
+// A psd_layer_filter read from a dictionary, with the patterns it points to
+typedef struct {
+	struct psd_layer_filter filter;
+	char ** patterns; // the include patterns, then the exclude ones
+	int pattern_count;
+} layer_filter_holder;
+
+static void _layer_filter_holder_init(layer_filter_holder * holder) {
+	psd_layer_filter_init(&holder->filter);
+	holder->patterns = NULL;
+	holder->pattern_count = 0;
+}
+
+static void _layer_filter_holder_destroy(layer_filter_holder * holder) {
+	for (int i = 0; i < holder->pattern_count; i++)
+		api->godot_free(holder->patterns[i]);
+	if (holder->patterns)
+		api->godot_free(holder->patterns);
+	_layer_filter_holder_init(holder);
+}
+
+static char * _copy_utf8(const godot_string * string) {
+	godot_char_string cstr = api->godot_string_utf8(string);
+	const char * data = api->godot_char_string_get_data(&cstr);
+	size_t length = strlen(data);
+	char * copy = api->godot_alloc(length + 1);
+	memcpy(copy, data, length + 1);
+	api->godot_char_string_destroy(&cstr);
+	return copy;
+}
+
+static int _dictionary_get_strings(const godot_dictionary * dict, const char * key, godot_pool_string_array * array) {
+	godot_variant value_var;
+	if (!_dictionary_get(dict, key, &value_var)) {
+		api->godot_pool_string_array_new(array);
+		return 0;
+	}
+
+	*array = api->godot_variant_as_pool_string_array(&value_var);
+	api->godot_variant_destroy(&value_var);
+	return api->godot_pool_string_array_size(array);
+}
+
+// {"include": PoolStringArray, "exclude": PoolStringArray, "visible_only": bool},
+// all optional. Returns NULL when the dictionary asks for no filtering.
+static const struct psd_layer_filter * _read_layer_filter(const godot_dictionary * dict, layer_filter_holder * holder) {
+	_layer_filter_holder_init(holder);
+
+	godot_pool_string_array include;
+	godot_pool_string_array exclude;
+	int include_count = _dictionary_get_strings(dict, "include", &include);
+	int exclude_count = _dictionary_get_strings(dict, "exclude", &exclude);
+	holder->filter.visible_only = _dictionary_get_bool(dict, "visible_only", false);
+
+	if (include_count + exclude_count > 0) {
+		holder->patterns = api->godot_alloc((include_count + exclude_count) * sizeof(char *));
+		for (int i = 0; i < include_count; i++) {
+			godot_string string = api->godot_pool_string_array_get(&include, i);
+			holder->patterns[holder->pattern_count++] = _copy_utf8(&string);
+			api->godot_string_destroy(&string);
+		}
+		for (int i = 0; i < exclude_count; i++) {
+			godot_string string = api->godot_pool_string_array_get(&exclude, i);
+			holder->patterns[holder->pattern_count++] = _copy_utf8(&string);
+			api->godot_string_destroy(&string);
+		}
+		holder->filter.include = include_count > 0? (const char * const *) holder->patterns : NULL;
+		holder->filter.include_count = include_count;
+		holder->filter.exclude = exclude_count > 0? (const char * const *) holder->patterns + include_count : NULL;
+		holder->filter.exclude_count = exclude_count;
+	}
+
+	api->godot_pool_string_array_destroy(&include);
+	api->godot_pool_string_array_destroy(&exclude);
+
+	if (holder->pattern_count == 0 && !holder->filter.visible_only)
+		return NULL;
+	return &holder->filter;
+}
+
+// The filter dictionary of the methods taking one as an optional argument
+static const struct psd_layer_filter * _read_layer_filter_arg(int p_num_args, godot_variant **p_args, layer_filter_holder * holder) {
+	_layer_filter_holder_init(holder);
+	if (p_num_args != 1 || api->godot_variant_get_type(p_args[0]) != GODOT_VARIANT_TYPE_DICTIONARY)
+		return NULL;
+
+	godot_dictionary dict = api->godot_variant_as_dictionary(p_args[0]);
+	const struct psd_layer_filter * filter = _read_layer_filter(&dict, holder);
+	api->godot_dictionary_destroy(&dict);
+	return filter;
+}
+
+// filter points into holder, which has to outlive the export
+static void _read_export_options(const godot_variant * arg, struct psd_export_options * options, layer_filter_holder * holder) {
+	psd_export_options_init(options);
+	// extract_psd leaves the layer metadata next to the files unless told not to
+	options->metadata = 1;
+
+	godot_dictionary dict = api->godot_variant_as_dictionary(arg);
+	options->filter = _read_layer_filter(&dict, holder);
+	options->threads = _dictionary_get_int(&dict, "threads", options->threads);
+	options->incremental = _dictionary_get_bool(&dict, "incremental", options->incremental);
+	options->trim = _dictionary_get_bool(&dict, "trim", options->trim);
+	options->dedup = _dictionary_get_bool(&dict, "dedup", options->dedup);
+	options->memory_budget_mb = _dictionary_get_int(&dict, "memory_budget_mb", options->memory_budget_mb);
+	options->png_profile = _dictionary_get_png_profile(&dict, "png_profile", options->png_profile);
+	options->texture_format = _dictionary_get_texture_format(&dict, "texture_format", options->texture_format);
+	options->bake = _dictionary_get_bool(&dict, "bake", options->bake);
+	options->group_frames = _dictionary_get_bool(&dict, "group_frames", options->group_frames);
+	options->metadata = _dictionary_get_bool(&dict, "metadata", options->metadata);
+	api->godot_dictionary_destroy(&dict);
+}
+
+static void _export_report_to_dictionary(const struct psd_export_report * report, godot_dictionary * dict) {
+	api->godot_dictionary_new(dict);
+
+	godot_pool_string_array changed;
+	api->godot_pool_string_array_new(&changed);
+	for (int i = 0; i < report->changed_count; i++) {
+		godot_string string;
+		api->godot_string_new(&string);
+		api->godot_string_parse_utf8(&string, report->changed[i]);
+		api->godot_pool_string_array_push_back(&changed, &string);
+		api->godot_string_destroy(&string);
+	}
+
+	godot_variant value;
+	api->godot_variant_new_pool_string_array(&value, &changed);
+	_dictionary_set(dict, "changed", &value);
+	api->godot_pool_string_array_destroy(&changed);
+
+	godot_dictionary frames;
+	api->godot_dictionary_new(&frames);
+	for (int i = 0; i < report->frame_count; i++) {
+		const struct psd_export_frame * frame = &report->frames[i];
+
+		godot_dictionary frame_dict;
+		api->godot_dictionary_new(&frame_dict);
+
+		godot_string file;
+		api->godot_string_new(&file);
+		api->godot_string_parse_utf8(&file, frame->file);
+		api->godot_variant_new_string(&value, &file);
+		_dictionary_set(&frame_dict, "file", &value);
+		api->godot_string_destroy(&file);
+
+		godot_rect2 rect;
+		api->godot_rect2_new(&rect, 0, 0, frame->width, frame->height);
+		api->godot_variant_new_rect2(&value, &rect);
+		_dictionary_set(&frame_dict, "region", &value);
+
+		// AtlasTexture margins: trimmed offset and the size given back around the region
+		api->godot_rect2_new(&rect, frame->offset_x, frame->offset_y, frame->layer_width - frame->width, frame->layer_height - frame->height);
+		api->godot_variant_new_rect2(&value, &rect);
+		_dictionary_set(&frame_dict, "margin", &value);
+
+		api->godot_variant_new_dictionary(&value, &frame_dict);
+		_dictionary_set(&frames, frame->name, &value);
+		api->godot_dictionary_destroy(&frame_dict);
+	}
+
+	api->godot_variant_new_dictionary(&value, &frames);
+	_dictionary_set(dict, "frames", &value);
+	api->godot_dictionary_destroy(&frames);
+
+	// of the files, ".png" or ".stex"
+	godot_string extension;
+	api->godot_string_new(&extension);
+	api->godot_string_parse_utf8(&extension, psd_texture_format_extension(report->texture_format));
+	api->godot_variant_new_string(&value, &extension);
+	_dictionary_set(dict, "extension", &value);
+	api->godot_string_destroy(&extension);
+
+	api->godot_variant_new_bool(&value, report->metadata_failed != 0);
+	_dictionary_set(dict, "metadata_failed", &value);
+}
+
 static GDCALLINGCONV godot_variant extract_psd(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
 	godot_variant ret;
 	data_struct * user_data = (data_struct *) p_user_data;
 
-	if (!user_data || !user_data->doc || p_num_args != 1) {
+	if (!user_data || !user_data->doc || p_num_args < 1 || p_num_args > 2) {
 		api->godot_variant_new_bool(&ret, false);
 		return ret;
 	}
 
 	bool success = false;
+	bool has_report = false;
+	godot_dictionary report_dict;
+	double start = _now_ms();
 
 	if (api->godot_variant_get_type(p_args[0]) == GODOT_VARIANT_TYPE_STRING) {
 		godot_string dir_str = api->godot_variant_as_string(p_args[0]);
 		godot_char_string cstr = api->godot_string_utf8(&dir_str);
 		const char * dir = api->godot_char_string_get_data(&cstr);
 
-		success = true;
-		psd_document_save_layers(user_data->doc, dir);
+		if (p_num_args == 2 && api->godot_variant_get_type(p_args[1]) == GODOT_VARIANT_TYPE_DICTIONARY) {
+			struct psd_export_options options;
+			struct psd_export_report report;
+			layer_filter_holder filter;
+			_read_export_options(p_args[1], &options, &filter);
+			success = psd_document_export_layers(user_data->doc, dir, &options, &report) >= 0;
+			_layer_filter_holder_destroy(&filter);
+			if (success) {
+				_export_report_to_dictionary(&report, &report_dict);
+				psd_export_report_free(&report);
+				has_report = true;
+			}
+		} else if (p_num_args == 1) {
+			struct psd_export_options options;
+			psd_export_options_init(&options);
+			options.metadata = 1;
+			success = psd_document_export_layers(user_data->doc, dir, &options, NULL) >= 0;
+		}
 
 		api->godot_char_string_destroy(&cstr);
 		api->godot_string_destroy(&dir_str);
 	}
+
+	user_data->extract_ms += _now_ms() - start;
+
+	if (has_report) {
+		api->godot_variant_new_dictionary(&ret, &report_dict);
+		api->godot_dictionary_destroy(&report_dict);
+	} else {
+		api->godot_variant_new_bool(&ret, success);
+	}
+	return ret;
+}
+
+// Same arguments as extract_psd with an options dictionary. Returns whether
+// the export was started; poll_extract reports its progress, finish_extract
+// waits for it and returns the report extract_psd would have.
+static GDCALLINGCONV godot_variant extract_psd_async(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	data_struct * user_data = (data_struct *) p_user_data;
+
+	if (!user_data || !user_data->doc || user_data->task || p_num_args != 2
+			|| api->godot_variant_get_type(p_args[0]) != GODOT_VARIANT_TYPE_STRING) {
+		api->godot_variant_new_bool(&ret, false);
+		return ret;
+	}
+
+	godot_string dir_str = api->godot_variant_as_string(p_args[0]);
+	godot_char_string cstr = api->godot_string_utf8(&dir_str);
+	const char * dir = api->godot_char_string_get_data(&cstr);
+
+	// the task keeps its own copy of the filter
+	struct psd_export_options options;
+	layer_filter_holder filter;
+	_read_export_options(p_args[1], &options, &filter);
+	user_data->task_start = _now_ms();
+	user_data->task = psd_document_export_layers_async(user_data->doc, dir, &options);
+	_layer_filter_holder_destroy(&filter);
+	user_data->written_polled = 0;
+
+	api->godot_char_string_destroy(&cstr);
+	api->godot_string_destroy(&dir_str);
+
+	api->godot_variant_new_bool(&ret, user_data->task != NULL);
+	return ret;
+}
+
+// {"done": int, "total": int, "running": bool, "written": PoolStringArray}
+// where written only holds the files finished since the previous poll. Once
+// running is false, every written file has been returned.
+static GDCALLINGCONV godot_variant poll_extract(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	data_struct * user_data = (data_struct *) p_user_data;
+
+	if (!user_data || !user_data->task || p_num_args != 0) {
+		api->godot_variant_new_bool(&ret, false);
+		return ret;
+	}
+
+	int done = 0;
+	int total = 0;
+	bool finished = psd_export_task_progress(user_data->task, &done, &total) == 1;
+
+	godot_pool_string_array written;
+	api->godot_pool_string_array_new(&written);
+	int written_count = psd_export_task_written_count(user_data->task);
+	for (; user_data->written_polled < written_count; user_data->written_polled++) {
+		godot_string string;
+		api->godot_string_new(&string);
+		api->godot_string_parse_utf8(&string, psd_export_task_written(user_data->task, user_data->written_polled));
+		api->godot_pool_string_array_push_back(&written, &string);
+		api->godot_string_destroy(&string);
+	}
+
+	godot_dictionary dict;
+	api->godot_dictionary_new(&dict);
+	godot_variant value;
+	api->godot_variant_new_int(&value, done);
+	_dictionary_set(&dict, "done", &value);
+	api->godot_variant_new_int(&value, total);
+	_dictionary_set(&dict, "total", &value);
+	api->godot_variant_new_bool(&value, !finished);
+	_dictionary_set(&dict, "running", &value);
+	api->godot_variant_new_pool_string_array(&value, &written);
+	_dictionary_set(&dict, "written", &value);
+	api->godot_pool_string_array_destroy(&written);
+
+	api->godot_variant_new_dictionary(&ret, &dict);
+	api->godot_dictionary_destroy(&dict);
+	return ret;
+}
+
+static GDCALLINGCONV godot_variant cancel_extract(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	data_struct * user_data = (data_struct *) p_user_data;
+
+	bool success = user_data && user_data->task && p_num_args == 0;
+	if (success)
+		psd_export_task_cancel(user_data->task);
+
 	api->godot_variant_new_bool(&ret, success);
 	return ret;
 }
 
-static bool _is_sprite_frames(struct psd_document * doc) {
+static GDCALLINGCONV godot_variant finish_extract(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	data_struct * user_data = (data_struct *) p_user_data;
+
+	if (!user_data || !user_data->task || p_num_args != 0) {
+		api->godot_variant_new_bool(&ret, false);
+		return ret;
+	}
+
+	struct psd_export_report report;
+	bool success = psd_export_task_wait(user_data->task, &report) >= 0;
+	psd_export_task_free(user_data->task);
+	user_data->task = NULL;
+	user_data->extract_ms += _now_ms() - user_data->task_start;
+
+	if (success) {
+		godot_dictionary report_dict;
+		_export_report_to_dictionary(&report, &report_dict);
+		api->godot_variant_new_dictionary(&ret, &report_dict);
+		api->godot_dictionary_destroy(&report_dict);
+	} else {
+		api->godot_variant_new_bool(&ret, false);
+	}
+	psd_export_report_free(&report);
+	return ret;
+}
+
+// "animation/frame", allocated with godot_alloc
+static char * _frame_path(const struct psd_document * doc, const struct psd_node * animation, const struct psd_node * frame) {
+	const char * animation_name = psd_document_node_name(doc, animation);
+	const char * frame_name = psd_document_node_name(doc, frame);
+	size_t animation_length = strlen(animation_name);
+	size_t frame_length = strlen(frame_name);
+	char * path = api->godot_alloc(animation_length + frame_length + 2);
+	memcpy(path, animation_name, animation_length);
+	path[animation_length] = '/';
+	memcpy(path + animation_length + 1, frame_name, frame_length + 1);
+	return path;
+}
+
+static bool _frame_accepted(const struct psd_document * doc, const struct psd_layer_filter * filter, const struct psd_node * animation, const struct psd_node * frame) {
+	if (filter == NULL)
+		return true;
+
+	char * path = _frame_path(doc, animation, frame);
+	bool accepted = psd_layer_filter_accepts(filter, path, frame->visible);
+	api->godot_free(path);
+	return accepted;
+}
+
+// Animation groups the filter leaves out are not looked into
+static bool _animation_rejected(const struct psd_document * doc, const struct psd_layer_filter * filter, const struct psd_node * animation) {
+	return psd_layer_filter_rejects_group(filter, psd_document_node_name(doc, animation), animation->visible);
+}
+
+// "group_frames" of the optional dictionary argument, see _is_sprite_frames
+static bool _read_group_frames_arg(int p_num_args, godot_variant **p_args) {
+	if (p_num_args != 1 || api->godot_variant_get_type(p_args[0]) != GODOT_VARIANT_TYPE_DICTIONARY)
+		return false;
+
+	godot_dictionary dict = api->godot_variant_as_dictionary(p_args[0]);
+	bool group_frames = _dictionary_get_bool(&dict, "group_frames", false);
+	api->godot_dictionary_destroy(&dict);
+	return group_frames;
+}
+
+// Top-level groups are animations and their children frames. Frames are
+// layers, or with group_frames groups as well, each flattened into one frame.
+static bool _is_sprite_frames(const struct psd_document * doc, const struct psd_layer_filter * filter, bool group_frames) {
 	if (doc == NULL)
 		return false;
 
-	bool success = true;
+	struct psd_node_iter animations;
+	psd_node_iter_children(&animations, doc, -1);
+	for (const struct psd_node * animation = psd_node_iter_next(&animations); animation; animation = psd_node_iter_next(&animations)) {
+		if (!animation->is_group || _animation_rejected(doc, filter, animation))
+			continue;
 
-	struct psd_record * record = psd_document_first_child(doc);
-	while (record) {
-		if (record->is_group) {
-			struct psd_layer_group * group = record->data.group;
-			struct psd_record * nested_record = psd_layer_group_first_child(group);
-			while (nested_record) {
-				if (nested_record->is_group) {
-					success = false;
-					psd_record_free(nested_record);
-					break;
-				}
-				struct psd_record * next_nested_record = psd_layer_group_next_child(group);
-				psd_record_free(nested_record);
-				nested_record = next_nested_record;
-			}
-			if (!success) {
-				psd_record_free(record);
-				break;
-			}
+		struct psd_node_iter frames;
+		psd_node_iter_children(&frames, doc, psd_document_node_index(doc, animation));
+		for (const struct psd_node * frame = psd_node_iter_next(&frames); frame; frame = psd_node_iter_next(&frames)) {
+			if (frame->is_group && !group_frames && _frame_accepted(doc, filter, animation, frame))
+				return false;
 		}
-		struct psd_record * next_record = psd_document_next_child(doc);
-		psd_record_free(record);
-		record = next_record;
 	}
-	return success;
+	return true;
 }
 
 static GDCALLINGCONV godot_variant is_sprite_frames(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
 	godot_variant ret;
 	data_struct * user_data = (data_struct *) p_user_data;
 	
-	if (!user_data || !user_data->doc || p_num_args != 0) {
+	if (!user_data || !user_data->doc || p_num_args > 1) {
 		api->godot_variant_new_bool(&ret, false);
 		return ret;
 	}
 
-	bool success = _is_sprite_frames(user_data->doc);
+	layer_filter_holder holder;
+	const struct psd_layer_filter * filter = _read_layer_filter_arg(p_num_args, p_args, &holder);
+	bool success = _is_sprite_frames(user_data->doc, filter, _read_group_frames_arg(p_num_args, p_args));
+	_layer_filter_holder_destroy(&holder);
 
 	api->godot_variant_new_bool(&ret, success);
 	return ret;
 }
 
-static bool _get_sprite_frame_names(struct psd_document * doc, godot_dictionary * dict) {
+static bool _get_sprite_frame_names(const struct psd_document * doc, const struct psd_layer_filter * filter, bool group_frames, godot_dictionary * dict) {
 	if (doc == NULL || dict == NULL)
 		return false;
 	
-	if (!_is_sprite_frames(doc))
+	if (!_is_sprite_frames(doc, filter, group_frames))
 		return false;
 
-	bool success = true;
-	
 	api->godot_dictionary_new(dict);
-	
-	struct psd_record * animation_record = psd_document_first_child(doc);
-	while (animation_record) {
-		
-		if (animation_record->is_group) {
-			struct psd_layer_group * group = animation_record->data.group;
-			struct psd_record * frame_record = psd_layer_group_first_child(group);
-			godot_pool_string_array array;
-			api->godot_pool_string_array_new(&array);
-			//api->godot_pool_string_array_resize(&array, psd_layer_group_children_count(group));
-			while (frame_record) {
-				godot_string string;
-				api->godot_string_new(&string);
-				api->godot_string_parse_utf8(&string, psd_record_name(frame_record));
-				api->godot_pool_string_array_push_back(&array, &string);
-				api->godot_string_destroy(&string);
-
-				struct psd_record * next_frame_record = psd_layer_group_next_child(group);
-				psd_record_free(frame_record);
-				if (!success)
-					break;
-				frame_record = next_frame_record;
-			}
 
-			if (!success) {
-				api->godot_pool_string_array_destroy(&array);
-				psd_record_free(animation_record);
-				break;
-			}
+	struct psd_node_iter animations;
+	psd_node_iter_children(&animations, doc, -1);
+	for (const struct psd_node * animation = psd_node_iter_next(&animations); animation; animation = psd_node_iter_next(&animations)) {
+		if (!animation->is_group || _animation_rejected(doc, filter, animation))
+			continue;
 
-			godot_string key_str;
-			api->godot_string_new(&key_str);
-			api->godot_string_parse_utf8(&key_str, psd_record_name(animation_record));
+		godot_pool_string_array array;
+		api->godot_pool_string_array_new(&array);
 
-			godot_variant key;
-			api->godot_variant_new_string(&key, &key_str);
+		struct psd_node_iter frames;
+		psd_node_iter_children(&frames, doc, psd_document_node_index(doc, animation));
+		for (const struct psd_node * frame = psd_node_iter_next(&frames); frame; frame = psd_node_iter_next(&frames)) {
+			if (!_frame_accepted(doc, filter, animation, frame))
+				continue;
 
-			godot_variant value;
-			api->godot_variant_new_pool_string_array(&value, &array);
+			godot_string string;
+			api->godot_string_new(&string);
+			api->godot_string_parse_utf8(&string, psd_document_node_name(doc, frame));
+			api->godot_pool_string_array_push_back(&array, &string);
+			api->godot_string_destroy(&string);
+		}
 
-			api->godot_dictionary_set(dict, &key, &value);
-			api->godot_string_destroy(&key_str);
+		// an animation filtered down to nothing is left out altogether
+		if (filter && api->godot_pool_string_array_size(&array) == 0) {
 			api->godot_pool_string_array_destroy(&array);
-			api->godot_variant_destroy(&value);
-			api->godot_variant_destroy(&key);
+			continue;
 		}
-		struct psd_record * next_animation_record = psd_document_next_child(doc);
-		psd_record_free(animation_record);
-		animation_record = next_animation_record;
-	}
-	if (!success)
-		api->godot_dictionary_destroy(dict);
-	return success;
 
+		godot_string key_str;
+		api->godot_string_new(&key_str);
+		api->godot_string_parse_utf8(&key_str, psd_document_node_name(doc, animation));
+
+		godot_variant key;
+		api->godot_variant_new_string(&key, &key_str);
+
+		godot_variant value;
+		api->godot_variant_new_pool_string_array(&value, &array);
+
+		api->godot_dictionary_set(dict, &key, &value);
+		api->godot_string_destroy(&key_str);
+		api->godot_pool_string_array_destroy(&array);
+		api->godot_variant_destroy(&value);
+		api->godot_variant_destroy(&key);
+	}
+	return true;
 }
 
+// Takes an optional filter dictionary, as read by _read_layer_filter, which
+// may also set "group_frames"
 static GDCALLINGCONV godot_variant get_sprite_frame_names(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
 	godot_variant ret;
 	data_struct * user_data = (data_struct *) p_user_data;
 	
-	if (!user_data || !user_data->doc || p_num_args != 0) {
+	if (!user_data || !user_data->doc || p_num_args > 1) {
 		api->godot_variant_new_bool(&ret, false);
 		return ret;
 	}
 
+	double start = _now_ms();
+	layer_filter_holder holder;
+	const struct psd_layer_filter * filter = _read_layer_filter_arg(p_num_args, p_args, &holder);
 	godot_dictionary dict;
-	bool success = _get_sprite_frame_names(user_data->doc, &dict);
+	bool success = _get_sprite_frame_names(user_data->doc, filter, _read_group_frames_arg(p_num_args, p_args), &dict);
+	_layer_filter_holder_destroy(&holder);
+	user_data->frame_names_ms += _now_ms() - start;
 	
 	if (!success)
 		api->godot_variant_new_bool(&ret, false);
@@ -267,7 +778,915 @@ static GDCALLINGCONV godot_variant get_sprite_frame_names(godot_object *p_instan
 	return ret;
 }
 
+static void _read_atlas_options(const godot_variant * arg, struct psd_atlas_options * options, layer_filter_holder * holder) {
+	psd_atlas_options_init(options);
+
+	godot_dictionary dict = api->godot_variant_as_dictionary(arg);
+	options->filter = _read_layer_filter(&dict, holder);
+	options->max_size = _dictionary_get_int(&dict, "max_size", options->max_size);
+	options->padding = _dictionary_get_int(&dict, "padding", options->padding);
+	options->threads = _dictionary_get_int(&dict, "threads", options->threads);
+	options->png_profile = _dictionary_get_png_profile(&dict, "png_profile", options->png_profile);
+	options->texture_format = _dictionary_get_texture_format(&dict, "texture_format", options->texture_format);
+	options->bake = _dictionary_get_bool(&dict, "bake", options->bake);
+	options->group_frames = _dictionary_get_bool(&dict, "group_frames", options->group_frames);
+	api->godot_dictionary_destroy(&dict);
+}
+
+static void _atlas_report_to_dictionary(const struct psd_atlas_report * report, godot_dictionary * dict) {
+	api->godot_dictionary_new(dict);
+
+	godot_pool_string_array pages;
+	api->godot_pool_string_array_new(&pages);
+	for (int i = 0; i < report->page_count; i++) {
+		godot_string string;
+		api->godot_string_new(&string);
+		api->godot_string_parse_utf8(&string, report->pages[i]);
+		api->godot_pool_string_array_push_back(&pages, &string);
+		api->godot_string_destroy(&string);
+	}
+
+	godot_variant value;
+	api->godot_variant_new_pool_string_array(&value, &pages);
+	_dictionary_set(dict, "pages", &value);
+	api->godot_pool_string_array_destroy(&pages);
+
+	godot_dictionary frames;
+	api->godot_dictionary_new(&frames);
+	for (int i = 0; i < report->frame_count; i++) {
+		const struct psd_atlas_frame * frame = &report->frames[i];
+
+		godot_dictionary frame_dict;
+		api->godot_dictionary_new(&frame_dict);
+
+		api->godot_variant_new_int(&value, frame->page);
+		_dictionary_set(&frame_dict, "page", &value);
+
+		godot_rect2 rect;
+		api->godot_rect2_new(&rect, frame->x, frame->y, frame->width, frame->height);
+		api->godot_variant_new_rect2(&value, &rect);
+		_dictionary_set(&frame_dict, "region", &value);
+
+		// AtlasTexture margins: trimmed offset and the size given back around the region
+		api->godot_rect2_new(&rect, frame->offset_x, frame->offset_y, frame->layer_width - frame->width, frame->layer_height - frame->height);
+		api->godot_variant_new_rect2(&value, &rect);
+		_dictionary_set(&frame_dict, "margin", &value);
+
+		api->godot_variant_new_dictionary(&value, &frame_dict);
+		_dictionary_set(&frames, frame->name, &value);
+		api->godot_dictionary_destroy(&frame_dict);
+	}
+
+	api->godot_variant_new_dictionary(&value, &frames);
+	_dictionary_set(dict, "frames", &value);
+	api->godot_dictionary_destroy(&frames);
+}
+
+static GDCALLINGCONV godot_variant pack_atlas(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	data_struct * user_data = (data_struct *) p_user_data;
+
+	if (!user_data || !user_data->doc || p_num_args < 1 || p_num_args > 2
+	    || api->godot_variant_get_type(p_args[0]) != GODOT_VARIANT_TYPE_STRING) {
+		api->godot_variant_new_bool(&ret, false);
+		return ret;
+	}
+
+	struct psd_atlas_options options;
+	layer_filter_holder filter;
+	_layer_filter_holder_init(&filter);
+	if (p_num_args == 2 && api->godot_variant_get_type(p_args[1]) == GODOT_VARIANT_TYPE_DICTIONARY)
+		_read_atlas_options(p_args[1], &options, &filter);
+	else
+		psd_atlas_options_init(&options);
+
+	godot_string dir_str = api->godot_variant_as_string(p_args[0]);
+	godot_char_string cstr = api->godot_string_utf8(&dir_str);
+	const char * dir = api->godot_char_string_get_data(&cstr);
 
+	struct psd_atlas_report report;
+	bool success = psd_document_pack_atlas(user_data->doc, dir, &options, &report) >= 0;
+	_layer_filter_holder_destroy(&filter);
+
+	api->godot_char_string_destroy(&cstr);
+	api->godot_string_destroy(&dir_str);
+
+	if (!success) {
+		api->godot_variant_new_bool(&ret, false);
+		return ret;
+	}
+
+	godot_dictionary dict;
+	_atlas_report_to_dictionary(&report, &dict);
+	psd_atlas_report_free(&report);
+
+	api->godot_variant_new_dictionary(&ret, &dict);
+	api->godot_dictionary_destroy(&dict);
+	return ret;
+}
+
+// with bake, the layer's opacity, mask and clipping are applied to the pixels
+static bool _read_layer_rgba(const struct psd_document * doc, int index, bool bake, struct psd_pixel_layer_info * info, godot_pool_byte_array * data) {
+	if (psd_document_pixel_layer_info(doc, index, info) != 0)
+		return false;
+
+	api->godot_pool_byte_array_new(data);
+	api->godot_pool_byte_array_resize(data, info->width * info->height * 4);
+
+	godot_pool_byte_array_write_access * write = api->godot_pool_byte_array_write(data);
+	unsigned char * rgba = api->godot_pool_byte_array_write_access_ptr(write);
+	int err = bake? psd_document_pixel_layer_bake_rgba(doc, index, rgba) : psd_document_pixel_layer_read_rgba(doc, index, rgba);
+	api->godot_pool_byte_array_write_access_destroy(write);
+
+	if (err != 0) {
+		api->godot_pool_byte_array_destroy(data);
+		return false;
+	}
+	return true;
+}
+
+// The group at path flattened, see psd_document_composite_group; info gets
+// where it lies in the document
+static bool _read_group_rgba(const struct psd_document * doc, const char * path, int threads, struct psd_pixel_layer_info * info, godot_pool_byte_array * data) {
+	struct psd_composite composite;
+	if (psd_document_composite_group(doc, path, threads, &composite) != 0)
+		return false;
+
+	info->name = path;
+	info->x = composite.x;
+	info->y = composite.y;
+	info->width = composite.width;
+	info->height = composite.height;
+	info->visible = 1;
+
+	api->godot_pool_byte_array_new(data);
+	api->godot_pool_byte_array_resize(data, composite.width * composite.height * 4);
+	godot_pool_byte_array_write_access * write = api->godot_pool_byte_array_write(data);
+	memcpy(api->godot_pool_byte_array_write_access_ptr(write), composite.rgba, (size_t) composite.width * composite.height * 4);
+	api->godot_pool_byte_array_write_access_destroy(write);
+	psd_composite_free(&composite);
+	return true;
+}
+
+static bool _get_layer_image(const struct psd_document * doc, int index, godot_dictionary * dict, godot_string * name) {
+	struct psd_pixel_layer_info info;
+	godot_pool_byte_array data;
+	if (!_read_layer_rgba(doc, index, false, &info, &data))
+		return false;
+
+	api->godot_dictionary_new(dict);
+
+	godot_variant value;
+	api->godot_variant_new_int(&value, info.x);
+	_dictionary_set(dict, "x", &value);
+	api->godot_variant_new_int(&value, info.y);
+	_dictionary_set(dict, "y", &value);
+	api->godot_variant_new_int(&value, info.width);
+	_dictionary_set(dict, "width", &value);
+	api->godot_variant_new_int(&value, info.height);
+	_dictionary_set(dict, "height", &value);
+	api->godot_variant_new_pool_byte_array(&value, &data);
+	_dictionary_set(dict, "data", &value);
+	api->godot_pool_byte_array_destroy(&data);
+
+	api->godot_string_new(name);
+	api->godot_string_parse_utf8(name, info.name);
+	return true;
+}
+
+// Reads the flattened image of a file without loading it as a document:
+// {"width": int, "height": int, "data": PoolByteArray of RGBA8}
+static GDCALLINGCONV godot_variant load_composite(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	data_struct * user_data = (data_struct *) p_user_data;
+
+	if (!user_data || p_num_args != 1) {
+		api->godot_variant_new_bool(&ret, false);
+		return ret;
+	}
+
+	double start = _now_ms();
+	godot_string filename_str = api->godot_variant_as_string(p_args[0]);
+	godot_char_string cstr = api->godot_string_utf8(&filename_str);
+	struct psd_composite composite;
+	int err = psd_composite_load(api->godot_char_string_get_data(&cstr), &composite);
+	api->godot_char_string_destroy(&cstr);
+	api->godot_string_destroy(&filename_str);
+
+	if (err != 0) {
+		api->godot_variant_new_bool(&ret, false);
+		return ret;
+	}
+
+	godot_pool_byte_array data;
+	api->godot_pool_byte_array_new(&data);
+	api->godot_pool_byte_array_resize(&data, composite.width * composite.height * 4);
+	godot_pool_byte_array_write_access * write = api->godot_pool_byte_array_write(&data);
+	memcpy(api->godot_pool_byte_array_write_access_ptr(write), composite.rgba, (size_t) composite.width * composite.height * 4);
+	api->godot_pool_byte_array_write_access_destroy(write);
+
+	godot_dictionary dict;
+	api->godot_dictionary_new(&dict);
+	godot_variant value;
+	api->godot_variant_new_int(&value, composite.width);
+	_dictionary_set(&dict, "width", &value);
+	api->godot_variant_new_int(&value, composite.height);
+	_dictionary_set(&dict, "height", &value);
+	api->godot_variant_new_pool_byte_array(&value, &data);
+	_dictionary_set(&dict, "data", &value);
+	api->godot_pool_byte_array_destroy(&data);
+	psd_composite_free(&composite);
+	user_data->file_load_ms = _now_ms() - start;
+
+	api->godot_variant_new_dictionary(&ret, &dict);
+	api->godot_dictionary_destroy(&dict);
+	return ret;
+}
+
+// Flattens the visible layers of a group of the loaded document, or of the
+// whole document for an empty path, with their blend modes, opacities, masks
+// and clipping: {"x": int, "y": int, "width": int, "height": int, "data":
+// PoolByteArray of RGBA8}, placed where it covers the canvas. An optional
+// second argument sets the number of threads.
+static GDCALLINGCONV godot_variant composite_group(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	data_struct * user_data = (data_struct *) p_user_data;
+
+	if (!user_data || !user_data->doc || p_num_args < 1 || p_num_args > 2
+	    || api->godot_variant_get_type(p_args[0]) != GODOT_VARIANT_TYPE_STRING) {
+		api->godot_variant_new_bool(&ret, false);
+		return ret;
+	}
+
+	int threads = p_num_args == 2? (int) api->godot_variant_as_int(p_args[1]) : 0;
+	godot_string group_str = api->godot_variant_as_string(p_args[0]);
+	godot_char_string cstr = api->godot_string_utf8(&group_str);
+	const char * group = api->godot_char_string_get_data(&cstr);
+	struct psd_pixel_layer_info info;
+	godot_pool_byte_array data;
+	bool success = _read_group_rgba(user_data->doc, group[0] != '\0'? group : NULL, threads, &info, &data);
+	api->godot_char_string_destroy(&cstr);
+	api->godot_string_destroy(&group_str);
+
+	if (!success) {
+		api->godot_variant_new_bool(&ret, false);
+		return ret;
+	}
+
+	godot_dictionary dict;
+	api->godot_dictionary_new(&dict);
+	godot_variant value;
+	api->godot_variant_new_int(&value, info.x);
+	_dictionary_set(&dict, "x", &value);
+	api->godot_variant_new_int(&value, info.y);
+	_dictionary_set(&dict, "y", &value);
+	api->godot_variant_new_int(&value, info.width);
+	_dictionary_set(&dict, "width", &value);
+	api->godot_variant_new_int(&value, info.height);
+	_dictionary_set(&dict, "height", &value);
+	api->godot_variant_new_pool_byte_array(&value, &data);
+	_dictionary_set(&dict, "data", &value);
+	api->godot_pool_byte_array_destroy(&data);
+
+	api->godot_variant_new_dictionary(&ret, &dict);
+	api->godot_dictionary_destroy(&dict);
+	return ret;
+}
+
+static GDCALLINGCONV godot_variant get_layer_images(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	data_struct * user_data = (data_struct *) p_user_data;
+
+	int count = -1;
+	if (user_data && user_data->doc && p_num_args <= 1)
+		count = psd_document_pixel_layer_count(user_data->doc);
+
+	if (count < 0) {
+		api->godot_variant_new_bool(&ret, false);
+		return ret;
+	}
+
+	layer_filter_holder holder;
+	const struct psd_layer_filter * filter = _read_layer_filter_arg(p_num_args, p_args, &holder);
+
+	godot_dictionary dict;
+	api->godot_dictionary_new(&dict);
+
+	bool success = true;
+	for (int i = 0; i < count && success; i++) {
+		struct psd_pixel_layer_info info;
+		if (filter && (psd_document_pixel_layer_info(user_data->doc, i, &info) != 0
+				|| !psd_layer_filter_accepts(filter, info.name, info.visible)))
+			continue;
+
+		godot_dictionary layer;
+		godot_string name;
+		success = _get_layer_image(user_data->doc, i, &layer, &name);
+		if (!success)
+			break;
+
+		godot_variant key;
+		api->godot_variant_new_string(&key, &name);
+		godot_variant value;
+		api->godot_variant_new_dictionary(&value, &layer);
+
+		api->godot_dictionary_set(&dict, &key, &value);
+		api->godot_variant_destroy(&value);
+		api->godot_variant_destroy(&key);
+		api->godot_dictionary_destroy(&layer);
+		api->godot_string_destroy(&name);
+	}
+	_layer_filter_holder_destroy(&holder);
+
+	if (!success)
+		api->godot_variant_new_bool(&ret, false);
+	else
+		api->godot_variant_new_dictionary(&ret, &dict);
+	api->godot_dictionary_destroy(&dict);
+	return ret;
+}
+
+// Engine methods build_sprite_frames calls, looked up on first use
+static struct {
+	bool ready;
+	godot_object * resource_loader;
+	godot_method_bind * load;
+	godot_method_bind * has_animation;
+	godot_method_bind * add_animation;
+	godot_method_bind * remove_animation;
+	godot_method_bind * set_animation_speed;
+	godot_method_bind * set_animation_loop;
+	godot_method_bind * add_frame;
+	godot_method_bind * set_atlas;
+	godot_method_bind * set_region;
+	godot_method_bind * set_margin;
+	godot_method_bind * create_from_data;
+	godot_method_bind * create_from_image;
+} engine;
+
+static void _engine_init(void) {
+	if (engine.ready)
+		return;
+	char resource_loader[] = "ResourceLoader";
+	engine.resource_loader = api->godot_global_get_singleton(resource_loader);
+	engine.load = api->godot_method_bind_get_method("_ResourceLoader", "load");
+	engine.has_animation = api->godot_method_bind_get_method("SpriteFrames", "has_animation");
+	engine.add_animation = api->godot_method_bind_get_method("SpriteFrames", "add_animation");
+	engine.remove_animation = api->godot_method_bind_get_method("SpriteFrames", "remove_animation");
+	engine.set_animation_speed = api->godot_method_bind_get_method("SpriteFrames", "set_animation_speed");
+	engine.set_animation_loop = api->godot_method_bind_get_method("SpriteFrames", "set_animation_loop");
+	engine.add_frame = api->godot_method_bind_get_method("SpriteFrames", "add_frame");
+	engine.set_atlas = api->godot_method_bind_get_method("AtlasTexture", "set_atlas");
+	engine.set_region = api->godot_method_bind_get_method("AtlasTexture", "set_region");
+	engine.set_margin = api->godot_method_bind_get_method("AtlasTexture", "set_margin");
+	engine.create_from_data = api->godot_method_bind_get_method("Image", "create_from_data");
+	engine.create_from_image = api->godot_method_bind_get_method("ImageTexture", "create_from_image");
+	engine.ready = true;
+}
+
+static godot_variant _call(godot_method_bind * method, godot_object * object, const godot_variant ** args, int arg_count) {
+	godot_variant_call_error error;
+	return api->godot_method_bind_call(method, object, args, arg_count, &error);
+}
+
+static void _call_and_drop(godot_method_bind * method, godot_object * object, const godot_variant ** args, int arg_count) {
+	godot_variant ret = _call(method, object, args, arg_count);
+	api->godot_variant_destroy(&ret);
+}
+
+// A new instance of a Reference class, owned by the variant
+static godot_object * _new_reference(const char * class_name, godot_variant * owner) {
+	godot_object * object = api->godot_get_class_constructor(class_name)();
+	api->godot_variant_new_object(owner, object);
+	return object;
+}
+
+static void _variant_new_utf8(godot_variant * value, const char * utf8) {
+	godot_string string;
+	api->godot_string_new(&string);
+	api->godot_string_parse_utf8(&string, utf8);
+	api->godot_variant_new_string(value, &string);
+	api->godot_string_destroy(&string);
+}
+
+// AtlasTexture showing region of atlas, with margin around it
+static void _new_atlas_texture(const godot_variant * atlas, const godot_variant * region, const godot_variant * margin, godot_variant * texture) {
+	godot_object * object = _new_reference("AtlasTexture", texture);
+	const godot_variant * args[1] = { atlas };
+	_call_and_drop(engine.set_atlas, object, args, 1);
+	args[0] = region;
+	_call_and_drop(engine.set_region, object, args, 1);
+	args[0] = margin;
+	_call_and_drop(engine.set_margin, object, args, 1);
+}
+
+enum {
+	FRAMES_FROM_LAYERS,
+	FRAMES_FROM_FILES,
+	FRAMES_FROM_ATLAS
+};
+
+// Where build_sprite_frames takes the texture of each frame from
+typedef struct {
+	const struct psd_document * doc;
+	int mode;
+	godot_dictionary frames; // the "frames" of the export or atlas report
+	godot_dictionary layers; // layers: pixel layer index by path
+	char * dir; // files: directory of the layer files, may be empty
+	char * extension; // files: of the layer files
+	godot_dictionary changed; // files: written by the export, so not loaded from the resource cache
+	godot_dictionary textures; // files: textures by file, shared with the caller
+	bool trim; // files: show the trimmed region of each file
+	bool bake; // layers: apply each layer's opacity, mask and clipping
+	bool group_frames; // frame groups are frames, composited in layers mode
+	godot_array pages; // atlas: page textures
+} frame_source;
+
+static void _frame_source_init(frame_source * source, const struct psd_document * doc, const godot_dictionary * options) {
+	source->doc = doc;
+	source->mode = FRAMES_FROM_LAYERS;
+	source->dir = NULL;
+	source->extension = NULL;
+	source->trim = false;
+	source->bake = false;
+	source->group_frames = _dictionary_get_bool(options, "group_frames", false);
+	api->godot_dictionary_new(&source->frames);
+	api->godot_dictionary_new(&source->layers);
+	api->godot_dictionary_new(&source->changed);
+	api->godot_dictionary_new(&source->textures);
+	api->godot_array_new(&source->pages);
+
+	godot_variant value;
+	godot_dictionary report;
+	if (_dictionary_get(options, "report", &value)) {
+		source->mode = FRAMES_FROM_FILES;
+		report = api->godot_variant_as_dictionary(&value);
+		api->godot_variant_destroy(&value);
+	} else if (_dictionary_get(options, "atlas", &value)) {
+		source->mode = FRAMES_FROM_ATLAS;
+		report = api->godot_variant_as_dictionary(&value);
+		api->godot_variant_destroy(&value);
+	}
+
+	if (source->mode != FRAMES_FROM_LAYERS) {
+		if (_dictionary_get(&report, "frames", &value)) {
+			api->godot_dictionary_destroy(&source->frames);
+			source->frames = api->godot_variant_as_dictionary(&value);
+			api->godot_variant_destroy(&value);
+		}
+	}
+
+	if (source->mode == FRAMES_FROM_FILES) {
+		godot_pool_string_array changed;
+		int changed_count = _dictionary_get_strings(&report, "changed", &changed);
+		for (int i = 0; i < changed_count; i++) {
+			godot_string file = api->godot_pool_string_array_get(&changed, i);
+			godot_variant key;
+			api->godot_variant_new_string(&key, &file);
+			godot_variant yes;
+			api->godot_variant_new_bool(&yes, true);
+			api->godot_dictionary_set(&source->changed, &key, &yes);
+			api->godot_variant_destroy(&key);
+			api->godot_string_destroy(&file);
+		}
+		api->godot_pool_string_array_destroy(&changed);
+
+		if (_dictionary_get(options, "textures", &value)) {
+			api->godot_dictionary_destroy(&source->textures);
+			source->textures = api->godot_variant_as_dictionary(&value);
+			api->godot_variant_destroy(&value);
+		}
+
+		godot_string extension;
+		if (_dictionary_get(&report, "extension", &value)) {
+			extension = api->godot_variant_as_string(&value);
+			api->godot_variant_destroy(&value);
+		} else {
+			api->godot_string_new(&extension);
+			api->godot_string_parse_utf8(&extension, ".png");
+		}
+		source->extension = _copy_utf8(&extension);
+		api->godot_string_destroy(&extension);
+
+		if (_dictionary_get(options, "dir", &value)) {
+			godot_string dir = api->godot_variant_as_string(&value);
+			source->dir = _copy_utf8(&dir);
+			api->godot_string_destroy(&dir);
+			api->godot_variant_destroy(&value);
+		}
+		source->trim = _dictionary_get_bool(options, "trim", false);
+	} else if (source->mode == FRAMES_FROM_ATLAS) {
+		if (_dictionary_get(options, "pages", &value)) {
+			api->godot_array_destroy(&source->pages);
+			source->pages = api->godot_variant_as_array(&value);
+			api->godot_variant_destroy(&value);
+		}
+	} else {
+		source->bake = _dictionary_get_bool(options, "bake", false);
+		int count = psd_document_pixel_layer_count(doc);
+		for (int i = 0; i < count; i++) {
+			struct psd_pixel_layer_info info;
+			if (psd_document_pixel_layer_info(doc, i, &info) != 0)
+				continue;
+			godot_variant key;
+			_variant_new_utf8(&key, info.name);
+			godot_variant index;
+			api->godot_variant_new_int(&index, i);
+			api->godot_dictionary_set(&source->layers, &key, &index);
+			api->godot_variant_destroy(&key);
+		}
+	}
+
+	if (source->mode != FRAMES_FROM_LAYERS)
+		api->godot_dictionary_destroy(&report);
+}
+
+static void _frame_source_destroy(frame_source * source) {
+	api->godot_dictionary_destroy(&source->frames);
+	api->godot_dictionary_destroy(&source->layers);
+	api->godot_dictionary_destroy(&source->changed);
+	api->godot_dictionary_destroy(&source->textures);
+	api->godot_array_destroy(&source->pages);
+	if (source->dir)
+		api->godot_free(source->dir);
+	if (source->extension)
+		api->godot_free(source->extension);
+}
+
+static bool _layer_texture(frame_source * source, const char * path, godot_variant * texture) {
+	// paths that are no layer are frame groups
+	godot_variant index_var;
+	int index = -1;
+	if (_dictionary_get(&source->layers, path, &index_var)) {
+		index = api->godot_variant_as_int(&index_var);
+		api->godot_variant_destroy(&index_var);
+	} else if (!source->group_frames) {
+		return false;
+	}
+
+	struct psd_pixel_layer_info info;
+	godot_pool_byte_array data;
+	if (index >= 0? !_read_layer_rgba(source->doc, index, source->bake, &info, &data) : !_read_group_rgba(source->doc, path, 0, &info, &data))
+		return false;
+
+	godot_variant image;
+	godot_object * image_object = _new_reference("Image", &image);
+	godot_variant width, height, mipmaps, format, data_var;
+	api->godot_variant_new_int(&width, info.width);
+	api->godot_variant_new_int(&height, info.height);
+	api->godot_variant_new_bool(&mipmaps, false);
+	api->godot_variant_new_int(&format, 5); // Image.FORMAT_RGBA8
+	api->godot_variant_new_pool_byte_array(&data_var, &data);
+	const godot_variant * image_args[5] = { &width, &height, &mipmaps, &format, &data_var };
+	_call_and_drop(engine.create_from_data, image_object, image_args, 5);
+	api->godot_variant_destroy(&data_var);
+	api->godot_pool_byte_array_destroy(&data);
+
+	godot_object * texture_object = _new_reference("ImageTexture", texture);
+	godot_variant flags;
+	api->godot_variant_new_int(&flags, 7); // Texture.FLAGS_DEFAULT
+	const godot_variant * texture_args[2] = { &image, &flags };
+	_call_and_drop(engine.create_from_image, texture_object, texture_args, 2);
+	api->godot_variant_destroy(&image);
+	return true;
+}
+
+static bool _file_texture(frame_source * source, const godot_dictionary * frame, godot_variant * texture) {
+	godot_variant file;
+	if (!_dictionary_get(frame, "file", &file))
+		return false;
+
+	// frames deduplicated into one file share its texture
+	if (api->godot_dictionary_has(&source->textures, &file)) {
+		*texture = api->godot_dictionary_get(&source->textures, &file);
+	} else {
+		godot_string file_str = api->godot_variant_as_string(&file);
+		char * file_name = _copy_utf8(&file_str);
+		api->godot_string_destroy(&file_str);
+
+		size_t dir_length = source->dir? strlen(source->dir) : 0;
+		size_t file_length = strlen(file_name);
+		size_t extension_length = strlen(source->extension);
+		char * path = api->godot_alloc(dir_length + file_length + extension_length + 2);
+		char * end = path;
+		if (dir_length > 0) {
+			memcpy(end, source->dir, dir_length);
+			end += dir_length;
+			*end++ = '/';
+		}
+		memcpy(end, file_name, file_length);
+		memcpy(end + file_length, source->extension, extension_length + 1);
+		api->godot_free(file_name);
+
+		godot_variant path_var, type_hint, no_cache;
+		_variant_new_utf8(&path_var, path);
+		_variant_new_utf8(&type_hint, "");
+		api->godot_variant_new_bool(&no_cache, api->godot_dictionary_has(&source->changed, &file));
+		const godot_variant * args[3] = { &path_var, &type_hint, &no_cache };
+		*texture = _call(engine.load, engine.resource_loader, args, 3);
+		api->godot_variant_destroy(&path_var);
+		api->godot_variant_destroy(&type_hint);
+		api->godot_free(path);
+
+		api->godot_dictionary_set(&source->textures, &file, texture);
+	}
+	api->godot_variant_destroy(&file);
+
+	if (api->godot_variant_get_type(texture) != GODOT_VARIANT_TYPE_OBJECT) {
+		api->godot_variant_destroy(texture);
+		return false;
+	}
+
+	if (source->trim) {
+		godot_variant region, margin;
+		bool has_region = _dictionary_get(frame, "region", &region);
+		bool has_margin = has_region && _dictionary_get(frame, "margin", &margin);
+		if (has_margin) {
+			godot_variant file_texture = *texture;
+			_new_atlas_texture(&file_texture, &region, &margin, texture);
+			api->godot_variant_destroy(&file_texture);
+			api->godot_variant_destroy(&margin);
+		}
+		if (has_region)
+			api->godot_variant_destroy(&region);
+	}
+	return true;
+}
+
+static bool _atlas_texture(frame_source * source, const godot_dictionary * frame, godot_variant * texture) {
+	godot_variant page_var, region, margin;
+	if (!_dictionary_get(frame, "page", &page_var))
+		return false;
+	int page = api->godot_variant_as_int(&page_var);
+	api->godot_variant_destroy(&page_var);
+	if (page < 0 || page >= api->godot_array_size(&source->pages))
+		return false;
+
+	if (!_dictionary_get(frame, "region", &region))
+		return false;
+	if (!_dictionary_get(frame, "margin", &margin)) {
+		api->godot_variant_destroy(&region);
+		return false;
+	}
+
+	godot_variant atlas = api->godot_array_get(&source->pages, page);
+	_new_atlas_texture(&atlas, &region, &margin, texture);
+	api->godot_variant_destroy(&atlas);
+	api->godot_variant_destroy(&region);
+	api->godot_variant_destroy(&margin);
+	return true;
+}
+
+static bool _frame_texture(frame_source * source, const char * path, godot_variant * texture) {
+	if (source->mode == FRAMES_FROM_LAYERS)
+		return _layer_texture(source, path, texture);
+
+	godot_variant frame_var;
+	if (!_dictionary_get(&source->frames, path, &frame_var))
+		return false;
+	godot_dictionary frame = api->godot_variant_as_dictionary(&frame_var);
+	api->godot_variant_destroy(&frame_var);
+
+	bool found;
+	if (source->mode == FRAMES_FROM_FILES)
+		found = _file_texture(source, &frame, texture);
+	else
+		found = _atlas_texture(source, &frame, texture);
+	api->godot_dictionary_destroy(&frame);
+	return found;
+}
+
+static bool _build_sprite_frames(const struct psd_document * doc, const struct psd_layer_filter * filter, frame_source * source,
+                                 double default_fps, bool default_loop, godot_variant * sprite_frames) {
+	if (!_is_sprite_frames(doc, filter, source->group_frames))
+		return false;
+
+	_engine_init();
+	godot_object * object = _new_reference("SpriteFrames", sprite_frames);
+
+	godot_variant name;
+	const godot_variant * args[3] = { &name, NULL, NULL };
+	_variant_new_utf8(&name, "default");
+	_call_and_drop(engine.remove_animation, object, args, 1);
+	api->godot_variant_destroy(&name);
+
+	bool success = true;
+	struct psd_node_iter animations;
+	psd_node_iter_children(&animations, doc, -1);
+	for (const struct psd_node * animation = psd_node_iter_next(&animations); animation && success; animation = psd_node_iter_next(&animations)) {
+		if (!animation->is_group || _animation_rejected(doc, filter, animation))
+			continue;
+
+		const char * group_name = psd_document_node_name(doc, animation);
+		struct psd_animation_info info;
+		psd_animation_info_parse(group_name, &info);
+
+		char * animation_name = api->godot_alloc(info.name_length + 1);
+		memcpy(animation_name, group_name, info.name_length);
+		animation_name[info.name_length] = 0;
+		_variant_new_utf8(&name, animation_name);
+		api->godot_free(animation_name);
+
+		bool added = false;
+		struct psd_node_iter frames;
+		psd_node_iter_children(&frames, doc, psd_document_node_index(doc, animation));
+		for (const struct psd_node * frame = psd_node_iter_next(&frames); frame && success; frame = psd_node_iter_next(&frames)) {
+			if (!_frame_accepted(doc, filter, animation, frame))
+				continue;
+
+			if (!added) {
+				// groups named alike, such as "walk" and "walk@12", share one animation
+				godot_variant exists = _call(engine.has_animation, object, args, 1);
+				if (!api->godot_variant_as_bool(&exists)) {
+					godot_variant fps, loop;
+					_call_and_drop(engine.add_animation, object, args, 1);
+					api->godot_variant_new_real(&fps, info.fps > 0? info.fps : default_fps);
+					args[1] = &fps;
+					_call_and_drop(engine.set_animation_speed, object, args, 2);
+					api->godot_variant_new_bool(&loop, default_loop && !info.no_loop);
+					args[1] = &loop;
+					_call_and_drop(engine.set_animation_loop, object, args, 2);
+				}
+				api->godot_variant_destroy(&exists);
+				added = true;
+			}
+
+			char * path = _frame_path(doc, animation, frame);
+			godot_variant texture;
+			success = _frame_texture(source, path, &texture);
+			api->godot_free(path);
+			if (!success)
+				break;
+
+			godot_variant position;
+			api->godot_variant_new_int(&position, -1);
+			args[1] = &texture;
+			args[2] = &position;
+			_call_and_drop(engine.add_frame, object, args, 3);
+			api->godot_variant_destroy(&texture);
+		}
+		api->godot_variant_destroy(&name);
+	}
+
+	if (!success)
+		api->godot_variant_destroy(sprite_frames);
+	return success;
+}
+
+// Builds the SpriteFrames of the document in one call, ready to be saved:
+// {"default_fps": float, "loop": bool} plus the filter keys, and where the
+// frames come from. With {"report": <extract_psd report>, "dir": String}
+// each frame loads its layer file, reusing the textures already in
+// "textures" (by file, added to as files load) and, with "trim": true,
+// showing the trimmed region. With {"atlas": <pack_atlas report>, "pages":
+// Array of page textures} frames are atlas regions. Without either, the
+// layers are decoded into ImageTextures, with "bake": true after applying
+// their opacity, mask and clipping. With "group_frames": true the groups
+// inside animation groups are frames too, flattened into one image each.
+// Group names may set the playback of their animation, see
+// psd_animation_info.
+static GDCALLINGCONV godot_variant build_sprite_frames(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	data_struct * user_data = (data_struct *) p_user_data;
+
+	if (!user_data || !user_data->doc || p_num_args != 1
+			|| api->godot_variant_get_type(p_args[0]) != GODOT_VARIANT_TYPE_DICTIONARY) {
+		api->godot_variant_new_bool(&ret, false);
+		return ret;
+	}
+
+	double start = _now_ms();
+	godot_dictionary options = api->godot_variant_as_dictionary(p_args[0]);
+	layer_filter_holder holder;
+	const struct psd_layer_filter * filter = _read_layer_filter(&options, &holder);
+	godot_variant fps_var;
+	double default_fps = 5;
+	if (_dictionary_get(&options, "default_fps", &fps_var)) {
+		default_fps = api->godot_variant_as_real(&fps_var);
+		api->godot_variant_destroy(&fps_var);
+	}
+	bool default_loop = _dictionary_get_bool(&options, "loop", true);
+
+	frame_source source;
+	_frame_source_init(&source, user_data->doc, &options);
+	bool success = _build_sprite_frames(user_data->doc, filter, &source, default_fps, default_loop, &ret);
+	_frame_source_destroy(&source);
+	_layer_filter_holder_destroy(&holder);
+	api->godot_dictionary_destroy(&options);
+	user_data->sprite_frames_ms += _now_ms() - start;
+
+	if (!success)
+		api->godot_variant_new_bool(&ret, false);
+	return ret;
+}
+
+static void _dictionary_set_real(godot_dictionary * dict, const char * key, double value) {
+	godot_variant value_var;
+	api->godot_variant_new_real(&value_var, value);
+	_dictionary_set(dict, key, &value_var);
+}
+
+static void _dictionary_set_int(godot_dictionary * dict, const char * key, long long value) {
+	godot_variant value_var;
+	api->godot_variant_new_int(&value_var, value);
+	_dictionary_set(dict, key, &value_var);
+}
+
+// Sets up the document cache shared by every importer, for file_load calls
+// made with "cache": true. Takes {"max_mb": int, "directory": String}; an
+// empty directory keeps serialized trees off.
+static GDCALLINGCONV godot_variant configure_cache(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+
+	if (p_num_args != 1 || api->godot_variant_get_type(p_args[0]) != GODOT_VARIANT_TYPE_DICTIONARY) {
+		api->godot_variant_new_bool(&ret, false);
+		return ret;
+	}
+
+	godot_dictionary dict = api->godot_variant_as_dictionary(p_args[0]);
+
+	struct psd_cache_options options;
+	psd_cache_options_init(&options);
+	options.max_bytes = (long long) _dictionary_get_int(&dict, "max_mb", 0) * 1024 * 1024;
+
+	godot_variant directory_var;
+	godot_string directory_str;
+	godot_char_string cstr;
+	bool has_directory = _dictionary_get(&dict, "directory", &directory_var);
+	if (has_directory) {
+		directory_str = api->godot_variant_as_string(&directory_var);
+		cstr = api->godot_string_utf8(&directory_str);
+		const char * directory = api->godot_char_string_get_data(&cstr);
+		if (directory[0] != 0)
+			options.directory = directory;
+	}
+
+	bool success = psd_cache_configure(&options) == 0;
+
+	if (has_directory) {
+		api->godot_char_string_destroy(&cstr);
+		api->godot_string_destroy(&directory_str);
+		api->godot_variant_destroy(&directory_var);
+	}
+	api->godot_dictionary_destroy(&dict);
+
+	api->godot_variant_new_bool(&ret, success);
+	return ret;
+}
+
+static GDCALLINGCONV godot_variant get_import_stats(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args) {
+	godot_variant ret;
+	data_struct * user_data = (data_struct *) p_user_data;
+
+	if (!user_data || p_num_args != 0) {
+		api->godot_variant_new_bool(&ret, false);
+		return ret;
+	}
+
+	// the timings of this instance are there whatever was loaded last, a
+	// composite does not keep a document
+	godot_dictionary dict;
+	api->godot_dictionary_new(&dict);
+	_dictionary_set_real(&dict, "file_load_ms", user_data->file_load_ms);
+	_dictionary_set_real(&dict, "extract_ms", user_data->extract_ms);
+	_dictionary_set_real(&dict, "frame_names_ms", user_data->frame_names_ms);
+	_dictionary_set_real(&dict, "sprite_frames_ms", user_data->sprite_frames_ms);
+	long long allocations, allocated_bytes;
+	psd_allocation_counts(&allocations, &allocated_bytes);
+	_dictionary_set_int(&dict, "allocations", allocations - user_data->allocations_at_load);
+	_dictionary_set_int(&dict, "allocated_bytes", allocated_bytes - user_data->allocated_bytes_at_load);
+
+	struct psd_stats stats;
+	if (user_data->doc && psd_document_get_stats(user_data->doc, &stats) == 0) {
+		const struct psd_stats * at_load = &user_data->stats_at_load;
+		_dictionary_set_real(&dict, "parse_ms", user_data->parse_ms);
+		_dictionary_set_real(&dict, "decode_ms", stats.decode_ms - at_load->decode_ms);
+		_dictionary_set_real(&dict, "encode_ms", stats.encode_ms - at_load->encode_ms);
+		_dictionary_set_real(&dict, "write_ms", stats.write_ms - at_load->write_ms);
+		_dictionary_set_int(&dict, "decoded_layers", stats.decoded_layers - at_load->decoded_layers);
+		_dictionary_set_int(&dict, "decoded_bytes", stats.decoded_bytes - at_load->decoded_bytes);
+		_dictionary_set_int(&dict, "encoded_bytes", stats.encoded_bytes - at_load->encoded_bytes);
+		_dictionary_set_int(&dict, "written_files", stats.written_files - at_load->written_files);
+		_dictionary_set_int(&dict, "arena_allocations", stats.arena_allocations);
+		_dictionary_set_int(&dict, "arena_blocks", stats.arena_blocks);
+		_dictionary_set_int(&dict, "arena_reserved_bytes", stats.arena_reserved_bytes);
+		_dictionary_set_int(&dict, "arena_used_bytes", stats.arena_used_bytes);
+	}
+
+	struct psd_cache_stats cache_stats;
+	if (psd_cache_get_stats(&cache_stats) == 0) {
+		_dictionary_set_int(&dict, "cache_documents", cache_stats.documents);
+		_dictionary_set_int(&dict, "cache_bytes", cache_stats.bytes);
+		_dictionary_set_int(&dict, "cache_hits", cache_stats.hits);
+		_dictionary_set_int(&dict, "cache_tree_hits", cache_stats.tree_hits);
+		_dictionary_set_int(&dict, "cache_misses", cache_stats.misses);
+		_dictionary_set_int(&dict, "cache_evictions", cache_stats.evictions);
+	}
+
+	api->godot_variant_new_dictionary(&ret, &dict);
+	api->godot_dictionary_destroy(&dict);
+	return ret;
+}
 
 const struct godot_psdimporter godot_psdimporter = {0x01,
                                                       constructor, destructor,
@@ -275,4 +1694,12 @@ const struct godot_psdimporter godot_psdimporter = {0x01,
                                                       get_layer_count,
                                                       extract_psd,
                                                       is_sprite_frames, get_sprite_frame_names,
+                                                      pack_atlas,
+                                                      get_layer_images,
+                                                      get_import_stats,
+                                                      configure_cache,
+                                                      extract_psd_async, poll_extract, cancel_extract, finish_extract,
+                                                      load_composite,
+                                                      build_sprite_frames,
+                                                      composite_group,
                                                       };
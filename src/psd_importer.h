@@ -40,6 +40,17 @@ struct godot_psdimporter {
 	GDCALLINGCONV godot_variant (*extract_psd) (godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args);
 	GDCALLINGCONV godot_variant (*is_sprite_frames) (godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args);
 	GDCALLINGCONV godot_variant (*get_sprite_frame_names) (godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args);
+	GDCALLINGCONV godot_variant (*pack_atlas) (godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args);
+	GDCALLINGCONV godot_variant (*get_layer_images) (godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args);
+	GDCALLINGCONV godot_variant (*get_import_stats) (godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args);
+	GDCALLINGCONV godot_variant (*configure_cache) (godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args);
+	GDCALLINGCONV godot_variant (*extract_psd_async) (godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args);
+	GDCALLINGCONV godot_variant (*poll_extract) (godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args);
+	GDCALLINGCONV godot_variant (*cancel_extract) (godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args);
+	GDCALLINGCONV godot_variant (*finish_extract) (godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args);
+	GDCALLINGCONV godot_variant (*load_composite) (godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args);
+	GDCALLINGCONV godot_variant (*build_sprite_frames) (godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args);
+	GDCALLINGCONV godot_variant (*composite_group) (godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args);
 };
 
 extern const struct godot_psdimporter godot_psdimporter;
@@ -0,0 +1,356 @@
+#include "psd_parser.h"
+#include "psd_document.h"
+#include "mapped_file.h"
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Layer metadata files hold the node tree of a document for tools that only
+// need names and rectangles. They are little-endian whatever the host, and
+// laid out to be used in place from a read-only mapping:
+//
+//   meta_header
+//   node_count records of node_size bytes, the first fields as in meta_node
+//   index_size uint32 slots: node index + 1 of a path hashing there, 0 when
+//     empty; a power of two above node_count, probed linearly
+//   strings_size bytes of NUL-terminated paths; a node's name is the tail of
+//     its path
+//
+// Readers accept their own version only, and any node_size from the record
+// they know up, so that later versions can append fields to nodes.
+
+namespace {
+
+const uint32_t meta_magic = 0x4d445350; // "PSDM"
+const uint32_t meta_version = 1;
+
+struct meta_header {
+	uint32_t magic;
+	uint32_t version;
+	int32_t width;
+	int32_t height;
+	int32_t depth;
+	int32_t children_count; // top-level nodes, at the start of the nodes
+	uint32_t node_count;
+	uint32_t node_size;
+	uint32_t nodes_offset;
+	uint32_t index_size;
+	uint32_t index_offset;
+	uint32_t strings_size;
+	uint32_t strings_offset;
+};
+
+enum meta_node_flags {
+	meta_node_group = 1,
+	meta_node_visible = 2, // as in psd_node
+};
+
+struct meta_node {
+	int32_t parent;
+	int32_t first_child;
+	int32_t children_count;
+	uint32_t flags;
+	int32_t x;
+	int32_t y;
+	int32_t width;
+	int32_t height;
+	uint32_t name; // into the strings
+	uint32_t path;
+	uint32_t hash; // of the path, checked before comparing strings
+};
+
+const size_t header_fields = sizeof(meta_header) / sizeof(uint32_t);
+const size_t node_fields = sizeof(meta_node) / sizeof(uint32_t);
+
+// FNV-1a, 32 bits
+uint32_t hash_path(const char * path)
+{
+	uint32_t hash = 0x811c9dc5;
+	for (const unsigned char * p = (const unsigned char *) path; *p; p++)
+		hash = (hash ^ *p) * 0x01000193;
+	return hash;
+}
+
+uint32_t load_u32(const uint8_t * p)
+{
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+void append_u32(std::vector<uint8_t> & out, uint32_t value)
+{
+	out.push_back(value & 0xff);
+	out.push_back((value >> 8) & 0xff);
+	out.push_back((value >> 16) & 0xff);
+	out.push_back(value >> 24);
+}
+
+// both structs are made of 32-bit fields only
+void append_fields(std::vector<uint8_t> & out, const void * fields, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		append_u32(out, ((const uint32_t *) fields)[i]);
+}
+
+void load_fields(const uint8_t * p, void * fields, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		((uint32_t *) fields)[i] = load_u32(p + i * 4);
+}
+
+}
+
+struct psd_metadata {
+	mapped_file file;
+	meta_header header;
+	const uint8_t * nodes;
+	const uint8_t * index;
+	const char * strings;
+
+	meta_node node(int index) const
+	{
+		meta_node node;
+		load_fields(nodes + (size_t) index * header.node_size, &node, node_fields);
+		return node;
+	}
+
+	// the whole file is checked once so that lookups need not be
+	bool validate() const
+	{
+		const meta_header & h = header;
+		uint64_t size = file.size();
+		if (h.magic != meta_magic || h.version != meta_version || h.node_size < sizeof(meta_node))
+			return false;
+		if (h.nodes_offset > size || (uint64_t) h.node_count * h.node_size > size - h.nodes_offset)
+			return false;
+		if (h.index_offset > size || (uint64_t) h.index_size * 4 > size - h.index_offset)
+			return false;
+		if (h.strings_offset > size || h.strings_size > size - h.strings_offset)
+			return false;
+		if (h.index_size <= h.node_count || (h.index_size & (h.index_size - 1)) != 0)
+			return false;
+		if (h.strings_size == 0 || strings[h.strings_size - 1] != '\0')
+			return false;
+		if (h.children_count < 0 || (uint32_t) h.children_count > h.node_count)
+			return false;
+
+		for (uint32_t i = 0; i < h.node_count; i++) {
+			meta_node n = node(i);
+			if (n.parent < -1 || n.parent >= (int32_t) h.node_count || n.children_count < 0)
+				return false;
+			if (n.first_child < 0 || (uint32_t) n.first_child > h.node_count || (uint32_t) n.children_count > h.node_count - n.first_child)
+				return false;
+			if (n.path >= h.strings_size || n.name < n.path || n.name >= h.strings_size)
+				return false;
+		}
+		for (uint32_t i = 0; i < h.index_size; i++) {
+			if (load_u32(index + i * 4) > h.node_count)
+				return false;
+		}
+		return true;
+	}
+};
+
+int psd_document_write_metadata(const struct psd_document * doc, const char * filename)
+{
+	if (doc == NULL || filename == NULL)
+		return -1;
+
+	// paths are built from the tree, parents coming before their children
+	uint32_t node_count = doc->nodes.size();
+	std::vector<uint8_t> strings;
+	std::vector<meta_node> nodes(node_count);
+	std::string node_path;
+	for (uint32_t i = 0; i < node_count; i++) {
+		const psd_node & n = doc->nodes[i];
+		const char * name = doc->names.data() + n.name_offset;
+		if (n.parent >= 0 && (uint32_t) n.parent >= i)
+			return -1;
+		node_path.clear();
+		if (n.parent >= 0) {
+			node_path = (const char *) &strings[nodes[n.parent].path];
+			node_path += '/';
+		}
+		node_path += name;
+		meta_node & node = nodes[i];
+		node.parent = n.parent;
+		node.first_child = n.first_child;
+		node.children_count = n.children_count;
+		node.flags = (n.is_group? meta_node_group : 0) | (n.visible? meta_node_visible : 0);
+		node.x = n.x;
+		node.y = n.y;
+		node.width = n.width;
+		node.height = n.height;
+		node.path = strings.size();
+		node.name = node.path + node_path.size() - strlen(name);
+		node.hash = hash_path(node_path.c_str());
+		strings.insert(strings.end(), node_path.c_str(), node_path.c_str() + node_path.size() + 1);
+	}
+	if (strings.empty())
+		strings.push_back('\0');
+
+	// at most half full, and the first of several nodes with one path wins
+	uint32_t index_size = 2;
+	while (index_size < node_count * 2)
+		index_size *= 2;
+	std::vector<uint32_t> index(index_size, 0);
+	for (uint32_t i = 0; i < node_count; i++) {
+		uint32_t slot = nodes[i].hash & (index_size - 1);
+		bool duplicate = false;
+		for (; index[slot] != 0; slot = (slot + 1) & (index_size - 1)) {
+			const meta_node & other = nodes[index[slot] - 1];
+			if (other.hash == nodes[i].hash && strcmp((const char *) &strings[other.path], (const char *) &strings[nodes[i].path]) == 0) {
+				duplicate = true;
+				break;
+			}
+		}
+		if (!duplicate)
+			index[slot] = i + 1;
+	}
+
+	meta_header header;
+	header.magic = meta_magic;
+	header.version = meta_version;
+	header.width = doc->width;
+	header.height = doc->height;
+	header.depth = doc->depth;
+	header.children_count = doc->children_count;
+	header.node_count = node_count;
+	header.node_size = sizeof(meta_node);
+	header.nodes_offset = sizeof(meta_header);
+	header.index_size = index_size;
+	header.index_offset = header.nodes_offset + node_count * sizeof(meta_node);
+	header.strings_size = strings.size();
+	header.strings_offset = header.index_offset + index_size * 4;
+
+	std::vector<uint8_t> out;
+	out.reserve(header.strings_offset + strings.size());
+	append_fields(out, &header, header_fields);
+	for (uint32_t i = 0; i < node_count; i++)
+		append_fields(out, &nodes[i], node_fields);
+	append_fields(out, index.data(), index_size);
+	out.insert(out.end(), strings.begin(), strings.end());
+
+	// written aside and renamed, as tools may have the old file mapped
+	std::string path = filename;
+	std::string tmp = path + ".tmp";
+	FILE * file = fopen(tmp.c_str(), "wb");
+	if (file == NULL)
+		return -1;
+	bool ok = fwrite(out.data(), 1, out.size(), file) == out.size();
+	ok = fclose(file) == 0 && ok;
+	if (ok && rename(tmp.c_str(), path.c_str()) != 0) {
+		remove(path.c_str());
+		ok = rename(tmp.c_str(), path.c_str()) == 0;
+	}
+	if (!ok)
+		remove(tmp.c_str());
+	return ok? 0 : -1;
+}
+
+struct psd_metadata * psd_metadata_open(const char * filename)
+{
+	if (filename == NULL)
+		return NULL;
+
+	struct psd_metadata * metadata = new psd_metadata();
+	if (!metadata->file.open(filename) || metadata->file.size() < sizeof(meta_header)) {
+		delete metadata;
+		return NULL;
+	}
+	const uint8_t * data = metadata->file.data();
+	load_fields(data, &metadata->header, header_fields);
+	const meta_header & h = metadata->header;
+	uint64_t size = metadata->file.size();
+	metadata->nodes = data + (h.nodes_offset < size? h.nodes_offset : 0);
+	metadata->index = data + (h.index_offset < size? h.index_offset : 0);
+	metadata->strings = (const char *) data + (h.strings_offset < size? h.strings_offset : 0);
+	if (!metadata->validate()) {
+		delete metadata;
+		return NULL;
+	}
+	return metadata;
+}
+
+void psd_metadata_close(struct psd_metadata * metadata)
+{
+	delete metadata;
+}
+
+int psd_metadata_width(const struct psd_metadata * metadata)
+{
+	if (metadata == NULL)
+		return -1;
+	return metadata->header.width;
+}
+
+int psd_metadata_height(const struct psd_metadata * metadata)
+{
+	if (metadata == NULL)
+		return -1;
+	return metadata->header.height;
+}
+
+int psd_metadata_depth(const struct psd_metadata * metadata)
+{
+	if (metadata == NULL)
+		return -1;
+	return metadata->header.depth;
+}
+
+int psd_metadata_node_count(const struct psd_metadata * metadata)
+{
+	if (metadata == NULL)
+		return -1;
+	return metadata->header.node_count;
+}
+
+int psd_metadata_children_count(const struct psd_metadata * metadata)
+{
+	if (metadata == NULL)
+		return -1;
+	return metadata->header.children_count;
+}
+
+int psd_metadata_get_node(const struct psd_metadata * metadata, int index, struct psd_metadata_node * node)
+{
+	if (metadata == NULL || node == NULL)
+		return -1;
+	if (index < 0 || index >= (int) metadata->header.node_count)
+		return -1;
+
+	meta_node n = metadata->node(index);
+	node->name = metadata->strings + n.name;
+	node->path = metadata->strings + n.path;
+	node->is_group = (n.flags & meta_node_group)? 1 : 0;
+	node->parent = n.parent;
+	node->first_child = n.first_child;
+	node->children_count = n.children_count;
+	node->x = n.x;
+	node->y = n.y;
+	node->width = n.width;
+	node->height = n.height;
+	node->visible = (n.flags & meta_node_visible)? 1 : 0;
+	return 0;
+}
+
+int psd_metadata_find(const struct psd_metadata * metadata, const char * path)
+{
+	if (metadata == NULL || path == NULL)
+		return -1;
+
+	uint32_t hash = hash_path(path);
+	uint32_t mask = metadata->header.index_size - 1;
+	for (uint32_t i = 0, slot = hash & mask; i <= mask; i++, slot = (slot + 1) & mask) {
+		uint32_t entry = load_u32(metadata->index + slot * 4);
+		if (entry == 0)
+			break;
+		meta_node node = metadata->node(entry - 1);
+		if (node.hash == hash && strcmp(metadata->strings + node.path, path) == 0)
+			return entry - 1;
+	}
+	return -1;
+}
@@ -1,68 +1,408 @@
 #include "psd_parser.h"
+#include "psd_document.h"
+#include "pixel_ops.h"
+#include "psd_compose.h"
+#include "psd_reader.h"
 
-#include "parser/PsdParser.h"
-#include "Layer.h"
-#include "LayerGroup.h"
-
-#include "register_types.h"
+#include <stdlib.h>
+#include <string.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 struct psd_parser {
-	PsdParser * parser;
+	char * filename;
 };
 
-struct psd_document {
-	Document * doc;
+#ifdef __cplusplus
+}
+#endif
+
+static struct psd_allocator allocator = { malloc, free };
+static std::atomic<long long> n_allocations(0);
+static std::atomic<long long> n_allocated_bytes(0);
+
+void psd_parser_set_allocator(const struct psd_allocator * new_allocator)
+{
+	if (new_allocator && new_allocator->alloc && new_allocator->free) {
+		allocator = *new_allocator;
+	} else {
+		allocator.alloc = malloc;
+		allocator.free = free;
+	}
+}
+
+void * psd_alloc(size_t size)
+{
+	n_allocations++;
+	n_allocated_bytes += size;
+	return allocator.alloc(size);
+}
+
+void psd_allocation_counts(long long * allocations, long long * bytes)
+{
+	if (allocations)
+		*allocations = n_allocations;
+	if (bytes)
+		*bytes = n_allocated_bytes;
+}
+
+void psd_free(void * ptr)
+{
+	if (ptr)
+		allocator.free(ptr);
+}
+
+bool psd_copy_string(const std::string & src, char ** dst)
+{
+	*dst = (char *) psd_alloc(src.size() + 1);
+	if (*dst == NULL)
+		return false;
+	strcpy(*dst, src.c_str());
+	return true;
+}
+
+enum layer_entry_kind {
+	layer_entry_other,
+	layer_entry_divider,
+	layer_entry_folder,
+	layer_entry_pixels,
 };
 
-struct psd_layer {
-	Layer * layer;
+// What the tree needs from a layer record, whichever reader produced it
+struct layer_entry {
+	int kind;
+	int record;
+	const char * name; // borrowed from the context or the reader
+	bool visible;
+	int x;
+	int y;
+	int width;
+	int height;
 };
 
-struct psd_layer_group {
-	LayerGroup * group;
+typedef arena_vector<layer_entry> layer_entries;
+
+static void list_context_entries(const psd_context * context, layer_entries & entries)
+{
+	entries.resize(context->layer_count);
+	for (int i = 0; i < context->layer_count; i++) {
+		const psd_layer_record * record = &context->layer_records[i];
+		layer_entry & entry = entries[i];
+
+		switch (record->layer_type) {
+		case psd_layer_type_hidden:
+			entry.kind = layer_entry_divider;
+			break;
+		case psd_layer_type_folder:
+			entry.kind = layer_entry_folder;
+			break;
+		case psd_layer_type_normal:
+			if (record->width > 0 && record->height > 0 && record->image_data != NULL)
+				entry.kind = layer_entry_pixels;
+			else
+				entry.kind = layer_entry_other;
+			break;
+		default:
+			entry.kind = layer_entry_other;
+			break;
+		}
+		entry.record = i;
+		entry.name = (const char *) record->layer_name;
+		entry.visible = record->visible != 0;
+		entry.x = record->left;
+		entry.y = record->top;
+		entry.width = record->width;
+		entry.height = record->height;
+	}
+}
+
+static void list_reader_entries(const psd_reader * reader, layer_entries & entries)
+{
+	const arena_vector<psd_layer_ref> & layers = reader->layers();
+	entries.resize(layers.size());
+	for (size_t i = 0; i < layers.size(); i++) {
+		const psd_layer_ref & layer = layers[i];
+		layer_entry & entry = entries[i];
+
+		switch (layer.section) {
+		case psd_section_divider:
+			entry.kind = layer_entry_divider;
+			break;
+		case psd_section_open_folder:
+		case psd_section_closed_folder:
+			entry.kind = layer_entry_folder;
+			break;
+		default:
+			if (layer.width() > 0 && layer.height() > 0 && !layer.adjustment && layer.channel_count > 0)
+				entry.kind = layer_entry_pixels;
+			else
+				entry.kind = layer_entry_other;
+			break;
+		}
+		entry.record = (int) i;
+		entry.name = layer.name;
+		entry.visible = layer.visible();
+		entry.x = layer.left;
+		entry.y = layer.top;
+		entry.width = layer.width();
+		entry.height = layer.height();
+	}
+}
+
+struct parse_node {
+	const layer_entry * entry;
+	arena_vector<size_t> children;
+
+	explicit parse_node(arena & scratch) : entry(NULL), children(scratch) {}
 };
 
-#ifdef __cplusplus
+typedef arena_vector<parse_node> parse_tree;
+
+// Records are stored bottom-up: a group starts with a hidden section divider
+// and ends with the folder record carrying its name and bounds.
+static bool build_parse_tree(const layer_entries & entries, arena & scratch, parse_tree & tree)
+{
+	tree.reserve(entries.size() + 1);
+	tree.push_back(parse_node(scratch));
+
+	arena_vector<size_t> open_groups(scratch);
+	open_groups.push_back(0);
+
+	for (size_t i = 0; i < entries.size(); i++) {
+		const layer_entry * entry = &entries[i];
+
+		switch (entry->kind) {
+		case layer_entry_divider:
+			tree[open_groups.back()].children.push_back(tree.size());
+			open_groups.push_back(tree.size());
+			tree.push_back(parse_node(scratch));
+			break;
+		case layer_entry_folder:
+			if (open_groups.size() == 1)
+				return false;
+			tree[open_groups.back()].entry = entry;
+			open_groups.pop_back();
+			break;
+		case layer_entry_pixels:
+			tree[open_groups.back()].children.push_back(tree.size());
+			tree.push_back(parse_node(scratch));
+			tree.back().entry = entry;
+			break;
+		default:
+			break;
+		}
+	}
+	return open_groups.size() == 1;
 }
-#endif
 
-static struct psd_record * cxx_record_to_c(Record * record)
+// Lays the tree out breadth-first, which keeps every node's children next
+// to each other and the top-level nodes at the start of the array. Every
+// array of the document is reserved up front so the arena is not left with
+// the buffers of outgrown vectors.
+static void flatten_tree(const parse_tree & tree, arena & scratch, struct psd_document * doc)
 {
-	if (!record)
+	size_t names_size = 0;
+	size_t group_count = 0;
+	for (size_t i = 1; i < tree.size(); i++) {
+		names_size += strlen(tree[i].entry->name) + 1;
+		if (tree[i].entry->kind == layer_entry_folder)
+			group_count++;
+	}
+	doc->nodes.reserve(tree.size() - 1);
+	doc->node_records.reserve(tree.size() - 1);
+	doc->names.reserve(names_size);
+	doc->groups.reserve(group_count);
+	doc->layers.reserve(tree.size() - 1 - group_count);
+
+	arena_vector<size_t> order(scratch);
+	arena_vector<int> parents(scratch);
+	arena_vector<const char *> paths(scratch);
+	order.reserve(tree.size() - 1);
+	parents.reserve(tree.size() - 1);
+	paths.reserve(tree.size() - 1);
+	order.insert(order.end(), tree[0].children.begin(), tree[0].children.end());
+	parents.insert(parents.end(), order.size(), -1);
+
+	std::string path;
+	for (size_t k = 0; k < order.size(); k++) {
+		const parse_node & item = tree[order[k]];
+		const layer_entry & entry = *item.entry;
+		const char * name = entry.name;
+
+		psd_node node;
+		node.is_group = entry.kind == layer_entry_folder? 1 : 0;
+		node.parent = parents[k];
+		node.first_child = order.size();
+		node.children_count = item.children.size();
+		node.name_offset = doc->names.size();
+		node.x = entry.x;
+		node.y = entry.y;
+		node.width = entry.width;
+		node.height = entry.height;
+		node.visible = entry.visible && (node.parent < 0 || doc->nodes[node.parent].visible)? 1 : 0;
+		doc->nodes.push_back(node);
+		doc->node_records.push_back(entry.record);
+
+		doc->names.insert(doc->names.end(), name, name + strlen(name) + 1);
+
+		if (node.parent < 0) {
+			paths.push_back(doc->memory.copy_string(name));
+		} else {
+			path.assign(paths[node.parent]);
+			path += '/';
+			path += name;
+			paths.push_back(doc->memory.copy_string(path.c_str(), path.size()));
+		}
+		if (node.is_group) {
+			doc->groups.push_back(paths.back());
+		} else {
+			pixel_layer layer;
+			layer.record = entry.record;
+			layer.node = doc->nodes.size() - 1;
+			layer.name = paths.back();
+			layer.visible = node.visible != 0;
+			layer.x = entry.x;
+			layer.y = entry.y;
+			layer.width = entry.width;
+			layer.height = entry.height;
+			doc->layers.push_back(layer);
+		}
+
+		order.insert(order.end(), item.children.begin(), item.children.end());
+		parents.insert(parents.end(), item.children.size(), (int) k);
+	}
+	doc->children_count = tree[0].children.size();
+}
+
+// Reopens the source of a document restored from a serialized tree. The
+// records are checked against the tree so a file rewritten with the same
+// size and time is not read with stale indices.
+static psd_reader * open_checked_reader(const struct psd_document * doc, arena & memory)
+{
+	psd_reader * reader = new psd_reader(memory);
+	if (!reader->open(doc->filename) || reader->depth() != doc->depth) {
+		delete reader;
 		return NULL;
+	}
+	for (size_t i = 0; i < doc->layers.size(); i++) {
+		const pixel_layer & layer = doc->layers[i];
+		if (layer.record >= (int) reader->layers().size()
+				|| reader->layers()[layer.record].width() != layer.width
+				|| reader->layers()[layer.record].height() != layer.height) {
+			delete reader;
+			return NULL;
+		}
+	}
+	return reader;
+}
 
-	struct psd_record * ret = (struct psd_record *) api->godot_alloc(sizeof(struct psd_record));
-	
-	ret->is_group = record->is_group()? 1 : 0;
-	
-	if (ret->is_group) {
-		ret->data.group = (struct psd_layer_group *) api->godot_alloc(sizeof(struct psd_layer_group));
-		ret->data.group->group = (LayerGroup *) record;
+static bool attach_pixel_source(struct psd_document * doc)
+{
+	if (doc->lazy) {
+		doc->reader = open_checked_reader(doc, doc->memory);
+		return doc->reader != NULL;
+	}
+
+	psd_context * context = NULL;
+	if (psd_image_load(&context, (psd_char *) doc->filename) != psd_status_done)
+		return false;
+	for (size_t i = 0; i < doc->layers.size(); i++) {
+		const pixel_layer & layer = doc->layers[i];
+		if (layer.record >= context->layer_count
+				|| context->layer_records[layer.record].width != layer.width
+				|| context->layer_records[layer.record].height != layer.height) {
+			psd_image_free(context);
+			return false;
+		}
+	}
+	doc->context = context;
+	return true;
+}
+
+bool open_pixel_source(const struct psd_document * doc)
+{
+	std::call_once(doc->source_once, [doc]() {
+		// the document is only ever created non-const, see psd_parser_parse_with_options
+		struct psd_document * mutable_doc = const_cast<struct psd_document *>(doc);
+		mutable_doc->source_ready = doc->context || doc->reader || attach_pixel_source(mutable_doc);
+	});
+	return doc->source_ready;
+}
+
+const psd_reader * open_depth_source(const struct psd_document * doc)
+{
+	if (doc->lazy)
+		return open_pixel_source(doc)? doc->reader : NULL;
+	std::call_once(doc->depth_once, [doc]() {
+		struct psd_document * mutable_doc = const_cast<struct psd_document *>(doc);
+		mutable_doc->depth_reader = open_checked_reader(doc, mutable_doc->depth_memory);
+	});
+	return doc->depth_reader;
+}
+
+bool layer_pixels::load(const struct psd_document * doc, const pixel_layer & layer, bool bake)
+{
+	m_data = NULL;
+	if (!open_pixel_source(doc))
+		return false;
+
+	if (doc->context) {
+		const uint32_t * data = (const uint32_t *) doc->context->layer_records[layer.record].image_data;
+		if (data == NULL || !bake) {
+			m_data = data;
+			return m_data != NULL;
+		}
+		// libpsd's pixels are shared, baking works on a copy
+		m_buffer.assign(data, data + (size_t) layer.width * layer.height);
 	} else {
-		ret->data.layer = (struct psd_layer *) api->godot_alloc(sizeof(struct psd_layer));
-		ret->data.layer->layer = (Layer *) record;
+		// a layer from a cached tree is only as good as the tree, the record
+		// has to agree on the rectangle before its pixels go into the buffer
+		const arena_vector<psd_layer_ref> & records = doc->reader->layers();
+		if ((size_t) layer.record >= records.size())
+			return false;
+		const psd_layer_ref & record = records[layer.record];
+		if (record.left != layer.x || record.top != layer.y || record.width() != layer.width || record.height() != layer.height)
+			return false;
+		scoped_timer timer(doc->stats.decode_ns);
+		m_buffer.resize((size_t) layer.width * layer.height);
+		if (!doc->reader->decode_layer_argb(layer.record, m_buffer.data()))
+			return false;
+		doc->stats.decoded_layers++;
+		doc->stats.decoded_bytes += m_buffer.size() * sizeof(uint32_t);
 	}
-	return ret;
+	if (bake && !bake_layer(doc, layer, m_buffer.data()))
+		return false;
+	m_data = m_buffer.data();
+	return true;
 }
 
+bool layer_pixels::compose(const struct psd_document * doc, int node, int threads)
+{
+	m_data = NULL;
+	pixel_rect bounds;
+	if (!compose_group(doc, node, threads, bounds, m_buffer))
+		return false;
+	m_data = m_buffer.data();
+	return true;
+}
 
 struct psd_parser * psd_parser_new(const char * filename)
 {
-	PsdParser * parser = new PsdParser(filename);
-	if (parser == NULL) {
+	if (filename == NULL)
 		return NULL;
-	}
-	struct psd_parser * ret = (struct psd_parser *) api->godot_alloc(sizeof(struct psd_parser));
-	if (ret == NULL) {
-		delete parser;
+
+	struct psd_parser * ret = (struct psd_parser *) psd_alloc(sizeof(struct psd_parser));
+	if (ret == NULL)
+		return NULL;
+
+	ret->filename = (char *) psd_alloc(strlen(filename) + 1);
+	if (ret->filename == NULL) {
+		psd_free(ret);
 		return NULL;
 	}
-	
-	ret->parser = parser;
+	strcpy(ret->filename, filename);
 	
 	return ret;
 }
@@ -72,161 +412,505 @@ void psd_parser_free(struct psd_parser * parser)
 	if (parser == NULL)
 		return;
 	
-	delete parser->parser;
-	api->godot_free(parser);
+	psd_free(parser->filename);
+	psd_free(parser);
+}
+
+void psd_parse_options_init(struct psd_parse_options * options)
+{
+	if (options == NULL)
+		return;
+	options->lazy = 0;
+	options->cache = 0;
 }
 
 struct psd_document * psd_parser_parse(struct psd_parser * parser)
 {
-	if (parser == NULL || parser->parser == NULL) // !!
+	return psd_parser_parse_with_options(parser, NULL);
+}
+
+// Maps the file and reads the layer records only. Returns NULL for files the
+// reader does not handle, which are then loaded eagerly by libpsd.
+static struct psd_document * parse_lazy(const char * filename)
+{
+	struct psd_document * ret = new psd_document();
+	ret->reader = new psd_reader(ret->memory);
+	if (!ret->reader->open(filename)) {
+		psd_document_free(ret);
 		return NULL;
+	}
 
-	Document * doc = parser->parser->parse(); // !!!
-	if (doc == NULL)
+	arena scratch;
+	layer_entries entries(scratch);
+	parse_tree tree(scratch);
+	list_reader_entries(ret->reader, entries);
+	if (!build_parse_tree(entries, scratch, tree)) {
+		psd_document_free(ret);
 		return NULL;
+	}
 
-	struct psd_document * ret = (struct psd_document *) api->godot_alloc(sizeof(struct psd_document));
-	if (ret == NULL) {
-		delete doc;
+	ret->filename = ret->memory.copy_string(filename);
+	ret->width = ret->reader->width();
+	ret->height = ret->reader->height();
+	ret->depth = ret->reader->depth();
+	ret->lazy = true;
+	flatten_tree(tree, scratch, ret);
+	return ret;
+}
+
+static struct psd_document * parse_eager(char * filename)
+{
+	psd_context * context = NULL;
+	if (psd_image_load(&context, filename) != psd_status_done)
+		return NULL;
+
+	arena scratch;
+	layer_entries entries(scratch);
+	parse_tree tree(scratch);
+	list_context_entries(context, entries);
+	if (!build_parse_tree(entries, scratch, tree)) {
+		psd_image_free(context);
 		return NULL;
 	}
 
-	ret->doc = doc;
+	struct psd_document * ret = new psd_document();
+	ret->filename = ret->memory.copy_string(filename);
+	ret->width = context->width;
+	ret->height = context->height;
+	ret->depth = context->depth;
+	ret->context = context;
+	flatten_tree(tree, scratch, ret);
 	return ret;
 }
 
-int psd_document_width(const struct psd_document * doc)
+struct psd_document * psd_parser_parse_with_options(struct psd_parser * parser, const struct psd_parse_options * options)
 {
-	if (doc == NULL || doc->doc == NULL)
-		return -1;
-	return doc->doc->width();
+	if (parser == NULL || parser->filename == NULL)
+		return NULL;
+
+	bool lazy = options && options->lazy;
+	document_key key;
+	bool cached = options && options->cache && document_key_init(key, parser->filename, lazy);
+	if (cached) {
+		struct psd_document * ret = document_cache_acquire(key);
+		if (ret)
+			return ret;
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	struct psd_document * ret = lazy? parse_lazy(parser->filename) : NULL;
+	if (ret == NULL)
+		ret = parse_eager(parser->filename);
+	if (ret == NULL)
+		return NULL;
+	ret->stats.parse_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+	if (cached)
+		document_cache_store(key, ret);
+	return ret;
 }
 
-int psd_document_height(const struct psd_document * doc)
+int psd_composite_load(const char * filename, struct psd_composite * composite)
 {
-	if (doc == NULL || doc->doc == NULL)
+	if (filename == NULL || composite == NULL)
 		return -1;
-	return doc->doc->height();
+	composite->x = 0;
+	composite->y = 0;
+	composite->width = 0;
+	composite->height = 0;
+	composite->rgba = NULL;
+
+	arena memory;
+	psd_reader reader(memory);
+	std::vector<uint32_t> buffer;
+	const uint32_t * argb = NULL;
+	psd_context * context = NULL;
+	int width = 0;
+	int height = 0;
+	if (reader.open(filename, false)) {
+		width = reader.width();
+		height = reader.height();
+		buffer.resize((size_t) width * height);
+		if (reader.decode_composite_argb(buffer.data()))
+			argb = buffer.data();
+	}
+	if (argb == NULL) {
+		if (psd_image_load_merged(&context, (psd_char *) filename) != psd_status_done)
+			return -1;
+		width = context->width;
+		height = context->height;
+		argb = (const uint32_t *) context->merged_image_data;
+		if (argb == NULL) {
+			psd_image_free(context);
+			return -1;
+		}
+	}
+
+	composite->rgba = (unsigned char *) psd_alloc((size_t) width * height * 4);
+	if (composite->rgba != NULL) {
+		argb_to_rgba(argb, width, width, height, composite->rgba, (size_t) width * 4);
+		composite->width = width;
+		composite->height = height;
+	}
+	if (context)
+		psd_image_free(context);
+	return composite->rgba != NULL? 0 : -1;
 }
 
-void psd_document_save_layers(const struct psd_document * doc, const char * dir)
+void psd_composite_free(struct psd_composite * composite)
 {
-	if (doc == NULL || doc->doc == NULL)
+	if (composite == NULL)
 		return;
-	return doc->doc->save_layers(dir);
+	psd_free(composite->rgba);
+	composite->x = 0;
+	composite->y = 0;
+	composite->width = 0;
+	composite->height = 0;
+	composite->rgba = NULL;
 }
 
-int psd_document_children_count(const struct psd_document * doc)
+int psd_document_width(const struct psd_document * doc)
 {
-	if (doc == NULL || doc->doc == NULL)
+	if (doc == NULL)
 		return -1;
-	return doc->doc->children_count();
+	return doc->width;
 }
 
-void psd_document_free(struct psd_document * doc)
+int psd_document_height(const struct psd_document * doc)
 {
 	if (doc == NULL)
-		return;
-	
-	delete doc->doc;
-	api->godot_free(doc);
+		return -1;
+	return doc->height;
 }
 
-struct psd_record * psd_document_first_child(struct psd_document * doc)
+int psd_document_pixel_layer_count(const struct psd_document * doc)
 {
-	if (doc == NULL || doc->doc == NULL)
-		return NULL;
-	return cxx_record_to_c(doc->doc->first_child());
+	if (doc == NULL)
+		return -1;
+	return (int) doc->layers.size();
 }
 
-struct psd_record * psd_document_next_child(struct psd_document * doc)
+int psd_document_pixel_layer_info(const struct psd_document * doc, int index, struct psd_pixel_layer_info * info)
 {
-	if (doc == NULL || doc->doc == NULL)
-		return NULL;
-	return cxx_record_to_c(doc->doc->next_child());
+	if (doc == NULL || info == NULL)
+		return -1;
+	if (index < 0 || index >= (int) doc->layers.size())
+		return -1;
+
+	const pixel_layer & layer = doc->layers[index];
+	info->name = layer.name;
+	info->x = layer.x;
+	info->y = layer.y;
+	info->width = layer.width;
+	info->height = layer.height;
+	info->visible = layer.visible? 1 : 0;
+	return 0;
 }
 
-int psd_document_has_next_child(const struct psd_document * doc)
+int psd_document_pixel_layer_read_rgba(const struct psd_document * doc, int index, unsigned char * rgba)
 {
-	if (doc == NULL || doc->doc == NULL)
+	if (doc == NULL || rgba == NULL)
 		return -1;
-	return doc->doc->has_next_child()? 1 : 0;
+	if (index < 0 || index >= (int) doc->layers.size())
+		return -1;
+
+	const pixel_layer & layer = doc->layers[index];
+	layer_pixels pixels;
+	if (!pixels.load(doc, layer))
+		return -1;
+	argb_to_rgba(pixels.data(), layer.width, layer.width, layer.height, rgba, (size_t) layer.width * 4);
+	return 0;
 }
 
+int psd_document_pixel_layer_bake_rgba(const struct psd_document * doc, int index, unsigned char * rgba)
+{
+	if (doc == NULL || rgba == NULL)
+		return -1;
+	if (index < 0 || index >= (int) doc->layers.size())
+		return -1;
+
+	const pixel_layer & layer = doc->layers[index];
+	layer_pixels pixels;
+	if (!pixels.load(doc, layer, true))
+		return -1;
+	argb_to_rgba(pixels.data(), layer.width, layer.width, layer.height, rgba, (size_t) layer.width * 4);
+	return 0;
+}
 
-void psd_record_free(struct psd_record * record)
+static int native_sample_type(int depth)
 {
-	if (record == NULL)
-		return;
-	if (record->is_group)
-		api->godot_free(record->data.group);
-	else
-		api->godot_free(record->data.layer);
-	api->godot_free(record);
+	return depth == 32? psd_sample_float : depth == 16? psd_sample_uint16 : psd_sample_uint8;
 }
 
-const char * psd_record_name(const struct psd_record * record)
+static size_t sample_type_size(int sample_type)
 {
-	if (record == NULL)
-		return NULL;
-	if (record->is_group)
-		return record->data.group->group->name();
-	else
-		return record->data.layer->layer->name();
+	return sample_type == psd_sample_float? 4 : sample_type == psd_sample_uint16? 2 : 1;
 }
 
-struct psd_record * psd_layer_group_first_child(struct psd_layer_group * group)
+static bool readable_format(const struct psd_document * doc, const struct psd_pixel_format * format)
 {
-	if (group == NULL || group->group == NULL)
-		return NULL;
-	return cxx_record_to_c(group->group->first_child());
+	return format->sample_type == psd_sample_uint8 || format->sample_type == native_sample_type(doc->depth);
 }
 
-struct psd_record * psd_layer_group_next_child(struct psd_layer_group * group)
+template <typename T>
+static void interleave_planes(const T * planes, size_t count, T * pixels)
 {
-	if (group == NULL || group->group == NULL)
-		return NULL;
-	return cxx_record_to_c(group->group->next_child());
+	for (size_t i = 0; i < count; i++) {
+		for (int p = 0; p < 4; p++)
+			pixels[i * 4 + p] = planes[p * count + i];
+	}
 }
 
-int psd_layer_group_has_next_child(const struct psd_layer_group * group)
+int psd_document_depth(const struct psd_document * doc)
 {
-	if (group == NULL || group->group == NULL)
+	if (doc == NULL)
 		return -1;
-	return group->group->has_next_child()? 1 : 0;
+	return doc->depth;
 }
 
-int psd_layer_group_children_count(const struct psd_layer_group * group)
+int psd_document_native_pixel_format(const struct psd_document * doc, struct psd_pixel_format * format)
 {
-	if (group == NULL || group->group == NULL)
+	if (doc == NULL || format == NULL)
 		return -1;
-	return group->group->children_count();
+	format->sample_type = native_sample_type(doc->depth);
+	format->planar = 1;
+	return 0;
 }
 
-int psd_layer_x(const struct psd_layer * layer)
+long long psd_document_pixel_layer_size(const struct psd_document * doc, int index, const struct psd_pixel_format * format)
 {
-	if (layer == NULL || layer->layer == NULL)
+	if (doc == NULL || format == NULL)
+		return -1;
+	if (index < 0 || index >= (int) doc->layers.size() || !readable_format(doc, format))
 		return -1;
-	return layer->layer->x();
+
+	const pixel_layer & layer = doc->layers[index];
+	return (long long) layer.width * layer.height * 4 * sample_type_size(format->sample_type);
 }
 
-int psd_layer_y(const struct psd_layer * layer)
+int psd_document_pixel_layer_read(const struct psd_document * doc, int index, const struct psd_pixel_format * format, void * pixels)
 {
-	if (layer == NULL || layer->layer == NULL)
+	if (doc == NULL || format == NULL || pixels == NULL)
 		return -1;
-	return layer->layer->y();
+	if (index < 0 || index >= (int) doc->layers.size() || !readable_format(doc, format))
+		return -1;
+
+	const pixel_layer & layer = doc->layers[index];
+	size_t n_pixels = (size_t) layer.width * layer.height;
+	if (format->sample_type == psd_sample_uint8) {
+		layer_pixels argb;
+		if (!argb.load(doc, layer))
+			return -1;
+		unsigned char * out = (unsigned char *) pixels;
+		if (!format->planar) {
+			argb_to_rgba(argb.data(), layer.width, layer.width, layer.height, out, (size_t) layer.width * 4);
+			return 0;
+		}
+		for (size_t i = 0; i < n_pixels; i++) {
+			uint32_t color = argb.data()[i];
+			out[i] = (color >> 16) & 0xff;
+			out[n_pixels + i] = (color >> 8) & 0xff;
+			out[n_pixels * 2 + i] = color & 0xff;
+			out[n_pixels * 3 + i] = (color >> 24) & 0xff;
+		}
+		return 0;
+	}
+
+	// deeper samples come straight from the reader, decoded into the
+	// caller's buffer when it asked for planes
+	const psd_reader * reader = open_depth_source(doc);
+	if (reader == NULL)
+		return -1;
+	size_t size = sample_type_size(format->sample_type);
+	std::vector<uint8_t> buffer(format->planar? 0 : n_pixels * 4 * size);
+	uint8_t * base = format->planar? (uint8_t *) pixels : buffer.data();
+	void * planes[4];
+	for (int p = 0; p < 4; p++)
+		planes[p] = base + p * n_pixels * size;
+	{
+		scoped_timer timer(doc->stats.decode_ns);
+		if (!reader->decode_layer_planes(layer.record, planes))
+			return -1;
+	}
+	doc->stats.decoded_layers++;
+	doc->stats.decoded_bytes += n_pixels * 4 * size;
+
+	if (!format->planar) {
+		if (size == 2)
+			interleave_planes((const uint16_t *) base, n_pixels, (uint16_t *) pixels);
+		else
+			interleave_planes((const float *) base, n_pixels, (float *) pixels);
+	}
+	return 0;
+}
+
+int psd_document_children_count(const struct psd_document * doc)
+{
+	if (doc == NULL)
+		return -1;
+	return doc->children_count;
+}
+
+int psd_document_get_stats(const struct psd_document * doc, struct psd_stats * stats)
+{
+	if (doc == NULL || stats == NULL)
+		return -1;
+
+	stats->parse_ms = doc->stats.parse_ns / 1e6;
+	stats->decode_ms = doc->stats.decode_ns / 1e6;
+	stats->encode_ms = doc->stats.encode_ns / 1e6;
+	stats->write_ms = doc->stats.write_ns / 1e6;
+	stats->decoded_layers = doc->stats.decoded_layers;
+	stats->decoded_bytes = doc->stats.decoded_bytes;
+	stats->encoded_bytes = doc->stats.encoded_bytes;
+	stats->written_files = doc->stats.written_files;
+	stats->allocations = n_allocations;
+	stats->allocated_bytes = n_allocated_bytes;
+	stats->arena_allocations = doc->memory.allocation_count();
+	stats->arena_blocks = doc->memory.block_count();
+	stats->arena_reserved_bytes = doc->memory.reserved_bytes();
+	stats->arena_used_bytes = doc->memory.used_bytes();
+	return 0;
 }
 
-int psd_layer_width(const struct psd_layer * layer)
+void psd_document_free(struct psd_document * doc)
 {
-	if (layer == NULL || layer->layer == NULL)
+	if (doc == NULL || --doc->refs > 0)
+		return;
+	
+	if (doc->context)
+		psd_image_free(doc->context);
+	delete doc->reader;
+	delete doc->depth_reader;
+	delete doc;
+}
+
+int psd_document_node_count(const struct psd_document * doc)
+{
+	if (doc == NULL)
 		return -1;
-	return layer->layer->width();
+	return (int) doc->nodes.size();
 }
 
-int psd_layer_height(const struct psd_layer * layer)
+const struct psd_node * psd_document_nodes(const struct psd_document * doc)
 {
-	if (layer == NULL || layer->layer == NULL)
+	if (doc == NULL || doc->nodes.empty())
+		return NULL;
+	return &doc->nodes[0];
+}
+
+const char * psd_document_node_name(const struct psd_document * doc, const struct psd_node * node)
+{
+	if (doc == NULL || node == NULL)
+		return NULL;
+	if (node->name_offset < 0 || node->name_offset >= (int) doc->names.size())
+		return NULL;
+	return &doc->names[node->name_offset];
+}
+
+int psd_document_node_index(const struct psd_document * doc, const struct psd_node * node)
+{
+	if (doc == NULL || node == NULL || doc->nodes.empty())
 		return -1;
-	return layer->layer->height();
+	if (node < &doc->nodes[0] || node >= &doc->nodes[0] + doc->nodes.size())
+		return -1;
+	return (int) (node - &doc->nodes[0]);
+}
+
+void psd_node_iter_children(struct psd_node_iter * iter, const struct psd_document * doc, int parent)
+{
+	if (iter == NULL)
+		return;
+
+	iter->doc = doc;
+	iter->next = -1;
+	iter->end = -1;
+	iter->root = parent;
+	iter->depth_first = 0;
+
+	if (doc == NULL || parent >= (int) doc->nodes.size())
+		return;
+
+	int first = parent < 0? 0 : doc->nodes[parent].first_child;
+	int count = parent < 0? doc->children_count : doc->nodes[parent].children_count;
+	if (count > 0) {
+		iter->next = first;
+		iter->end = first + count;
+	}
+}
+
+void psd_node_iter_depth_first(struct psd_node_iter * iter, const struct psd_document * doc, int root)
+{
+	psd_node_iter_children(iter, doc, root);
+	if (iter)
+		iter->depth_first = 1;
+}
+
+// node following index in a pre-order walk of the subtree below root
+static int next_depth_first(const struct psd_document * doc, int index, int root)
+{
+	const psd_node & node = doc->nodes[index];
+	if (node.children_count > 0)
+		return node.first_child;
+
+	for (int k = index; k != root; k = doc->nodes[k].parent) {
+		int parent = doc->nodes[k].parent;
+		int last = parent < 0? doc->children_count - 1 : doc->nodes[parent].first_child + doc->nodes[parent].children_count - 1;
+		if (k < last)
+			return k + 1;
+		if (parent < 0)
+			break;
+	}
+	return -1;
+}
+
+const struct psd_node * psd_node_iter_next(struct psd_node_iter * iter)
+{
+	if (iter == NULL || iter->doc == NULL || iter->next < 0)
+		return NULL;
+
+	int index = iter->next;
+	if (iter->depth_first)
+		iter->next = next_depth_first(iter->doc, index, iter->root);
+	else
+		iter->next = index + 1 < iter->end? index + 1 : -1;
+	return &iter->doc->nodes[index];
+}
+
+void psd_animation_info_parse(const char * group_name, struct psd_animation_info * info)
+{
+	if (info == NULL)
+		return;
+	info->name_length = group_name? (int) strlen(group_name) : 0;
+	info->fps = 0;
+	info->no_loop = 0;
+	if (info->name_length == 0)
+		return;
+
+	int end = info->name_length;
+	if (group_name[end - 1] == '!') {
+		info->no_loop = 1;
+		end--;
+	}
+
+	const char * at = NULL;
+	for (int i = end - 1; i >= 0 && at == NULL; i--) {
+		if (group_name[i] == '@')
+			at = group_name + i;
+	}
+	if (at != NULL && at + 1 < group_name + end) {
+		char * parsed_end = NULL;
+		double fps = strtod(at + 1, &parsed_end);
+		if (parsed_end == group_name + end && fps > 0 && at[1] >= '0' && at[1] <= '9') {
+			info->fps = fps;
+			end = (int) (at - group_name);
+		}
+	}
+	// a lone "!" or "@12" is a name, not settings
+	if (end == 0) {
+		info->fps = 0;
+		info->no_loop = 0;
+		end = info->name_length;
+	}
+	info->name_length = end;
 }
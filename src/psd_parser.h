@@ -1,48 +1,365 @@
 #ifndef PSD_PARSER_H
 #define PSD_PARSER_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 struct psd_parser;
 struct psd_document;
-struct psd_layer;
-struct psd_layer_group;
-struct psd_record {
+struct psd_export_task;
+struct psd_metadata;
+
+// The layer tree of a document is a flat array of nodes built once at parse
+// time. The children of a node are contiguous and the top-level nodes come
+// first, so the whole tree can be walked by index.
+//
+// A parsed document is never modified afterwards: every function taking a
+// const struct psd_document may be called from several threads at once, and
+// walks keep their position in a caller-owned psd_node_iter. Documents parsed
+// through the cache may be shared by several callers; each of them still
+// calls psd_document_free once.
+struct psd_node {
+	int is_group;
+	int parent; // -1 for top-level nodes
+	int first_child; // index of the first child in the node array
+	int children_count;
+	int name_offset; // into the document string table, see psd_document_node_name
+	int x;
+	int y;
+	int width;
+	int height;
+	int visible; // 0 when the node or any group around it is hidden
+};
+
+struct psd_node_iter {
+	const struct psd_document * doc;
+	int next; // index of the node returned by the next call, -1 when done
+	int end; // one past the last sibling, for children walks
+	int root; // subtree root, for depth-first walks; -1 for the whole document
+	int depth_first;
+};
+
+// Selects layers by their path from the document root, such as
+// "walk/frame_01". In patterns '*' and '?' stay within one path component
+// and '**' spans any number of them; a pattern matching a group selects
+// everything inside it. Layers are kept when they match an include pattern,
+// or when there are none, and no exclude pattern.
+struct psd_layer_filter {
+	const char * const * include;
+	int include_count;
+	const char * const * exclude;
+	int exclude_count;
+	int visible_only; // also drop hidden layers and the contents of hidden groups
+};
+
+struct psd_parse_options {
+	int lazy; // map the file and decode the pixels of a layer only when they are read
+	int cache; // reuse the document of an unchanged file, see psd_cache_configure
+};
+
+// The document cache keeps parsed documents keyed by path, modification time
+// and size, and drops the least recently used ones past max_bytes. With a
+// directory it also writes the layer tree of each document there, so the
+// structure of an unchanged file is recovered without parsing it again; its
+// pixels are then only read once something asks for them.
+struct psd_cache_options {
+	long long max_bytes; // documents kept in memory, estimated; 0 keeps none
+	const char * directory; // existing directory for serialized trees, NULL for none
+};
+
+struct psd_cache_stats {
+	long long documents; // held in memory
+	long long bytes;
+	long long hits; // served from memory
+	long long tree_hits; // restored from a serialized tree
+	long long misses;
+	long long evictions;
+};
+
+enum psd_png_profile {
+	psd_png_default = 0, // lodepng's defaults
+	psd_png_fast, // single filter, short deflate window
+	psd_png_store, // no compression at all
+	psd_png_small, // smallest files, for final assets
+};
+
+// What layer and atlas files are written as. The VRAM formats are Godot
+// StreamTextures (.stex), compressed the way the texture importer would, so
+// they load without going through a PNG import.
+enum psd_texture_format {
+	psd_texture_png = 0,
+	psd_texture_dxt5, // S3TC/BC3, for desktop
+	psd_texture_etc2, // ETC2 RGBA8, for mobile
+};
+
+struct psd_export_options {
+	int threads; // number of encoding workers; 0 means one per hardware thread
+	// skip layers whose pixels and bounds match the manifest of the previous
+	// export, .<document name>.manifest in dir
+	int incremental;
+	int trim; // crop the fully transparent borders of each layer
+	int dedup; // write byte-identical layers only once
+	int memory_budget_mb; // cap on the layers decoded and encoded at once, 0 for none; only bounds lazily parsed documents
+	int png_profile; // psd_png_profile
+	int texture_format; // psd_texture_format
+	const struct psd_layer_filter * filter; // layers left out are never decoded; NULL exports them all
+	int bake; // apply each layer's opacity, mask and clipping, see psd_document_pixel_layer_bake_rgba
+	// Write each group directly inside a top-level group as one frame named
+	// by its path, composited as psd_document_composite_group does, instead
+	// of the layers inside it
+	int group_frames;
+	int metadata; // also write the node tree to dir, named as the document with a .psdmeta extension, see psd_metadata_open
+};
+
+struct psd_export_frame {
+	char * name; // layer path relative to the export dir, without extension
+	char * file; // layer path of the file holding its pixels, differs from name for duplicates
+	int offset_x; // where the written pixels start in the layer
+	int offset_y;
+	int width; // size of the written pixels
+	int height;
+	int layer_width;
+	int layer_height;
+};
+
+struct psd_export_report {
+	char ** changed; // layer paths relative to the export dir, without extension
+	int changed_count;
+	struct psd_export_frame * frames;
+	int frame_count;
+	int texture_format; // of the files, see psd_texture_format_extension
+	int metadata_failed; // the .psdmeta file was asked for but not written; the layers still were
+};
+
+struct psd_atlas_options {
+	int max_size; // largest page side, in pixels
+	int padding; // transparent pixels between frames and around the page borders
+	int threads;
+	int png_profile; // psd_png_profile
+	int texture_format; // psd_texture_format
+	const struct psd_layer_filter * filter; // NULL packs every frame
+	int bake; // as in psd_export_options
+	int group_frames; // as in psd_export_options
+};
+
+struct psd_atlas_frame {
+	char * name; // layer path, without extension
+	int page;
+	int x; // region of the trimmed frame in its page
+	int y;
+	int width;
+	int height;
+	int offset_x; // where the region starts in the untrimmed layer
+	int offset_y;
+	int layer_width;
+	int layer_height;
+};
+
+struct psd_atlas_report {
+	char ** pages; // paths of the written page PNGs
+	int page_count;
+	struct psd_atlas_frame * frames;
+	int frame_count;
+};
+
+// Counters of a document since it was parsed. A cached document is shared by
+// every load that hits it, so they add up over all of them, and parse_ms is
+// that of the parse that made it.
+struct psd_stats {
+	double parse_ms;
+	double decode_ms; // on-demand decoding of lazy documents, summed over threads
+	double encode_ms; // PNG encoding, summed over threads
+	double write_ms; // file writes, summed over threads
+	long long decoded_layers;
+	long long decoded_bytes;
+	long long encoded_bytes;
+	long long written_files;
+	long long allocations; // through the psd_allocator, by the whole library, see psd_allocation_counts
+	long long allocated_bytes;
+	long long arena_allocations; // parse state of this document, see arena.h
+	long long arena_blocks;
+	long long arena_reserved_bytes;
+	long long arena_used_bytes;
+};
+
+struct psd_pixel_layer_info {
+	const char * name; // path from the document root, owned by the document
+	int x;
+	int y;
+	int width;
+	int height;
+	int visible; // as in psd_node
+};
+
+enum psd_sample_type {
+	psd_sample_uint8 = 0,
+	psd_sample_uint16,
+	psd_sample_float, // linear light, as 32-bit documents store it
+};
+
+// Layout of the samples psd_document_pixel_layer_read writes: red, green,
+// blue and alpha interleaved per pixel, or four planes of width * height
+// samples back to back. Samples are in host byte order.
+struct psd_pixel_format {
+	int sample_type; // psd_sample_type
+	int planar;
+};
+
+// The flattened image Photoshop stores after the layers, or a group flattened
+// by psd_document_composite_group, as RGBA bytes
+struct psd_composite {
+	int width;
+	int height;
+	unsigned char * rgba;
+	int x; // of the top-left pixel in the document, 0 for the whole canvas
+	int y;
+};
+
+// A node of a layer metadata file. The strings point into the file and live
+// as long as it is open.
+struct psd_metadata_node {
+	const char * name;
+	const char * path; // from the document root, as in the export
 	int is_group;
-	union {
-		struct psd_layer * layer;
-		struct psd_layer_group * group;
-	} data;
+	int parent; // -1 for top-level nodes
+	int first_child;
+	int children_count;
+	int x;
+	int y;
+	int width;
+	int height;
+	int visible; // as in psd_node
+};
+
+// Playback settings an animation group may give after its name: "walk@12"
+// plays at 12 frames per second, "walk!" does not loop, "walk@12!" does both
+struct psd_animation_info {
+	int name_length; // of the animation name, without the settings
+	double fps; // 0 when the name gives none
+	int no_loop;
+};
+
+// Parsers and the arrays and strings of reports are allocated with this,
+// malloc and free unless set. Set it before parsing anything.
+struct psd_allocator {
+	void * (* alloc)(size_t size);
+	void (* free)(void * ptr);
 };
 
+// NULL restores malloc and free
+void psd_parser_set_allocator(const struct psd_allocator * allocator);
+// running totals of the allocations made through the allocator
+void psd_allocation_counts(long long * allocations, long long * bytes);
+
 struct psd_parser * psd_parser_new(const char * filename);
 void psd_parser_free(struct psd_parser * parser);
 struct psd_document * psd_parser_parse(struct psd_parser * parser);
+void psd_parse_options_init(struct psd_parse_options * options);
+struct psd_document * psd_parser_parse_with_options(struct psd_parser * parser, const struct psd_parse_options * options);
+
+// the cache starts disabled; configure it before parsing with options->cache
+void psd_cache_options_init(struct psd_cache_options * options);
+int psd_cache_configure(const struct psd_cache_options * options);
+// drops every document held in memory; serialized trees are kept
+void psd_cache_clear(void);
+int psd_cache_get_stats(struct psd_cache_stats * stats);
+
+// Reads the composite alone, skipping the layers entirely. Files the lazy
+// reader does not handle go through libpsd's merged image loader instead.
+int psd_composite_load(const char * filename, struct psd_composite * composite);
+void psd_composite_free(struct psd_composite * composite);
+
+// Layer metadata files hold the node tree of a document, the names and
+// rectangles of its layers and groups, for tools that need them without
+// parsing the PSD. They are mapped rather than read, and paths are looked up
+// through a hash index stored with them, so opening one costs little more
+// than validating it. Files of another version fail to open.
+int psd_document_write_metadata(const struct psd_document * doc, const char * filename);
+struct psd_metadata * psd_metadata_open(const char * filename);
+void psd_metadata_close(struct psd_metadata * metadata);
+int psd_metadata_width(const struct psd_metadata * metadata);
+int psd_metadata_height(const struct psd_metadata * metadata);
+int psd_metadata_depth(const struct psd_metadata * metadata);
+// nodes are ordered as psd_document_nodes orders them
+int psd_metadata_node_count(const struct psd_metadata * metadata);
+int psd_metadata_children_count(const struct psd_metadata * metadata);
+int psd_metadata_get_node(const struct psd_metadata * metadata, int index, struct psd_metadata_node * node);
+// index of the node at path, the first one when several share it; -1 when none does
+int psd_metadata_find(const struct psd_metadata * metadata, const char * path);
 
 int psd_document_width(const struct psd_document * doc);
 int psd_document_height(const struct psd_document * doc);
 void psd_document_save_layers(const struct psd_document * doc, const char * dir);
+// ".png" or ".stex"
+const char * psd_texture_format_extension(int format);
+void psd_export_options_init(struct psd_export_options * options);
+int psd_document_export_layers(const struct psd_document * doc, const char * dir, const struct psd_export_options * options, struct psd_export_report * report);
+void psd_export_report_free(struct psd_export_report * report);
+
+// psd_document_export_layers on a thread of its own. The task keeps the
+// document alive until it is freed. Progress is polled: layers count as done
+// once their file is written or found unchanged, and the paths of the files
+// written so far are listed in the order they were finished.
+struct psd_export_task * psd_document_export_layers_async(const struct psd_document * doc, const char * dir, const struct psd_export_options * options);
+// returns 1 once the export is over, 0 while it runs
+int psd_export_task_progress(const struct psd_export_task * task, int * done, int * total);
+int psd_export_task_written_count(const struct psd_export_task * task);
+// relative to the export dir, without extension; owned by the task
+const char * psd_export_task_written(const struct psd_export_task * task, int index);
+// stops before the next layer; the files already written are kept and stay in the manifest
+void psd_export_task_cancel(struct psd_export_task * task);
+// waits for the export and returns what psd_document_export_layers would have, -1 when cancelled
+int psd_export_task_wait(struct psd_export_task * task, struct psd_export_report * report);
+// cancels the export if it was not waited for
+void psd_export_task_free(struct psd_export_task * task);
+void psd_atlas_options_init(struct psd_atlas_options * options);
+int psd_document_pack_atlas(const struct psd_document * doc, const char * dir, const struct psd_atlas_options * options, struct psd_atlas_report * report);
+void psd_atlas_report_free(struct psd_atlas_report * report);
+int psd_document_pixel_layer_count(const struct psd_document * doc);
+int psd_document_pixel_layer_info(const struct psd_document * doc, int index, struct psd_pixel_layer_info * info);
+int psd_document_pixel_layer_read_rgba(const struct psd_document * doc, int index, unsigned char * rgba);
+// psd_document_pixel_layer_read_rgba with the layer's opacity, fill opacity and
+// mask applied, and cut to the layer below when it is clipped to it
+int psd_document_pixel_layer_bake_rgba(const struct psd_document * doc, int index, unsigned char * rgba);
+// Flattens the visible layers of the group at path, or of the whole document
+// for NULL, with their blend modes, opacities, masks and clipping. The
+// composite covers what they draw on; free it with psd_composite_free.
+int psd_document_composite_group(const struct psd_document * doc, const char * group, int threads, struct psd_composite * composite);
+// bits per channel of the file: 8, 16 or 32
+int psd_document_depth(const struct psd_document * doc);
+// planes of the sample type the file stores, which layers are decoded into without any conversion
+int psd_document_native_pixel_format(const struct psd_document * doc, struct psd_pixel_format * format);
+// bytes psd_document_pixel_layer_read writes, -1 for a format it cannot produce
+long long psd_document_pixel_layer_size(const struct psd_document * doc, int index, const struct psd_pixel_format * format);
+// Reads a layer in the sample type of the file, or as bytes dithered down
+// from it; other sample types are not converted to and fail
+int psd_document_pixel_layer_read(const struct psd_document * doc, int index, const struct psd_pixel_format * format, void * pixels);
 int psd_document_children_count(const struct psd_document * doc);
+int psd_document_get_stats(const struct psd_document * doc, struct psd_stats * stats);
 void psd_document_free(struct psd_document * doc);
 
-struct psd_record * psd_document_first_child(struct psd_document * doc);
-struct psd_record * psd_document_next_child(struct psd_document * doc);
-int psd_document_has_next_child(const struct psd_document * doc);
+void psd_layer_filter_init(struct psd_layer_filter * filter);
+// whether the layer or group at path passes; visible as in psd_node
+int psd_layer_filter_accepts(const struct psd_layer_filter * filter, const char * path, int visible);
+// whether nothing inside the group at path can pass, so that walks may skip it
+int psd_layer_filter_rejects_group(const struct psd_layer_filter * filter, const char * path, int visible);
 
-void psd_record_free(struct psd_record * record);
-const char * psd_record_name(const struct psd_record * record);
+int psd_document_node_count(const struct psd_document * doc);
+const struct psd_node * psd_document_nodes(const struct psd_document * doc);
+const char * psd_document_node_name(const struct psd_document * doc, const struct psd_node * node);
+int psd_document_node_index(const struct psd_document * doc, const struct psd_node * node);
 
-struct psd_record * psd_layer_group_first_child(struct psd_layer_group * group);
-struct psd_record * psd_layer_group_next_child(struct psd_layer_group * group);
-int psd_layer_group_has_next_child(const struct psd_layer_group * group);
-int psd_layer_group_children_count(const struct psd_layer_group * group);
+// parent is a node index, or -1 for the top-level nodes
+void psd_node_iter_children(struct psd_node_iter * iter, const struct psd_document * doc, int parent);
+// pre-order walk of the subtree below root (excluded), or of the whole document when root is -1
+void psd_node_iter_depth_first(struct psd_node_iter * iter, const struct psd_document * doc, int root);
+const struct psd_node * psd_node_iter_next(struct psd_node_iter * iter);
 
-int psd_layer_x(const struct psd_layer * layer);
-int psd_layer_y(const struct psd_layer * layer);
-int psd_layer_width(const struct psd_layer * layer);
-int psd_layer_height(const struct psd_layer * layer);
+// names without valid settings are taken whole, with fps 0 and looping
+void psd_animation_info_parse(const char * group_name, struct psd_animation_info * info);
 
 #ifdef __cplusplus
 }
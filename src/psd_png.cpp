@@ -0,0 +1,64 @@
+#include "psd_png.h"
+#include "psd_parser.h"
+
+#include "lodepng/lodepng.h"
+
+// lodepng's defaults try every filter on each row and look for a smaller
+// color type first. Layers are re-imported as textures by Godot, so most of
+// the time speed matters more than size.
+static void set_profile(lodepng::State & state, int profile)
+{
+	state.info_raw.colortype = LCT_RGBA;
+	state.info_raw.bitdepth = 8;
+	state.info_png.color.colortype = LCT_RGBA;
+	state.info_png.color.bitdepth = 8;
+
+	LodePNGEncoderSettings & encoder = state.encoder;
+	LodePNGCompressSettings & zlib = encoder.zlibsettings;
+	switch (profile) {
+	case psd_png_fast:
+		encoder.auto_convert = 0;
+		encoder.filter_strategy = LFS_ZERO;
+		zlib.btype = 2;
+		zlib.use_lz77 = 1;
+		zlib.windowsize = 512;
+		zlib.minmatch = 3;
+		zlib.nicematch = 32;
+		zlib.lazymatching = 0;
+		break;
+	case psd_png_store:
+		encoder.auto_convert = 0;
+		encoder.filter_strategy = LFS_ZERO;
+		zlib.btype = 0;
+		zlib.use_lz77 = 0;
+		break;
+	case psd_png_small:
+		encoder.auto_convert = 1;
+		encoder.filter_strategy = LFS_ENTROPY;
+		zlib.btype = 2;
+		zlib.use_lz77 = 1;
+		zlib.windowsize = 32768;
+		zlib.minmatch = 3;
+		zlib.nicematch = 258;
+		zlib.lazymatching = 1;
+		break;
+	default:
+		break;
+	}
+}
+
+bool psd_png_encode(const unsigned char * rgba, int width, int height, int profile, std::vector<unsigned char> & png)
+{
+	png.clear();
+	if (profile == psd_png_default)
+		return lodepng::encode(png, rgba, width, height) == 0;
+
+	lodepng::State state;
+	set_profile(state, profile);
+	return lodepng::encode(png, rgba, width, height, state) == 0;
+}
+
+bool psd_png_save(const std::string & path, const std::vector<unsigned char> & png)
+{
+	return lodepng::save_file(png, path) == 0;
+}
@@ -0,0 +1,12 @@
+#ifndef PSD_PNG_H
+#define PSD_PNG_H
+
+#include <string>
+#include <vector>
+
+// Encodes width x height RGBA8 pixels with one of the psd_png_profile
+// settings from psd_parser.h
+bool psd_png_encode(const unsigned char * rgba, int width, int height, int profile, std::vector<unsigned char> & png);
+bool psd_png_save(const std::string & path, const std::vector<unsigned char> & png);
+
+#endif // PSD_PNG_H
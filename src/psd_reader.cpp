@@ -0,0 +1,635 @@
+#include "psd_reader.h"
+#include "pixel_ops.h"
+
+#include "lodepng/lodepng.h"
+
+#include <string.h>
+
+namespace {
+
+// Bounds-checked big-endian reader over a byte range
+class cursor {
+public:
+	cursor(const uint8_t * data, uint64_t size, uint64_t pos = 0)
+		: m_data(data), m_size(size), m_pos(pos), m_ok(pos <= size)
+	{
+	}
+
+	bool ok() const { return m_ok; }
+	uint64_t pos() const { return m_pos; }
+	const uint8_t * here() const { return m_data + m_pos; }
+
+	bool has(uint64_t n) const { return m_ok && n <= m_size - m_pos; }
+
+	void seek(uint64_t pos)
+	{
+		if (pos > m_size)
+			m_ok = false;
+		else
+			m_pos = pos;
+	}
+
+	void skip(uint64_t n)
+	{
+		if (!has(n))
+			m_ok = false;
+		else
+			m_pos += n;
+	}
+
+	uint8_t u8()
+	{
+		if (!has(1)) {
+			m_ok = false;
+			return 0;
+		}
+		return m_data[m_pos++];
+	}
+
+	uint16_t u16()
+	{
+		uint16_t hi = u8();
+		return (hi << 8) | u8();
+	}
+
+	uint32_t u32()
+	{
+		uint32_t hi = u16();
+		return (hi << 16) | u16();
+	}
+
+	uint64_t u64()
+	{
+		uint64_t hi = u32();
+		return (hi << 32) | u32();
+	}
+
+	bool bytes(void * out, size_t n)
+	{
+		if (!has(n)) {
+			m_ok = false;
+			return false;
+		}
+		memcpy(out, m_data + m_pos, n);
+		m_pos += n;
+		return true;
+	}
+
+private:
+	const uint8_t * m_data;
+	uint64_t m_size;
+	uint64_t m_pos;
+	bool m_ok;
+};
+
+bool is_key(const char * key, const char * value)
+{
+	return memcmp(key, value, 4) == 0;
+}
+
+// keys whose length field is 8 bytes wide in PSB files
+bool has_long_length(const char * key)
+{
+	static const char * const keys[] = {
+		"LMsk", "Lr16", "Lr32", "Layr", "Mt16", "Mt32", "Mtrn", "Alph", "FMsk", "lnk2", "FEid", "FXid", "PxSD",
+	};
+	for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+		if (is_key(key, keys[i]))
+			return true;
+	}
+	return false;
+}
+
+// fill and adjustment layers carry no pixels of their own
+bool is_adjustment_key(const char * key)
+{
+	static const char * const keys[] = {
+		"SoCo", "GdFl", "PtFl", "brit", "levl", "curv", "expA", "vibA", "hue ", "hue2", "blnc",
+		"blwh", "phfl", "mixr", "clrL", "nvrt", "post", "thrs", "grdm", "selc",
+	};
+	for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+		if (is_key(key, keys[i]))
+			return true;
+	}
+	return false;
+}
+
+enum {
+	compression_raw = 0,
+	compression_rle = 1,
+	compression_zip = 2,
+	compression_zip_prediction = 3,
+};
+
+enum {
+	color_mode_grayscale = 1,
+	color_mode_rgb = 3,
+};
+
+
+// Swaps count big-endian samples of size bytes to host order in place
+void samples_to_host(uint8_t * data, size_t count, int size)
+{
+	if (size == 2) {
+		for (size_t i = 0; i < count; i++) {
+			uint8_t * p = data + i * 2;
+			uint16_t value = (uint16_t) (p[0] << 8 | p[1]);
+			memcpy(p, &value, 2);
+		}
+	} else if (size == 4) {
+		for (size_t i = 0; i < count; i++) {
+			uint8_t * p = data + i * 4;
+			uint32_t value = (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+			memcpy(p, &value, 4);
+		}
+	}
+}
+
+// Fills a plane with black or, for transparency, with opaque samples
+void fill_plane(void * plane, size_t count, int size, bool opaque)
+{
+	if (!opaque || size < 4) {
+		memset(plane, opaque? 0xff : 0, count * size);
+		return;
+	}
+	float * samples = (float *) plane;
+	for (size_t i = 0; i < count; i++)
+		samples[i] = 1.0f;
+}
+
+// Dithers a plane of 16-bit or float samples down to bytes. 32-bit files
+// store linear light, so their color gets the sRGB curve on the way.
+void plane_to_u8(const void * plane, int size, bool color, int width, int height, uint8_t * out)
+{
+	std::vector<uint16_t> row(size == 4? width : 0);
+	for (int y = 0; y < height; y++) {
+		size_t offset = (size_t) y * width;
+		const uint16_t * samples = (const uint16_t *) plane + offset;
+		if (size == 4) {
+			float_to_u16((const float *) plane + offset, width, color, row.data());
+			samples = row.data();
+		}
+		dither_u16_to_u8(samples, width, y, out + offset);
+	}
+}
+
+}
+
+psd_reader::psd_reader(arena & memory)
+	: m_arena(memory), m_psb(false), m_channels(0), m_width(0), m_height(0), m_depth(0), m_color_mode(0),
+	  m_layer_section_offset(0), m_image_data_offset(0), m_merged_alpha(false), m_layers(memory)
+{
+}
+
+bool psd_reader::open(const char * filename, bool read_layers)
+{
+	m_layers.clear();
+	if (!m_file.open(filename))
+		return false;
+
+	cursor in(m_file.data(), m_file.size());
+
+	char signature[4];
+	in.bytes(signature, 4);
+	int version = in.u16();
+	in.skip(6);
+	m_channels = in.u16();
+	m_height = in.u32();
+	m_width = in.u32();
+	m_depth = in.u16();
+	m_color_mode = in.u16();
+	if (!in.ok() || !is_key(signature, "8BPS") || (version != 1 && version != 2))
+		return false;
+	m_psb = version == 2;
+
+	if (m_depth != 8 && m_depth != 16 && m_depth != 32)
+		return false;
+	if (m_color_mode != color_mode_rgb && m_color_mode != color_mode_grayscale)
+		return false;
+
+	// color mode data, then image resources
+	in.skip(in.u32());
+	in.skip(in.u32());
+
+	uint64_t layer_and_mask_length = m_psb? in.u64() : in.u32();
+	m_layer_section_offset = in.pos();
+	in.skip(layer_and_mask_length);
+	m_image_data_offset = in.pos();
+	if (!in.ok())
+		return false;
+	if (layer_and_mask_length == 0)
+		return true;
+
+	// a negative layer count flags the transparency of the composite
+	uint64_t layer_info, layer_info_end;
+	if (find_layer_info(layer_info, layer_info_end)) {
+		cursor info(m_file.data(), layer_info_end, layer_info);
+		m_merged_alpha = (int16_t) info.u16() < 0 && info.ok();
+	}
+
+	return !read_layers || read_layer_records();
+}
+
+// Finds the layer count that starts the layer records. 16 and 32-bit files
+// leave the layer info of the section empty and store it in a Lr16 or Lr32
+// block after the global mask instead.
+bool psd_reader::find_layer_info(uint64_t & offset, uint64_t & end) const
+{
+	if (m_image_data_offset == m_layer_section_offset)
+		return false;
+
+	cursor in(m_file.data(), m_image_data_offset, m_layer_section_offset);
+	uint64_t layer_info_length = m_psb? in.u64() : in.u32();
+	if (layer_info_length != 0) {
+		offset = in.pos();
+		end = offset + layer_info_length;
+		return in.ok();
+	}
+	if (m_depth == 8)
+		return false;
+
+	in.skip(in.u32());
+	while (in.ok() && in.pos() + 12 <= m_image_data_offset) {
+		char signature[4];
+		char key[4];
+		in.bytes(signature, 4);
+		in.bytes(key, 4);
+		if (!is_key(signature, "8BIM") && !is_key(signature, "8B64"))
+			return false;
+		uint64_t length = m_psb && has_long_length(key)? in.u64() : in.u32();
+		if (is_key(key, m_depth == 16? "Lr16" : "Lr32")) {
+			offset = in.pos();
+			end = offset + length;
+			return length != 0 && in.ok();
+		}
+		in.skip(length);
+	}
+	return false;
+}
+
+bool psd_reader::read_layer_records()
+{
+	uint64_t layer_info, layer_info_end;
+	if (!find_layer_info(layer_info, layer_info_end))
+		return true;
+
+	cursor in(m_file.data(), m_file.size(), layer_info);
+	int layer_count = (int16_t) in.u16();
+	if (layer_count < 0)
+		layer_count = -layer_count;
+
+	m_layers.resize(layer_count);
+	for (int i = 0; i < layer_count; i++) {
+		psd_layer_ref & layer = m_layers[i];
+		layer.top = (int32_t) in.u32();
+		layer.left = (int32_t) in.u32();
+		layer.bottom = (int32_t) in.u32();
+		layer.right = (int32_t) in.u32();
+		if (layer.bottom < layer.top || layer.right < layer.left)
+			return false;
+
+		int n_channels = in.u16();
+		layer.channel_count = n_channels;
+		layer.channels = (psd_channel_ref *) m_arena.allocate(n_channels * sizeof(psd_channel_ref), alignof(psd_channel_ref));
+		for (int c = 0; c < n_channels; c++) {
+			layer.channels[c].id = (int16_t) in.u16();
+			layer.channels[c].length = m_psb? in.u64() : in.u32();
+		}
+
+		char signature[4];
+		in.bytes(signature, 4);
+		in.bytes(layer.blend_mode, 4);
+		layer.opacity = in.u8();
+		layer.clipping = in.u8();
+		layer.flags = in.u8();
+		in.skip(1);
+		if (!in.ok() || !is_key(signature, "8BIM"))
+			return false;
+
+		uint64_t extra_length = in.u32();
+		uint64_t extra_end = in.pos() + extra_length;
+
+		uint32_t mask_length = in.u32();
+		uint64_t mask_end = in.pos() + mask_length;
+		layer.has_mask = mask_length >= 18;
+		if (layer.has_mask) {
+			layer.mask_top = (int32_t) in.u32();
+			layer.mask_left = (int32_t) in.u32();
+			layer.mask_bottom = (int32_t) in.u32();
+			layer.mask_right = (int32_t) in.u32();
+			layer.mask_default_color = in.u8();
+			layer.mask_flags = in.u8();
+		} else {
+			layer.mask_top = layer.mask_left = layer.mask_bottom = layer.mask_right = 0;
+			layer.mask_default_color = 0;
+			layer.mask_flags = 0;
+		}
+		in.seek(mask_end);
+
+		// blending ranges
+		in.skip(in.u32());
+
+		// Pascal string padded to a multiple of 4 bytes
+		int name_length = in.u8();
+		layer.name = m_arena.copy_string((const char *) in.here(), in.has(name_length)? name_length : 0);
+		in.skip(((name_length + 1 + 3) & ~3) - 1);
+
+		layer.section = psd_section_none;
+		layer.adjustment = false;
+		layer.fill_opacity = 255;
+		while (in.ok() && in.pos() + 12 <= extra_end) {
+			char key[4];
+			in.bytes(signature, 4);
+			in.bytes(key, 4);
+			if (!is_key(signature, "8BIM") && !is_key(signature, "8B64"))
+				break;
+			uint64_t length = m_psb && has_long_length(key)? in.u64() : in.u32();
+			uint64_t block_end = in.pos() + length;
+
+			if (is_key(key, "lsct") || is_key(key, "lsdk")) {
+				layer.section = in.u32();
+			} else if (is_key(key, "iOpa")) {
+				layer.fill_opacity = in.u8();
+			} else if (is_adjustment_key(key)) {
+				layer.adjustment = true;
+			}
+			in.seek(block_end);
+		}
+		in.seek(extra_end);
+		if (!in.ok())
+			return false;
+	}
+
+	// channel image data follows the records, in the same order
+	for (size_t i = 0; i < m_layers.size(); i++) {
+		for (int c = 0; c < m_layers[i].channel_count; c++) {
+			psd_channel_ref & channel = m_layers[i].channels[c];
+			channel.offset = in.pos();
+			in.skip(channel.length);
+		}
+	}
+	return in.ok();
+}
+
+bool psd_reader::decode_channel(const psd_channel_ref & channel, int width, int height, uint8_t * out) const
+{
+	if (channel.length < 2 || channel.offset + channel.length > m_file.size())
+		return false;
+
+	cursor in(m_file.data(), channel.offset + channel.length, channel.offset);
+	int compression = in.u16();
+	int size = sample_size();
+	size_t n_samples = (size_t) width * height;
+	size_t n_bytes = n_samples * size;
+
+	switch (compression) {
+	case compression_raw:
+		if (!in.bytes(out, n_bytes))
+			return false;
+		break;
+	case compression_rle: {
+		// byte count of every row, then the packed rows back to back: runs
+		// never cross rows, so they decode as a single stream
+		size_t counts_size = (size_t) height * (m_psb? 4 : 2);
+		if (!in.has(counts_size))
+			return false;
+		cursor counts(m_file.data(), in.pos() + counts_size, in.pos());
+		in.skip(counts_size);
+		uint64_t packed_size = 0;
+		for (int y = 0; y < height; y++)
+			packed_size += m_psb? counts.u32() : counts.u16();
+		if (!in.has(packed_size) || !packbits_decode(in.here(), packed_size, out, n_bytes))
+			return false;
+		break;
+	}
+	case compression_zip:
+	case compression_zip_prediction: {
+		std::vector<unsigned char> inflated;
+		LodePNGDecompressSettings settings;
+		lodepng_decompress_settings_init(&settings);
+		if (lodepng::decompress(inflated, in.here(), channel.length - 2, settings) != 0 || inflated.size() < n_bytes)
+			return false;
+		memcpy(out, inflated.data(), n_bytes);
+		if (compression == compression_zip_prediction && size == 4) {
+			// the rows are byte deltas over the highest bytes of all the
+			// samples, then the next bytes and so on
+			for (int y = 0; y < height; y++) {
+				uint8_t * row = &inflated[(size_t) y * width * 4];
+				for (int x = 1; x < width * 4; x++)
+					row[x] += row[x - 1];
+				uint8_t * samples = out + (size_t) y * width * 4;
+				for (int x = 0; x < width; x++) {
+					for (int b = 0; b < 4; b++)
+						samples[x * 4 + b] = row[b * width + x];
+				}
+			}
+		} else if (compression == compression_zip_prediction) {
+			samples_to_host(out, n_samples, size);
+			for (int y = 0; y < height; y++) {
+				if (size == 2) {
+					uint16_t * row = (uint16_t *) out + (size_t) y * width;
+					for (int x = 1; x < width; x++)
+						row[x] += row[x - 1];
+				} else {
+					uint8_t * row = out + (size_t) y * width;
+					for (int x = 1; x < width; x++)
+						row[x] += row[x - 1];
+				}
+			}
+			return true;
+		}
+		break;
+	}
+	default:
+		return false;
+	}
+	samples_to_host(out, n_samples, size);
+	return true;
+}
+
+bool psd_reader::decode_layer_planes(size_t index, void * const planes[4]) const
+{
+	if (index >= m_layers.size())
+		return false;
+
+	const psd_layer_ref & layer = m_layers[index];
+	int width = layer.width();
+	int height = layer.height();
+	size_t n_pixels = (size_t) width * height;
+	if (n_pixels == 0)
+		return true;
+
+	bool decoded[4] = {false, false, false, false};
+	for (int c = 0; c < layer.channel_count; c++) {
+		const psd_channel_ref & channel = layer.channels[c];
+		int p;
+		if (channel.id == -1)
+			p = 3;
+		else if (channel.id >= 0 && channel.id < (m_color_mode == color_mode_rgb? 3 : 1))
+			p = channel.id;
+		else
+			continue;
+		if (!decode_channel(channel, width, height, (uint8_t *) planes[p]))
+			return false;
+		decoded[p] = true;
+	}
+
+	// missing color is black, missing transparency opaque
+	for (int p = 0; p < 4; p++) {
+		if (!decoded[p] && !(p > 0 && p < 3 && m_color_mode == color_mode_grayscale))
+			fill_plane(planes[p], n_pixels, sample_size(), p == 3);
+	}
+	if (m_color_mode == color_mode_grayscale) {
+		memcpy(planes[1], planes[0], n_pixels * sample_size());
+		memcpy(planes[2], planes[0], n_pixels * sample_size());
+	}
+	return true;
+}
+
+bool psd_reader::decode_layer_mask(size_t index, uint8_t * mask) const
+{
+	if (index >= m_layers.size())
+		return false;
+
+	const psd_layer_ref & layer = m_layers[index];
+	int width = layer.mask_width();
+	int height = layer.mask_height();
+	size_t n_pixels = (size_t) width * height;
+	if (!layer.has_mask || width <= 0 || height <= 0)
+		return false;
+
+	for (int c = 0; c < layer.channel_count; c++) {
+		const psd_channel_ref & channel = layer.channels[c];
+		if (channel.id != -2)
+			continue;
+		if (m_depth == 8)
+			return decode_channel(channel, width, height, mask);
+
+		std::vector<uint8_t> samples(n_pixels * sample_size());
+		if (!decode_channel(channel, width, height, samples.data()))
+			return false;
+		for (size_t i = 0; i < n_pixels; i++) {
+			if (m_depth == 16) {
+				mask[i] = ((const uint16_t *) samples.data())[i] >> 8;
+			} else {
+				float value = ((const float *) samples.data())[i];
+				mask[i] = (uint8_t) (value > 0? (value < 1? value * 255 + 0.5f : 255) : 0);
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+bool psd_reader::decode_layer_argb(size_t index, uint32_t * pixels) const
+{
+	if (index >= m_layers.size())
+		return false;
+
+	const psd_layer_ref & layer = m_layers[index];
+	int width = layer.width();
+	int height = layer.height();
+	size_t n_pixels = (size_t) width * height;
+	if (n_pixels == 0)
+		return true;
+
+	// planes: red, green, blue, alpha
+	std::vector<uint8_t> planes(n_pixels * 4 * sample_size());
+	void * plane[4];
+	for (int p = 0; p < 4; p++)
+		plane[p] = &planes[p * n_pixels * sample_size()];
+	if (!decode_layer_planes(index, plane))
+		return false;
+
+	uint8_t * bytes[4];
+	std::vector<uint8_t> reduced;
+	if (m_depth == 8) {
+		for (int p = 0; p < 4; p++)
+			bytes[p] = (uint8_t *) plane[p];
+	} else {
+		// the color planes of grayscale are copies, one is enough
+		reduced.resize(n_pixels * 4);
+		for (int p = 0; p < 4; p++) {
+			bytes[p] = &reduced[p * n_pixels];
+			if (p == 0 || p == 3 || m_color_mode != color_mode_grayscale)
+				plane_to_u8(plane[p], sample_size(), p < 3, width, height, bytes[p]);
+		}
+	}
+
+	if (m_color_mode == color_mode_grayscale)
+		planar_to_argb(bytes[0], bytes[0], bytes[0], bytes[3], n_pixels, pixels);
+	else
+		planar_to_argb(bytes[0], bytes[1], bytes[2], bytes[3], n_pixels, pixels);
+	return true;
+}
+
+bool psd_reader::decode_composite_argb(uint32_t * pixels) const
+{
+	size_t n_pixels = (size_t) m_width * m_height;
+	if (n_pixels == 0)
+		return true;
+
+	int n_color = m_color_mode == color_mode_rgb? 3 : 1;
+	if (m_channels < n_color)
+		return false;
+	int n_planes = m_merged_alpha && m_channels > n_color? n_color + 1 : n_color;
+	int size = sample_size();
+	size_t plane_size = n_pixels * size;
+
+	// planes: color, then transparency in the slot after it
+	std::vector<uint8_t> planes(plane_size * 4);
+	uint8_t * plane[4];
+	for (int p = 0; p < 4; p++)
+		plane[p] = &planes[p * plane_size];
+
+	// every channel is stored whole, one after the other
+	cursor in(m_file.data(), m_file.size(), m_image_data_offset);
+	int compression = in.u16();
+	switch (compression) {
+	case compression_raw:
+		for (int c = 0; c < n_planes; c++) {
+			if (!in.bytes(plane[c < n_color? c : 3], plane_size))
+				return false;
+		}
+		break;
+	case compression_rle: {
+		// the byte counts of the rows of all channels come first
+		size_t counts_size = (size_t) m_channels * m_height * (m_psb? 4 : 2);
+		if (!in.has(counts_size))
+			return false;
+		cursor counts(m_file.data(), in.pos() + counts_size, in.pos());
+		in.skip(counts_size);
+		for (int c = 0; c < n_planes; c++) {
+			uint64_t packed_size = 0;
+			for (int y = 0; y < m_height; y++)
+				packed_size += m_psb? counts.u32() : counts.u16();
+			if (!in.has(packed_size) || !packbits_decode(in.here(), packed_size, plane[c < n_color? c : 3], plane_size))
+				return false;
+			in.skip(packed_size);
+		}
+		break;
+	}
+	default:
+		return false;
+	}
+	for (int c = 0; c < n_planes; c++)
+		samples_to_host(plane[c < n_color? c : 3], n_pixels, size);
+	if (n_planes == n_color)
+		fill_plane(plane[3], n_pixels, size, true);
+
+	std::vector<uint8_t> reduced;
+	if (m_depth != 8) {
+		reduced.resize(n_pixels * 4);
+		for (int c = 0; c < 4; c++) {
+			if (c < n_color || c == 3)
+				plane_to_u8(plane[c], size, c < 3, m_width, m_height, &reduced[c * n_pixels]);
+			plane[c] = &reduced[c * n_pixels];
+		}
+	}
+
+	if (m_color_mode == color_mode_grayscale)
+		planar_to_argb(plane[0], plane[0], plane[0], plane[3], n_pixels, pixels);
+	else
+		planar_to_argb(plane[0], plane[1], plane[2], plane[3], n_pixels, pixels);
+	return true;
+}
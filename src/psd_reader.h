@@ -0,0 +1,108 @@
+#ifndef PSD_READER_H
+#define PSD_READER_H
+
+#include "arena.h"
+#include "mapped_file.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum psd_section_type {
+	psd_section_none = 0,
+	psd_section_open_folder = 1,
+	psd_section_closed_folder = 2,
+	psd_section_divider = 3,
+};
+
+struct psd_channel_ref {
+	int id; // 0, 1, 2: color; -1: transparency; -2, -3: masks
+	uint64_t offset; // of the compression tag, in the file
+	uint64_t length; // including the compression tag
+};
+
+struct psd_layer_ref {
+	int top;
+	int left;
+	int bottom;
+	int right;
+	psd_channel_ref * channels;
+	int channel_count;
+	char blend_mode[4];
+	uint8_t opacity;
+	uint8_t fill_opacity; // of the pixels alone, without the layer effects
+	uint8_t clipping;
+	uint8_t flags;
+	int section; // psd_section_type
+	bool adjustment; // fill or adjustment layer, without pixels of its own
+	const char * name;
+
+	bool has_mask;
+	int mask_top;
+	int mask_left;
+	int mask_bottom;
+	int mask_right;
+	uint8_t mask_default_color;
+	uint8_t mask_flags;
+
+	int width() const { return right - left; }
+	int height() const { return bottom - top; }
+	int mask_width() const { return mask_right - mask_left; }
+	int mask_height() const { return mask_bottom - mask_top; }
+	bool visible() const { return (flags & 0x02) == 0; }
+	bool mask_enabled() const { return has_mask && (mask_flags & 0x02) == 0; }
+};
+
+// Reads the structure of a PSD/PSB file straight from a memory mapping: the
+// header and the layer records are parsed when the file is opened, channel
+// data is only touched when a layer is decoded. The records live in the
+// arena given to the constructor.
+class psd_reader {
+public:
+	explicit psd_reader(arena & memory);
+
+	// fails on files it cannot decode, so that callers can fall back to libpsd;
+	// without read_layers only the header is read, for decode_composite_argb
+	bool open(const char * filename, bool read_layers = true);
+
+	int width() const { return m_width; }
+	int height() const { return m_height; }
+	int depth() const { return m_depth; } // bits per channel: 8, 16 or 32
+	int sample_size() const { return m_depth / 8; } // uint8_t, uint16_t or float
+	int color_mode() const { return m_color_mode; }
+	const arena_vector<psd_layer_ref> & layers() const { return m_layers; }
+
+	// Decodes the red, green, blue and alpha channels of a layer into four
+	// planes of width * height samples of the file depth, in host byte order.
+	// Grayscale is copied to the three color planes. Safe to call from
+	// several threads at once, like the two below.
+	bool decode_layer_planes(size_t index, void * const planes[4]) const;
+	// Decodes the color and transparency channels of a layer into 0xAARRGGBB
+	// words, dithered down from deeper files.
+	bool decode_layer_argb(size_t index, uint32_t * pixels) const;
+	// Decodes the user mask of a layer, mask_width() * mask_height() bytes,
+	// deeper files shifted down to 8 bits. False when it has none.
+	bool decode_layer_mask(size_t index, uint8_t * mask) const;
+	// Decodes the flattened image stored after the layers, width() * height()
+	// words. Only raw and RLE data, the two Photoshop writes there.
+	bool decode_composite_argb(uint32_t * pixels) const;
+
+private:
+	bool find_layer_info(uint64_t & offset, uint64_t & end) const;
+	bool read_layer_records();
+	bool decode_channel(const psd_channel_ref & channel, int width, int height, uint8_t * out) const;
+
+	arena & m_arena;
+	mapped_file m_file;
+	bool m_psb;
+	int m_channels;
+	int m_width;
+	int m_height;
+	int m_depth;
+	int m_color_mode;
+	uint64_t m_layer_section_offset;
+	uint64_t m_image_data_offset;
+	bool m_merged_alpha; // the first extra channel of the composite is its transparency
+	arena_vector<psd_layer_ref> m_layers;
+};
+
+#endif // PSD_READER_H
@@ -0,0 +1,554 @@
+#include "psd_stex.h"
+#include "psd_parser.h"
+
+#include <atomic>
+#include <thread>
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+// Image::Format values and StreamTexture flags of Godot 3
+enum {
+	image_format_dxt5 = 19,
+	image_format_etc2_rgba8 = 35
+};
+
+static const uint32_t texture_flag_filter = 4;
+
+// 4x4 pixels, row by row, with the edges of partial blocks repeated
+struct pixel_block {
+	uint8_t rgba[16][4];
+};
+
+static void fetch_block(const unsigned char * rgba, int width, int height, int bx, int by, pixel_block & block)
+{
+	for (int y = 0; y < 4; y++) {
+		int sy = by * 4 + y < height? by * 4 + y : height - 1;
+		for (int x = 0; x < 4; x++) {
+			int sx = bx * 4 + x < width? bx * 4 + x : width - 1;
+			memcpy(block.rgba[y * 4 + x], rgba + ((size_t) sy * width + sx) * 4, 4);
+		}
+	}
+}
+
+static int clamp255(int value)
+{
+	return value < 0? 0 : value > 255? 255 : value;
+}
+
+static int square(int value)
+{
+	return value * value;
+}
+
+// BC3 (DXT5): an 8-byte alpha block followed by an 8-byte BC1 color block,
+// both little-endian
+
+static uint64_t bc3_alpha_indices(const pixel_block & block, const int * palette, int & error)
+{
+	uint64_t bits = 0;
+	error = 0;
+	for (int i = 0; i < 16; i++) {
+		int alpha = block.rgba[i][3];
+		int best = 0;
+		int best_error = 1 << 30;
+		for (int code = 0; code < 8; code++) {
+			int e = square(alpha - palette[code]);
+			if (e < best_error) {
+				best_error = e;
+				best = code;
+			}
+		}
+		error += best_error;
+		bits |= (uint64_t) best << (3 * i);
+	}
+	return bits;
+}
+
+static void encode_bc3_alpha(const pixel_block & block, uint8_t * out)
+{
+	int min_alpha = 255, max_alpha = 0;
+	// the six-value mode has exact 0 and 255, so it fits the rest in between
+	int inner_min = 255, inner_max = 0;
+	for (int i = 0; i < 16; i++) {
+		int alpha = block.rgba[i][3];
+		min_alpha = alpha < min_alpha? alpha : min_alpha;
+		max_alpha = alpha > max_alpha? alpha : max_alpha;
+		if (alpha != 0 && alpha != 255) {
+			inner_min = alpha < inner_min? alpha : inner_min;
+			inner_max = alpha > inner_max? alpha : inner_max;
+		}
+	}
+
+	int eight[8];
+	eight[0] = max_alpha;
+	eight[1] = min_alpha;
+	for (int code = 2; code < 8; code++)
+		eight[code] = ((8 - code) * max_alpha + (code - 1) * min_alpha) / 7;
+	int eight_error;
+	uint64_t bits = bc3_alpha_indices(block, eight, eight_error);
+	int a0 = max_alpha, a1 = min_alpha;
+
+	if (eight_error > 0) {
+		if (inner_min > inner_max)
+			inner_min = inner_max = 0;
+		int six[8];
+		six[0] = inner_min;
+		six[1] = inner_max;
+		for (int code = 2; code < 6; code++)
+			six[code] = ((6 - code) * inner_min + (code - 1) * inner_max) / 5;
+		six[6] = 0;
+		six[7] = 255;
+		int six_error;
+		uint64_t six_bits = bc3_alpha_indices(block, six, six_error);
+		if (six_error < eight_error) {
+			bits = six_bits;
+			a0 = inner_min;
+			a1 = inner_max;
+		}
+	}
+
+	out[0] = (uint8_t) a0;
+	out[1] = (uint8_t) a1;
+	for (int i = 0; i < 6; i++)
+		out[2 + i] = (uint8_t) (bits >> (8 * i));
+}
+
+static uint16_t pack_565(const float * color)
+{
+	int r = clamp255((int) (color[0] + 0.5f));
+	int g = clamp255((int) (color[1] + 0.5f));
+	int b = clamp255((int) (color[2] + 0.5f));
+	return (uint16_t) (((r * 31 + 127) / 255) << 11 | ((g * 63 + 127) / 255) << 5 | ((b * 31 + 127) / 255));
+}
+
+static void unpack_565(uint16_t packed, int * color)
+{
+	int r = packed >> 11, g = (packed >> 5) & 63, b = packed & 31;
+	color[0] = r << 3 | r >> 2;
+	color[1] = g << 2 | g >> 4;
+	color[2] = b << 3 | b >> 2;
+}
+
+static void encode_bc1_color(const pixel_block & block, uint8_t * out)
+{
+	// fully transparent pixels do not show, so they do not pull the endpoints
+	bool use[16];
+	int count = 0;
+	for (int i = 0; i < 16; i++) {
+		use[i] = block.rgba[i][3] != 0;
+		count += use[i];
+	}
+	if (count == 0) {
+		for (int i = 0; i < 16; i++)
+			use[i] = true;
+		count = 16;
+	}
+
+	float mean[3] = { 0, 0, 0 };
+	for (int i = 0; i < 16; i++) {
+		for (int c = 0; use[i] && c < 3; c++)
+			mean[c] += block.rgba[i][c];
+	}
+	for (int c = 0; c < 3; c++)
+		mean[c] /= count;
+
+	float cov[6] = { 0, 0, 0, 0, 0, 0 }; // rr rg rb gg gb bb
+	for (int i = 0; i < 16; i++) {
+		if (!use[i])
+			continue;
+		float d[3] = { block.rgba[i][0] - mean[0], block.rgba[i][1] - mean[1], block.rgba[i][2] - mean[2] };
+		cov[0] += d[0] * d[0];
+		cov[1] += d[0] * d[1];
+		cov[2] += d[0] * d[2];
+		cov[3] += d[1] * d[1];
+		cov[4] += d[1] * d[2];
+		cov[5] += d[2] * d[2];
+	}
+
+	// principal axis by power iteration
+	float axis[3] = { 1, 1, 1 };
+	for (int iteration = 0; iteration < 4; iteration++) {
+		float next[3] = {
+			cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2],
+			cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2],
+			cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2]
+		};
+		float length = next[0] * next[0] + next[1] * next[1] + next[2] * next[2];
+		if (length < 1e-6f)
+			break;
+		float scale = 1.0f / sqrtf(length);
+		for (int c = 0; c < 3; c++)
+			axis[c] = next[c] * scale;
+	}
+
+	float min_t = 1e30f, max_t = -1e30f;
+	for (int i = 0; i < 16; i++) {
+		if (!use[i])
+			continue;
+		float t = (block.rgba[i][0] - mean[0]) * axis[0] + (block.rgba[i][1] - mean[1]) * axis[1] + (block.rgba[i][2] - mean[2]) * axis[2];
+		min_t = t < min_t? t : min_t;
+		max_t = t > max_t? t : max_t;
+	}
+	// pulling the ends in a little lowers the error of the points in between
+	float inset = (max_t - min_t) / 16;
+	min_t += inset;
+	max_t -= inset;
+
+	float end0[3], end1[3];
+	for (int c = 0; c < 3; c++) {
+		end0[c] = mean[c] + axis[c] * max_t;
+		end1[c] = mean[c] + axis[c] * min_t;
+	}
+	uint16_t c0 = pack_565(end0);
+	uint16_t c1 = pack_565(end1);
+	// BC3 colors always use four-color mode, which wants c0 > c1
+	if (c0 < c1) {
+		uint16_t swap = c0;
+		c0 = c1;
+		c1 = swap;
+	}
+
+	uint32_t bits = 0;
+	if (c0 != c1) {
+		int palette[4][3];
+		unpack_565(c0, palette[0]);
+		unpack_565(c1, palette[1]);
+		for (int c = 0; c < 3; c++) {
+			palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+			palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+		}
+		for (int i = 0; i < 16; i++) {
+			int best = 0;
+			int best_error = 1 << 30;
+			for (int code = 0; code < 4; code++) {
+				int e = square(block.rgba[i][0] - palette[code][0]) + square(block.rgba[i][1] - palette[code][1]) + square(block.rgba[i][2] - palette[code][2]);
+				if (e < best_error) {
+					best_error = e;
+					best = code;
+				}
+			}
+			bits |= (uint32_t) best << (2 * i);
+		}
+	}
+
+	out[0] = (uint8_t) c0;
+	out[1] = (uint8_t) (c0 >> 8);
+	out[2] = (uint8_t) c1;
+	out[3] = (uint8_t) (c1 >> 8);
+	for (int i = 0; i < 4; i++)
+		out[4 + i] = (uint8_t) (bits >> (8 * i));
+}
+
+static void encode_bc3(const pixel_block & block, uint8_t * out)
+{
+	encode_bc3_alpha(block, out);
+	encode_bc1_color(block, out + 8);
+}
+
+// ETC2 RGBA8: an 8-byte EAC alpha block followed by an 8-byte color block,
+// both big-endian. Colors only use the individual and differential modes
+// that ETC2 shares with ETC1, never overflowing the differential deltas
+// into the T, H and planar modes.
+
+static const int etc_modifiers[8][2] = {
+	{ 2, 8 }, { 5, 17 }, { 9, 29 }, { 13, 42 }, { 18, 60 }, { 24, 80 }, { 33, 106 }, { 47, 183 }
+};
+
+static const int eac_modifiers[16][8] = {
+	{ -3, -6, -9, -15, 2, 5, 8, 14 },
+	{ -3, -7, -10, -13, 2, 6, 9, 12 },
+	{ -2, -5, -8, -13, 1, 4, 7, 12 },
+	{ -2, -4, -6, -13, 1, 3, 5, 12 },
+	{ -3, -6, -8, -12, 2, 5, 7, 11 },
+	{ -3, -7, -9, -11, 2, 6, 8, 10 },
+	{ -4, -7, -8, -11, 3, 6, 7, 10 },
+	{ -3, -5, -8, -11, 2, 4, 7, 10 },
+	{ -2, -6, -8, -10, 1, 5, 7, 9 },
+	{ -2, -5, -8, -10, 1, 4, 7, 9 },
+	{ -2, -4, -8, -10, 1, 3, 7, 9 },
+	{ -2, -5, -7, -10, 1, 4, 6, 9 },
+	{ -3, -4, -7, -10, 2, 3, 6, 9 },
+	{ -1, -2, -3, -10, 0, 1, 2, 9 },
+	{ -4, -6, -8, -9, 3, 5, 7, 8 },
+	{ -3, -5, -7, -9, 2, 4, 6, 8 }
+};
+
+static void store_be64(uint64_t value, uint8_t * out)
+{
+	for (int i = 0; i < 8; i++)
+		out[i] = (uint8_t) (value >> (56 - 8 * i));
+}
+
+static void encode_eac_alpha(const pixel_block & block, uint8_t * out)
+{
+	int min_alpha = 255, max_alpha = 0;
+	for (int i = 0; i < 16; i++) {
+		int alpha = block.rgba[i][3];
+		min_alpha = alpha < min_alpha? alpha : min_alpha;
+		max_alpha = alpha > max_alpha? alpha : max_alpha;
+	}
+
+	// flat blocks, such as fully opaque or transparent ones, are exact with
+	// the zero modifier of table 13
+	int best_base = min_alpha, best_table = 13, best_multiplier = 1;
+	int best_error = 0;
+	uint64_t best_indices = 0;
+	if (min_alpha != max_alpha) {
+		best_error = 1 << 30;
+		for (int table = 0; table < 16 && best_error > 0; table++) {
+			const int * modifiers = eac_modifiers[table];
+			int spread = modifiers[7] - modifiers[3];
+			int guess = (max_alpha - min_alpha + spread / 2) / spread;
+			for (int multiplier = guess - 1; multiplier <= guess + 1; multiplier++) {
+				if (multiplier < 1 || multiplier > 15)
+					continue;
+				int base = clamp255((min_alpha + max_alpha - (modifiers[3] + modifiers[7]) * multiplier + 1) / 2);
+				int values[8];
+				for (int code = 0; code < 8; code++)
+					values[code] = clamp255(base + modifiers[code] * multiplier);
+
+				int error = 0;
+				uint64_t indices = 0;
+				for (int i = 0; i < 16 && error < best_error; i++) {
+					int alpha = block.rgba[i][3];
+					int best = 0;
+					int best_e = 1 << 30;
+					for (int code = 0; code < 8; code++) {
+						int e = square(alpha - values[code]);
+						if (e < best_e) {
+							best_e = e;
+							best = code;
+						}
+					}
+					error += best_e;
+					// pixels go column by column
+					int position = (i & 3) * 4 + (i >> 2);
+					indices |= (uint64_t) best << (45 - 3 * position);
+				}
+				if (error < best_error) {
+					best_error = error;
+					best_base = base;
+					best_table = table;
+					best_multiplier = multiplier;
+					best_indices = indices;
+				}
+			}
+		}
+	} else {
+		for (int position = 0; position < 16; position++)
+			best_indices |= (uint64_t) 4 << (45 - 3 * position);
+	}
+
+	store_be64((uint64_t) best_base << 56 | (uint64_t) best_multiplier << 52 | (uint64_t) best_table << 48 | best_indices, out);
+}
+
+// Best modifier table and indices for the pixels of one half-block around
+// base; returns the error and sets the 2-bit index of each pixel
+static int fit_etc_half(const pixel_block & block, const int * pixels, const int * base, int & best_table, int * codes)
+{
+	int best_error = 1 << 30;
+	for (int table = 0; table < 8; table++) {
+		int error = 0;
+		int table_codes[8];
+		for (int n = 0; n < 8 && error < best_error; n++) {
+			const uint8_t * p = block.rgba[pixels[n]];
+			// fully transparent pixels do not show
+			bool visible = p[3] != 0;
+			int best = 0;
+			int best_e = 1 << 30;
+			for (int code = 0; code < 4; code++) {
+				int modifier = etc_modifiers[table][code & 1];
+				if (code & 2)
+					modifier = -modifier;
+				int e = square(p[0] - clamp255(base[0] + modifier)) + square(p[1] - clamp255(base[1] + modifier)) + square(p[2] - clamp255(base[2] + modifier));
+				if (e < best_e) {
+					best_e = e;
+					best = code;
+				}
+			}
+			table_codes[n] = best;
+			if (visible)
+				error += best_e;
+		}
+		if (error < best_error) {
+			best_error = error;
+			best_table = table;
+			memcpy(codes, table_codes, sizeof(table_codes));
+		}
+	}
+	return best_error;
+}
+
+static void encode_etc_color(const pixel_block & block, uint8_t * out)
+{
+	uint64_t best_bits = 0;
+	int best_error = 1 << 30;
+
+	for (int flip = 0; flip < 2; flip++) {
+		// pixel numbers of the two halves: left and right columns, or top and bottom rows
+		int halves[2][8];
+		int averages[2][3];
+		for (int half = 0; half < 2; half++) {
+			int n = 0;
+			int sums[3] = { 0, 0, 0 };
+			int weight = 0;
+			for (int i = 0; i < 16; i++) {
+				int x = i & 3, y = i >> 2;
+				if ((flip? y >> 1 : x >> 1) != half)
+					continue;
+				halves[half][n++] = i;
+				if (block.rgba[i][3] != 0) {
+					for (int c = 0; c < 3; c++)
+						sums[c] += block.rgba[i][c];
+					weight++;
+				}
+			}
+			for (int c = 0; c < 3; c++)
+				averages[half][c] = weight? (sums[c] + weight / 2) / weight : 0;
+		}
+
+		for (int differential = 0; differential < 2; differential++) {
+			int quantized[2][3];
+			int base[2][3];
+			bool fits = true;
+			for (int half = 0; half < 2; half++) {
+				for (int c = 0; c < 3; c++) {
+					if (differential) {
+						quantized[half][c] = (averages[half][c] * 31 + 127) / 255;
+						base[half][c] = quantized[half][c] << 3 | quantized[half][c] >> 2;
+					} else {
+						quantized[half][c] = (averages[half][c] * 15 + 127) / 255;
+						base[half][c] = quantized[half][c] * 17;
+					}
+				}
+			}
+			for (int c = 0; differential && c < 3; c++) {
+				int delta = quantized[1][c] - quantized[0][c];
+				fits = fits && delta >= -4 && delta <= 3;
+			}
+			if (!fits)
+				continue;
+
+			int tables[2];
+			int codes[2][8];
+			int error = 0;
+			for (int half = 0; half < 2; half++)
+				error += fit_etc_half(block, halves[half], base[half], tables[half], codes[half]);
+			if (error >= best_error)
+				continue;
+
+			uint64_t bits = 0;
+			for (int c = 0; c < 3; c++) {
+				int shift = 59 - 8 * c;
+				if (differential)
+					bits |= (uint64_t) quantized[0][c] << shift | (uint64_t) ((quantized[1][c] - quantized[0][c]) & 7) << (shift - 3);
+				else
+					bits |= (uint64_t) quantized[0][c] << (shift + 1) | (uint64_t) quantized[1][c] << (shift - 3);
+			}
+			bits |= (uint64_t) tables[0] << 37 | (uint64_t) tables[1] << 34;
+			bits |= (uint64_t) differential << 33 | (uint64_t) flip << 32;
+			for (int half = 0; half < 2; half++) {
+				for (int n = 0; n < 8; n++) {
+					int i = halves[half][n];
+					// pixels go column by column; the code's high bit sits 16 bits above its low bit
+					int position = (i & 3) * 4 + (i >> 2);
+					bits |= (uint64_t) (codes[half][n] >> 1) << (16 + position) | (uint64_t) (codes[half][n] & 1) << position;
+				}
+			}
+			best_error = error;
+			best_bits = bits;
+		}
+	}
+
+	store_be64(best_bits, out);
+}
+
+static void encode_etc2_rgba(const pixel_block & block, uint8_t * out)
+{
+	encode_eac_alpha(block, out);
+	encode_etc_color(block, out + 8);
+}
+
+static void store_le16(std::vector<unsigned char> & out, uint32_t value)
+{
+	out.push_back((unsigned char) value);
+	out.push_back((unsigned char) (value >> 8));
+}
+
+static void store_le32(std::vector<unsigned char> & out, uint32_t value)
+{
+	store_le16(out, value & 0xffff);
+	store_le16(out, value >> 16);
+}
+
+bool psd_stex_encode(const unsigned char * rgba, int width, int height, int format, int threads, std::vector<unsigned char> & stex)
+{
+	stex.clear();
+	if (rgba == NULL || width <= 0 || height <= 0 || width > 0xffff || height > 0xffff)
+		return false;
+
+	void (* encode_block)(const pixel_block &, uint8_t *);
+	uint32_t image_format;
+	switch (format) {
+	case psd_texture_dxt5:
+		encode_block = encode_bc3;
+		image_format = image_format_dxt5;
+		break;
+	case psd_texture_etc2:
+		encode_block = encode_etc2_rgba;
+		image_format = image_format_etc2_rgba8;
+		break;
+	default:
+		return false;
+	}
+
+	// the header StreamTexture::_load_data reads for textures stored
+	// as-is: no size override, no mipmaps, not streamed
+	stex.push_back('G');
+	stex.push_back('D');
+	stex.push_back('S');
+	stex.push_back('T');
+	store_le16(stex, width);
+	store_le16(stex, 0);
+	store_le16(stex, height);
+	store_le16(stex, 0);
+	store_le32(stex, texture_flag_filter);
+	store_le32(stex, image_format);
+
+	int blocks_x = (width + 3) / 4;
+	int blocks_y = (height + 3) / 4;
+	size_t header_size = stex.size();
+	size_t row_size = (size_t) blocks_x * 16;
+	stex.resize(header_size + row_size * blocks_y);
+	unsigned char * data = stex.data() + header_size;
+
+	std::atomic<int> next_row(0);
+	auto worker = [&]() {
+		pixel_block block;
+		for (int by = next_row++; by < blocks_y; by = next_row++) {
+			for (int bx = 0; bx < blocks_x; bx++) {
+				fetch_block(rgba, width, height, bx, by, block);
+				encode_block(block, data + by * row_size + bx * 16);
+			}
+		}
+	};
+
+	size_t n_threads = threads > 0? threads : std::thread::hardware_concurrency();
+	if (n_threads == 0)
+		n_threads = 1;
+	if (n_threads > (size_t) blocks_y)
+		n_threads = blocks_y;
+	if (n_threads <= 1) {
+		worker();
+		return true;
+	}
+
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < n_threads; i++)
+		workers.push_back(std::thread(worker));
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+	return true;
+}
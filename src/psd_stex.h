@@ -0,0 +1,12 @@
+#ifndef PSD_STEX_H
+#define PSD_STEX_H
+
+#include <string>
+#include <vector>
+
+// Encodes width x height RGBA8 pixels as a Godot 3 StreamTexture in one of
+// the VRAM psd_texture_format formats from psd_parser.h. Rows of 4x4 blocks
+// are spread over threads; 0 means one per hardware thread.
+bool psd_stex_encode(const unsigned char * rgba, int width, int height, int format, int threads, std::vector<unsigned char> & stex);
+
+#endif // PSD_STEX_H
@@ -24,12 +24,21 @@
 
 #include <gdnative_api_struct.gen.h>
 #include "psd_importer.h"
+#include "psd_parser.h"
 
 const godot_gdnative_core_api_struct *api = NULL;
 const godot_gdnative_ext_nativescript_api_struct *nativescript_api = NULL;
 
 static GDCALLINGCONV godot_variant get_version(godot_object *p_instance, void *p_method_data, void *p_user_data, int p_num_args, godot_variant **p_args);
 
+static void * _psd_godot_alloc(size_t size) {
+	return api->godot_alloc((int) size);
+}
+
+static void _psd_godot_free(void * ptr) {
+	api->godot_free(ptr);
+}
+
 void GDN_EXPORT godot_gdnative_init(godot_gdnative_init_options *p_options) {
 	api = p_options->api_struct;
 
@@ -43,9 +52,14 @@ void GDN_EXPORT godot_gdnative_init(godot_gdnative_init_options *p_options) {
 			break;
 		};
 	};	
+
+	struct psd_allocator allocator = { _psd_godot_alloc, _psd_godot_free };
+	psd_parser_set_allocator(&allocator);
 }
 
 void GDN_EXPORT godot_gdnative_terminate(godot_gdnative_terminate_options *p_options) {
+	psd_cache_clear();
+	psd_parser_set_allocator(NULL);
 	api = NULL;
 	nativescript_api = NULL;
 }
@@ -71,6 +85,17 @@ void GDN_EXPORT godot_nativescript_init(void *p_handle) {
 		{godot_psdimporter.extract_psd, "extract_psd"},
 		{godot_psdimporter.is_sprite_frames, "is_sprite_frames"},
 		{godot_psdimporter.get_sprite_frame_names, "get_sprite_frame_names"},
+		{godot_psdimporter.pack_atlas, "pack_atlas"},
+		{godot_psdimporter.get_layer_images, "get_layer_images"},
+		{godot_psdimporter.get_import_stats, "get_import_stats"},
+		{godot_psdimporter.configure_cache, "configure_cache"},
+		{godot_psdimporter.extract_psd_async, "extract_psd_async"},
+		{godot_psdimporter.poll_extract, "poll_extract"},
+		{godot_psdimporter.cancel_extract, "cancel_extract"},
+		{godot_psdimporter.finish_extract, "finish_extract"},
+		{godot_psdimporter.load_composite, "load_composite"},
+		{godot_psdimporter.build_sprite_frames, "build_sprite_frames"},
+		{godot_psdimporter.composite_group, "composite_group"},
 	};
 
 	godot_instance_method method_struct = { NULL, NULL, NULL };